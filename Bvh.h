@@ -0,0 +1,489 @@
+#ifndef BVH_H
+#define BVH_H
+
+/*---------------------------------------------------------------------------*/
+/* INCLUDES */
+#include <vector>
+#include <chrono>
+#include "Objects.h"
+#include "SceneArray.h"
+
+/*---------------------------------------------------------------------------*/
+/*  VARIABLES */
+const unsigned int BVH_NUM_BINS = 16; // buckets the centroids are sorted into when looking for a split
+const unsigned int BVH_MAX_LEAF_SIZE = 4; // never stop splitting above this many primitives
+const Real BVH_TRAVERSAL_COST = 1.0; // cost of visiting a node relative to one primitive test
+const unsigned int BVH_STACK_SIZE = 64; // deepest a traversal can go
+
+/*---------------------------------------------------------------------------*/
+/* CLASS DEFINITIONS */
+/*
+ PURPOSE: axis aligned bounding box
+ REMARK: kept as plain arrays rather than Points since the traversal loops over the axes
+ */
+struct Aabb
+{
+   Real lo[3];
+   Real hi[3];
+
+   Aabb()
+   {
+      reset();
+   }
+
+   Aabb(const Point& l, const Point& h)
+   {
+      lo[0] = l.x();
+      lo[1] = l.y();
+      lo[2] = l.z();
+      hi[0] = h.x();
+      hi[1] = h.y();
+      hi[2] = h.z();
+   }
+
+   // an empty box: growing it by anything gives that thing
+   void reset()
+   {
+      for (int a = 0; a < 3; a++)
+      {
+         lo[a] = HUGE_VAL;
+         hi[a] = -HUGE_VAL;
+      }
+   }
+
+   void grow(const Aabb& b)
+   {
+      for (int a = 0; a < 3; a++)
+      {
+         lo[a] = min(lo[a], b.lo[a]);
+         hi[a] = max(hi[a], b.hi[a]);
+      }
+   }
+
+   void grow(const Real p[3])
+   {
+      for (int a = 0; a < 3; a++)
+      {
+         lo[a] = min(lo[a], p[a]);
+         hi[a] = max(hi[a], p[a]);
+      }
+   }
+
+   bool overlaps(const Aabb& b) const
+   {
+      for (int a = 0; a < 3; a++)
+         if (lo[a] > b.hi[a] || b.lo[a] > hi[a])
+            return false;
+      return true;
+   }
+
+   Real centroid(int axis) const
+   {
+      return .5 * (lo[axis] + hi[axis]);
+   }
+
+   // half the surface area, which is all the SAH needs since only ratios matter
+   Real halfArea() const
+   {
+      Real dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+      if (dx < 0 || dy < 0 || dz < 0)
+         return 0;
+      return dx * dy + dy * dz + dz * dx;
+   }
+};
+
+/*
+ PURPOSE: node of a bounding volume hierarchy
+ REMARK: when count > 0 the node is a leaf over indices [first, first + count) of the
+ Bvh's index list, otherwise first is the index of its left child and the right child
+ directly follows it
+ */
+struct BvhNode
+{
+   Aabb box;
+   unsigned int first;
+   unsigned int count;
+};
+
+/*
+ PURPOSE: precomputed form of a ray for fast box tests
+ REMARK: direction is normalized so box distances and hit distances can be compared
+ */
+struct BvhRay
+{
+   Real origin[3];
+   Real invDir[3];
+   int dirNegative[3];
+
+   BvhRay(const Line& ray)
+   {
+      set(ray.startPoint(), ray.direction());
+   }
+
+   // the ray from o in the normalized direction d
+   BvhRay(const Point& o, const Point& d)
+   {
+      set(o, d);
+   }
+
+   void set(const Point& o, const Point& d)
+   {
+      Real dir[3] = { d.x(), d.y(), d.z() };
+      origin[0] = o.x();
+      origin[1] = o.y();
+      origin[2] = o.z();
+      for (int a = 0; a < 3; a++)
+      {
+         invDir[a] = 1.0 / dir[a];
+         dirNegative[a] = dir[a] < 0;
+      }
+   }
+
+   /*
+    PURPOSE: slab test of this ray against a box
+    RECEIVES:
+    box -- box to test
+    tMax -- only count hits closer than this
+    tEnter -- set to the distance at which the ray enters the box
+    RETURNS: true if the ray passes through the box in [0, tMax]
+    REMARKS:
+    */
+   bool hits(const Aabb& box, Real tMax, Real& tEnter) const
+   {
+      COUNT(bvhNodes, 1);
+      Real t0 = 0.0, t1 = tMax;
+      for (int a = 0; a < 3; a++)
+      {
+         Real tNear = ((dirNegative[a] ? box.hi[a] : box.lo[a]) - origin[a]) * invDir[a];
+         Real tFar = ((dirNegative[a] ? box.lo[a] : box.hi[a]) - origin[a]) * invDir[a];
+         if (tNear > t0)
+            t0 = tNear;
+         if (tFar < t1)
+            t1 = tFar;
+      }
+      tEnter = t0;
+      COUNTING(if (t0 > t1) COUNT(bvhRejections, 1));
+      return t0 <= t1;
+   }
+};
+
+/*
+ PURPOSE: bounding volume hierarchy built with the surface area heuristic
+ REMARK:
+ The Bvh only knows about boxes; what is inside them is up to whoever built it, who gets
+ called back with primitive indices during traversal. Splits are found by binning the
+ primitive centroids along each axis and picking the plane with the least
+ area-weighted cost.
+ */
+class Bvh
+{
+private:
+   SceneArray<BvhNode> _nodes;
+   SceneArray<unsigned int> _indices;
+   vector<Real> _centroids; // only alive during build
+   double _buildMillis;
+
+   friend class SceneCache;
+
+   struct Bin
+   {
+      Aabb box;
+      unsigned int count;
+   };
+
+   /*
+    PURPOSE: sets up the box of a node and splits it if that is cheaper than not to
+    RECEIVES:
+    nodeIndex -- node to finish
+    bounds -- boxes of all primitives
+    depth -- how deep in the tree the node is
+    RETURNS: nothing
+    REMARKS: nodes deep enough to overflow the traversal stack are left as leaves
+    */
+   void subdivide(unsigned int nodeIndex, const vector<Aabb>& bounds,
+         unsigned int depth)
+   {
+      BvhNode& node = _nodes[nodeIndex];
+      Aabb centroidBox;
+      node.box.reset();
+      for (unsigned int i = node.first; i < node.first + node.count; i++)
+      {
+         node.box.grow(bounds[_indices[i]]);
+         centroidBox.grow(&_centroids[3 * _indices[i]]);
+      }
+
+      if (node.count <= 1 || depth + 2 >= BVH_STACK_SIZE)
+         return;
+
+      // find the cheapest binned split over all three axes
+      Real bestCost = HUGE_VAL;
+      int bestAxis = -1;
+      unsigned int bestBin = 0;
+      for (int a = 0; a < 3; a++)
+      {
+         Real extent = centroidBox.hi[a] - centroidBox.lo[a];
+         if (extent <= 0)
+            continue;
+         Real scale = BVH_NUM_BINS / extent;
+
+         Bin bins[BVH_NUM_BINS];
+         for (unsigned int b = 0; b < BVH_NUM_BINS; b++)
+            bins[b].count = 0;
+         for (unsigned int i = node.first; i < node.first + node.count; i++)
+         {
+            unsigned int prim = _indices[i];
+            unsigned int b = min(BVH_NUM_BINS - 1,
+                  (unsigned int) ((_centroids[3 * prim + a] - centroidBox.lo[a]) * scale));
+            bins[b].count++;
+            bins[b].box.grow(bounds[prim]);
+         }
+
+         // sweep from the right to get the cost of every right hand side, then from the left
+         Real rightArea[BVH_NUM_BINS];
+         unsigned int rightCount[BVH_NUM_BINS];
+         Aabb box;
+         unsigned int count = 0;
+         for (unsigned int b = BVH_NUM_BINS - 1; b > 0; b--)
+         {
+            box.grow(bins[b].box);
+            count += bins[b].count;
+            rightArea[b] = box.halfArea();
+            rightCount[b] = count;
+         }
+         box.reset();
+         count = 0;
+         for (unsigned int b = 0; b < BVH_NUM_BINS - 1; b++)
+         {
+            box.grow(bins[b].box);
+            count += bins[b].count;
+            if (count == 0 || rightCount[b + 1] == 0)
+               continue;
+            Real cost = count * box.halfArea()
+                  + rightCount[b + 1] * rightArea[b + 1];
+            if (cost < bestCost)
+            {
+               bestCost = cost;
+               bestAxis = a;
+               bestBin = b;
+            }
+         }
+      }
+
+      Real leafCost = node.count * node.box.halfArea();
+      bestCost = BVH_TRAVERSAL_COST * node.box.halfArea() + bestCost;
+
+      unsigned int mid;
+      if (bestAxis >= 0 && (bestCost < leafCost || node.count > BVH_MAX_LEAF_SIZE))
+      {
+         Real scale = BVH_NUM_BINS
+               / (centroidBox.hi[bestAxis] - centroidBox.lo[bestAxis]);
+         unsigned int *begin = &_indices[node.first];
+         unsigned int *end = begin + node.count;
+         unsigned int *split = partition(begin, end, [&](unsigned int prim)
+         {
+            return min(BVH_NUM_BINS - 1, (unsigned int) ((_centroids[3 * prim + bestAxis]
+                  - centroidBox.lo[bestAxis]) * scale)) <= bestBin;
+         });
+         mid = split - &_indices[0];
+      }
+      else if (node.count > BVH_MAX_LEAF_SIZE)
+      {
+         // all centroids coincide so no plane separates them: just halve the list
+         mid = node.first + node.count / 2;
+      }
+      else
+      {
+         return;
+      }
+
+      unsigned int first = node.first;
+      unsigned int count = node.count;
+      unsigned int left = _nodes.size();
+      node.first = left;
+      node.count = 0; // node is a reference into _nodes so don't use it after the resize
+
+      _nodes.resize(left + 2);
+      _nodes[left].first = first;
+      _nodes[left].count = mid - first;
+      _nodes[left + 1].first = mid;
+      _nodes[left + 1].count = first + count - mid;
+      subdivide(left, bounds, depth + 1);
+      subdivide(left + 1, bounds, depth + 1);
+   }
+
+public:
+   Bvh()
+   {
+      _buildMillis = 0;
+   }
+
+   /*
+    PURPOSE: builds the hierarchy over the given boxes
+    RECEIVES: bounds -- one box per primitive; primitive i is reported back as index i
+    RETURNS: nothing
+    REMARKS: replaces whatever hierarchy was there before
+    */
+   void build(const vector<Aabb>& bounds)
+   {
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+      _nodes.clear();
+      _indices.clear();
+      _indices.resize(bounds.size());
+      _centroids.resize(3 * bounds.size());
+      for (unsigned int i = 0; i < bounds.size(); i++)
+      {
+         _indices[i] = i;
+         for (int a = 0; a < 3; a++)
+            _centroids[3 * i + a] = bounds[i].centroid(a);
+      }
+
+      if (!bounds.empty())
+      {
+         _nodes.reserve(2 * bounds.size());
+         _nodes.resize(1);
+         _nodes[0].first = 0;
+         _nodes[0].count = bounds.size();
+         subdivide(0, bounds, 0);
+      }
+      vector<Real>().swap(_centroids);
+
+      _buildMillis = chrono::duration<double, milli>(
+            chrono::steady_clock::now() - start).count();
+   }
+
+   size_t nodeCount() const
+   {
+      return _nodes.size();
+   }
+   const SceneArray<BvhNode>& nodes() const
+   {
+      return _nodes;
+   }
+   const SceneArray<unsigned int>& indices() const
+   {
+      return _indices;
+   }
+   double buildMillis() const
+   {
+      return _buildMillis;
+   }
+
+   /*
+    PURPOSE: finds the closest primitive hit by a ray
+    RECEIVES:
+    ray -- ray to trace
+    closest -- distance of the closest hit so far, updated by test
+    test -- called as test(first, count, closest) for every leaf the ray reaches, with
+    the leaf's range of indices(); should lower closest if it finds a nearer hit
+    RETURNS: nothing
+    REMARKS: the nearer child is always visited first and nodes starting beyond the
+    closest hit are skipped, so once a close hit is found most of the tree is culled.
+    Leaves are handed over whole so their primitives can be tested as a batch.
+    */
+   template<class LeafTest>
+   void closestHit(const BvhRay& ray, Real& closest, LeafTest test) const
+   {
+      if (!_nodes.empty())
+         closestHit(_nodes.data(), 0, ray, closest, test);
+   }
+
+   /*
+    PURPOSE: closestHit through any tree laid out like a Bvh's nodes
+    RECEIVES:
+    nodes -- array holding the tree
+    root -- index of its root in nodes
+    ray, closest, test -- as for closestHit
+    RETURNS: nothing
+    REMARKS: lets several trees share one array, such as the Bvhs of instanced
+    prototypes; child and leaf indices are whatever the tree's builder made them
+    */
+   template<class LeafTest>
+   static void closestHit(const BvhNode *nodes, unsigned int root, const BvhRay& ray,
+         Real& closest, LeafTest test)
+   {
+      unsigned int stack[BVH_STACK_SIZE];
+      unsigned int top = 0;
+      Real tEnter;
+      if (!ray.hits(nodes[root].box, closest, tEnter))
+         return;
+      stack[top++] = root;
+
+      while (top > 0)
+      {
+         const BvhNode& node = nodes[stack[--top]];
+         if (node.count > 0)
+         {
+            test(node.first, node.count, closest);
+            continue;
+         }
+
+         Real tLeft, tRight;
+         bool hitLeft = ray.hits(nodes[node.first].box, closest, tLeft);
+         bool hitRight = ray.hits(nodes[node.first + 1].box, closest, tRight);
+         if (hitLeft && hitRight)
+         {
+            // push the far child first so the near one is popped next
+            if (tLeft <= tRight)
+            {
+               stack[top++] = node.first + 1;
+               stack[top++] = node.first;
+            }
+            else
+            {
+               stack[top++] = node.first;
+               stack[top++] = node.first + 1;
+            }
+         }
+         else if (hitLeft)
+            stack[top++] = node.first;
+         else if (hitRight)
+            stack[top++] = node.first + 1;
+      }
+   }
+
+   /*
+    PURPOSE: finds out whether a ray hits anything at all within a given distance
+    RECEIVES:
+    ray -- ray to trace
+    maxDistance -- leaves starting beyond this distance are skipped
+    test -- called as test(first, count) for every leaf the ray reaches, with the leaf's
+    range of indices(); returns true if the ray hits something in it that counts
+    RETURNS: true as soon as a call to test does
+    REMARKS: for shadow rays, where any blocker will do, so children aren't ordered
+    */
+   template<class LeafTest>
+   bool anyHit(const BvhRay& ray, Real maxDistance, LeafTest test) const
+   {
+      return !_nodes.empty() && anyHit(_nodes.data(), 0, ray, maxDistance, test);
+   }
+
+   // anyHit through any tree laid out like a Bvh's nodes, see the static closestHit
+   template<class LeafTest>
+   static bool anyHit(const BvhNode *nodes, unsigned int root, const BvhRay& ray,
+         Real maxDistance, LeafTest test)
+   {
+      unsigned int stack[BVH_STACK_SIZE];
+      unsigned int top = 0;
+      Real tEnter;
+      stack[top++] = root;
+
+      while (top > 0)
+      {
+         const BvhNode& node = nodes[stack[--top]];
+         if (!ray.hits(node.box, maxDistance, tEnter))
+            continue;
+         if (node.count > 0)
+         {
+            if (test(node.first, node.count))
+               return true;
+            continue;
+         }
+         stack[top++] = node.first + 1;
+         stack[top++] = node.first;
+      }
+      return false;
+   }
+};
+
+#endif
@@ -0,0 +1,1656 @@
+#ifndef COMPILEDSCENE_H
+#define COMPILEDSCENE_H
+
+/*---------------------------------------------------------------------------*/
+/* INCLUDES */
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include "Objects.h"
+#include "Bvh.h"
+#include "Sampler.h"
+
+/*---------------------------------------------------------------------------*/
+/*  VARIABLES */
+// a primitive id keeps the kind of primitive in its top bits and the index into
+// the arrays for that kind in the rest. Boards aren't in the Bvh, see CompiledScene.
+enum PrimitiveType
+{
+   TRIANGLE_PRIMITIVE = 0, SPHERE_PRIMITIVE = 1, INSTANCE_PRIMITIVE = 2, BOX_PRIMITIVE = 3,
+   CONE_PRIMITIVE = 4, BOARD_PRIMITIVE = 5
+};
+const unsigned int PRIMITIVE_TYPE_SHIFT = 28;
+const unsigned int PRIMITIVE_INDEX_MASK = (1u << PRIMITIVE_TYPE_SHIFT) - 1;
+const unsigned int NO_PRIMITIVE = ~0u; // primitive of a Hit for a ray which hit nothing
+const unsigned int NO_PROTOTYPE = ~0u; // what findPrototype returns for an unknown name
+
+// past this many separate boxes a compile's changes are summed up as one box around them
+const size_t MAX_CHANGED_BOUNDS = 16;
+
+// whether a primitive stops light, see CompiledScene::shadowKinds
+enum ShadowKind
+{
+   CASTS_NO_SHADOW = 0, CASTS_SHADOW = 1
+};
+
+// how many triangles one ray is tested against at once: one per float lane of the
+// widest vector unit the compiler is allowed to use
+#if defined(__AVX512F__)
+const unsigned int TRIANGLE_BATCH_WIDTH = 16;
+#elif defined(__AVX__)
+const unsigned int TRIANGLE_BATCH_WIDTH = 8;
+#else
+const unsigned int TRIANGLE_BATCH_WIDTH = 4;
+#endif
+
+inline unsigned int primitiveId(PrimitiveType type, unsigned int index)
+{
+   return (unsigned int) type << PRIMITIVE_TYPE_SHIFT | index;
+}
+
+inline PrimitiveType primitiveType(unsigned int id)
+{
+   return (PrimitiveType) (id >> PRIMITIVE_TYPE_SHIFT);
+}
+
+/*---------------------------------------------------------------------------*/
+/* CLASS DEFINITIONS */
+/*
+ PURPOSE: all triangles of a scene, one array per field
+ REMARK: vertices are in scene coordinates. u and v are the edges from vertex 0 and
+ n the unit normal; uu, uv, vv and denominator are the dot products the barycentric
+ test needs, all as in Triangle. minDeterminant is what the Moller-Trumbore
+ determinant has to reach for a ray not to count as parallel to the triangle.
+ Degenerate triangles are never added. The float arrays used by the batch kernel are
+ padded with TRIANGLE_BATCH_WIDTH extra entries so a batch can always load a full
+ vector, even at the end.
+ */
+struct TriangleArrays
+{
+   SceneArray<float> v0[3];
+   SceneArray<float> u[3];
+   SceneArray<float> v[3];
+   SceneArray<float> n[3];
+   SceneArray<float> uu, uv, vv, denominator;
+   SceneArray<float> minDeterminant;
+   SceneArray<unsigned int> material;
+
+   size_t size() const
+   {
+      return material.size();
+   }
+
+   // appends triangle i of another set of arrays
+   void append(const TriangleArrays& from, unsigned int i)
+   {
+      for (int a = 0; a < 3; a++)
+      {
+         v0[a].push_back(from.v0[a][i]);
+         u[a].push_back(from.u[a][i]);
+         v[a].push_back(from.v[a][i]);
+         n[a].push_back(from.n[a][i]);
+      }
+      uu.push_back(from.uu[i]);
+      uv.push_back(from.uv[i]);
+      vv.push_back(from.vv[i]);
+      denominator.push_back(from.denominator[i]);
+      minDeterminant.push_back(from.minDeterminant[i]);
+      material.push_back(from.material[i]);
+   }
+
+   // adds the padding the batch kernel needs after the last triangle
+   void pad()
+   {
+      for (int a = 0; a < 3; a++)
+      {
+         v0[a].resize(size() + TRIANGLE_BATCH_WIDTH, 0.0f);
+         u[a].resize(size() + TRIANGLE_BATCH_WIDTH, 0.0f);
+         v[a].resize(size() + TRIANGLE_BATCH_WIDTH, 0.0f);
+      }
+      minDeterminant.resize(size() + TRIANGLE_BATCH_WIDTH, 0.0f);
+   }
+};
+
+/*
+ PURPOSE: what intersecting a ray with the scene finds out: just enough to shade it later
+ REMARK: b1 and b2 are the barycentric coordinates of the hit on a triangle, i.e. the hit
+ point is v0 + b1 u + b2 v; they are 0 for other primitives. For an instance, element
+ is which triangle of its prototype was hit, for a capped cone which ConePart and for a
+ board 1 on a black square and 0 on a white one. Normal, material, reflected and
+ transmitted rays are only worked out by CompiledScene::shade once the closest hit of a
+ ray is known.
+ */
+struct Hit
+{
+   Real distance;
+   unsigned int primitive;
+   unsigned int element;
+   float b1, b2;
+
+   Hit()
+   {
+      distance = HUGE_VAL;
+      primitive = NO_PRIMITIVE;
+      element = 0;
+      b1 = b2 = 0.0f;
+   }
+};
+
+// where a ray hits a batch of triangles; distance is HUGE_VALF for the ones it misses
+struct TriangleBatchHits
+{
+   float distance[TRIANGLE_BATCH_WIDTH];
+   float b1[TRIANGLE_BATCH_WIDTH];
+   float b2[TRIANGLE_BATCH_WIDTH];
+};
+
+/*
+ PURPOSE: tests one ray against TRIANGLE_BATCH_WIDTH consecutive triangles
+ RECEIVES:
+ t -- the scene's triangles
+ base -- first triangle of the batch
+ end -- triangles from here on are past the run being tested and never hit
+ o -- start of the ray
+ d -- normalized direction of the ray
+ nearest -- hits closer than this don't count; SMALL_NUMBER keeps rays leaving a
+ surface from hitting it again
+ RETURNS: where the ray hits each of the triangles
+ REMARKS:
+ Moller-Trumbore: with edges e1 = u and e2 = v precomputed, the barycentric coordinates
+ and the distance fall out of two cross products and a handful of dot products, without
+ ever computing the hit point. The loop runs over a fixed number of lanes with no
+ branches and writes to a local result, nothing that could alias the arrays, so the
+ compiler turns it into one vector instruction per step, one triangle per lane. As in
+ Triangle::doIIntersectWith, rays (nearly) parallel to a triangle don't hit it:
+ |n . d| < SMALL_NUMBER, i.e. |det| < SMALL_NUMBER * |e1 x e2|.
+ */
+inline TriangleBatchHits triangleBatchDistances(const TriangleArrays& t,
+      unsigned int base, unsigned int end, const float o[3], const float d[3],
+      float nearest = SMALL_NUMBER)
+{
+   TriangleBatchHits hits;
+   const float *v0x = &t.v0[0][0], *v0y = &t.v0[1][0], *v0z = &t.v0[2][0];
+   const float *e1x = &t.u[0][0], *e1y = &t.u[1][0], *e1z = &t.u[2][0];
+   const float *e2x = &t.v[0][0], *e2y = &t.v[1][0], *e2z = &t.v[2][0];
+   const float *minDet = &t.minDeterminant[0];
+
+   for (unsigned int l = 0; l < TRIANGLE_BATCH_WIDTH; l++)
+   {
+      unsigned int i = base + l;
+      float px = d[1] * e2z[i] - d[2] * e2y[i];
+      float py = d[2] * e2x[i] - d[0] * e2z[i];
+      float pz = d[0] * e2y[i] - d[1] * e2x[i];
+      float det = e1x[i] * px + e1y[i] * py + e1z[i] * pz;
+      float invDet = 1.0f / det;
+
+      float tx = o[0] - v0x[i], ty = o[1] - v0y[i], tz = o[2] - v0z[i];
+      float b1 = (tx * px + ty * py + tz * pz) * invDet;
+
+      float qx = ty * e1z[i] - tz * e1y[i];
+      float qy = tz * e1x[i] - tx * e1z[i];
+      float qz = tx * e1y[i] - ty * e1x[i];
+      float b2 = (d[0] * qx + d[1] * qy + d[2] * qz) * invDet;
+      float distance = (e2x[i] * qx + e2y[i] * qy + e2z[i] * qz) * invDet;
+
+      // & rather than && keeps the lane loop free of branches
+      bool valid = (i < end) & (fabsf(det) >= minDet[i])
+            & (b1 >= 0.0f) & (b2 >= 0.0f) & (b1 + b2 <= 1.0f)
+            & (distance >= nearest);
+      hits.distance[l] = valid ? distance : HUGE_VALF;
+      hits.b1[l] = b1;
+      hits.b2[l] = b2;
+   }
+   return hits;
+}
+
+/*
+ PURPOSE: finds the closest of a run of consecutive triangles hit by a ray
+ RECEIVES:
+ t -- the scene's triangles
+ first, count -- the run of triangles to test
+ o -- start of the ray
+ d -- normalized direction of the ray
+ hit -- closest hit so far; replaced if one of the triangles is closer
+ nearest -- as for triangleBatchDistances
+ RETURNS: nothing
+ REMARKS: the triangles are tested TRIANGLE_BATCH_WIDTH at a time by triangleBatchDistances
+ */
+inline void intersectTriangleBatch(const TriangleArrays& t, unsigned int first,
+      unsigned int count, const float o[3], const float d[3], Hit& hit,
+      float nearest = SMALL_NUMBER)
+{
+   COUNT(triangleTests, count);
+   for (unsigned int base = first; base < first + count; base += TRIANGLE_BATCH_WIDTH)
+   {
+      TriangleBatchHits hits = triangleBatchDistances(t, base, first + count, o, d, nearest);
+
+      for (unsigned int l = 0; l < TRIANGLE_BATCH_WIDTH; l++)
+      {
+         COUNTING(if (hits.distance[l] != HUGE_VALF) COUNT(triangleHits, 1));
+         if (hits.distance[l] < hit.distance)
+         {
+            hit.distance = hits.distance[l];
+            hit.primitive = primitiveId(TRIANGLE_PRIMITIVE, base + l);
+            hit.b1 = hits.b1[l];
+            hit.b2 = hits.b2[l];
+         }
+      }
+   }
+}
+
+/*
+ PURPOSE: all spheres of a scene, one array per field
+ */
+struct SphereArrays
+{
+   SceneArray<float> center[3];
+   SceneArray<float> radius;
+   SceneArray<unsigned int> material;
+
+   size_t size() const
+   {
+      return material.size();
+   }
+
+   // appends sphere i of another set of arrays
+   void append(const SphereArrays& from, unsigned int i)
+   {
+      for (int a = 0; a < 3; a++)
+         center[a].push_back(from.center[a][i]);
+      radius.push_back(from.radius[i]);
+      material.push_back(from.material[i]);
+   }
+};
+
+/*
+ PURPOSE: all axis aligned boxes of a scene, such as cubes, one array per field
+ */
+struct BoxArrays
+{
+   SceneArray<float> lo[3], hi[3];
+   SceneArray<unsigned int> material;
+
+   size_t size() const
+   {
+      return material.size();
+   }
+
+   // appends box i of another set of arrays
+   void append(const BoxArrays& from, unsigned int i)
+   {
+      for (int a = 0; a < 3; a++)
+      {
+         lo[a].push_back(from.lo[a][i]);
+         hi[a].push_back(from.hi[a][i]);
+      }
+      material.push_back(from.material[i]);
+   }
+};
+
+/*
+ PURPOSE: all capped cones of a scene, cylinders included, one array per field
+ REMARK: base is the centre of the bottom disc; see cappedConeDistance
+ */
+struct ConeArrays
+{
+   SceneArray<float> base[3];
+   SceneArray<float> height;
+   SceneArray<float> bottomRadius, topRadius;
+   SceneArray<unsigned int> material;
+
+   size_t size() const
+   {
+      return material.size();
+   }
+
+   // appends cone i of another set of arrays
+   void append(const ConeArrays& from, unsigned int i)
+   {
+      for (int a = 0; a < 3; a++)
+         base[a].push_back(from.base[a][i]);
+      height.push_back(from.height[i]);
+      bottomRadius.push_back(from.bottomRadius[i]);
+      topRadius.push_back(from.topRadius[i]);
+      material.push_back(from.material[i]);
+   }
+};
+
+/*
+ PURPOSE: checkerboards of a scene, one array per field
+ REMARK: a board lies flat at the given height, edgeSize wide and deep from its corner
+ (originX, originZ). The squares are laid out from that corner in steps of squareSize;
+ a hit gets whiteMaterial when the sum of its square coordinates is even, else
+ blackMaterial. See boardDistance.
+ */
+struct BoardArrays
+{
+   SceneArray<float> originX, originZ;
+   SceneArray<float> height;
+   SceneArray<float> edgeSize;
+   SceneArray<float> squareSize;
+   SceneArray<unsigned int> whiteMaterial, blackMaterial;
+
+   size_t size() const
+   {
+      return whiteMaterial.size();
+   }
+};
+
+/*
+ PURPOSE: placed copies of prototype meshes, one array per field
+ REMARK: an instance of a prototype is its mesh scaled by scale about the origin and
+ moved to position, made of material whatever the prototype's triangles say. Only
+ uniform scaling is allowed, so a normalized ray direction stays normalized in the
+ prototype's space and distances there are just distances in the scene over scale.
+ */
+struct InstanceArrays
+{
+   SceneArray<float> position[3];
+   SceneArray<float> scale;
+   SceneArray<unsigned int> prototype;
+   SceneArray<unsigned int> material;
+
+   size_t size() const
+   {
+      return material.size();
+   }
+
+   // appends instance i of another set of arrays
+   void append(const InstanceArrays& from, unsigned int i)
+   {
+      for (int a = 0; a < 3; a++)
+         position[a].push_back(from.position[a][i]);
+      scale.push_back(from.scale[i]);
+      prototype.push_back(from.prototype[i]);
+      material.push_back(from.material[i]);
+   }
+};
+
+/*
+ PURPOSE: the meshes instances are made from
+ REMARK: every prototype is stored once however many instances it has: its triangles
+ in its own space, and a Bvh over them. The triangles and trees of all prototypes share
+ one set of arrays; within nodes, leaves index triangles and inner nodes index nodes,
+ both counted from the start of the shared arrays, and root says where each
+ prototype's tree starts.
+ */
+struct PrototypeArrays
+{
+   TriangleArrays triangles;
+   SceneArray<BvhNode> nodes;
+   SceneArray<unsigned int> root;
+
+   size_t size() const
+   {
+      return root.size();
+   }
+};
+
+/*
+ PURPOSE: what one primitive looks like, used to tell which primitives changed between
+ two compiles of a scene
+ REMARK: hash covers everything that decides how the primitive looks: its geometry and
+ its material, or for a board the materials of both kinds of square
+ */
+struct PrimitiveSignature
+{
+   uint64_t hash;
+   Aabb box;
+};
+
+inline bool signatureLess(const PrimitiveSignature& a, const PrimitiveSignature& b)
+{
+   return a.hash < b.hash;
+}
+
+// folds a float into a running hash
+inline uint64_t hashFloat(uint64_t h, float f)
+{
+   uint32_t bits;
+   memcpy(&bits, &f, sizeof(bits));
+   return mixBits(h ^ bits);
+}
+
+/*
+ PURPOSE: the scene compiled from its Composite tree into flat arrays of primitives
+ plus a Bvh over them; this is what the renderer traces rays against
+ REMARK:
+ Compiling walks the tree once through RayObject::compileInto, which resolves the
+ position offsets and hands every leaf to addTriangle, addSphere and the like.
+ Materials are kept once in a shared table and primitives only refer to them by index.
+ The Shape tree stays the way scenes are put together; it just has to be compiled again
+ after it changes.
+ All the arrays are SceneArrays, so a SceneCache can also point them straight into a
+ mapped cache file instead of compiling.
+ Boards are kept out of the Bvh and tested first for every ray, as a floor: a ray's
+ hit on a board bounds how far into the tree it has to look, and a shadow ray blocked
+ by one needn't look at all. Scenes have only a board or a few, so this costs little.
+ */
+class CompiledScene
+{
+private:
+   vector<Material> _materials;
+   TriangleArrays _triangles;
+   SphereArrays _spheres;
+   BoxArrays _boxes;
+   ConeArrays _cones;
+   BoardArrays _boards;
+   InstanceArrays _instances;
+   PrototypeArrays _prototypes;
+   vector<string> _prototypeNames; // only known while compiling, see findPrototype
+   SceneArray<unsigned int> _primitives; // primitive ids in the order the Bvh knows them
+   Bvh _bvh;
+   SceneArray<unsigned char> _shadowKinds; // ShadowKind of each entry of _primitives
+   double _compileMillis;
+   unsigned int _version; // how many times compile has been called
+   vector<PrimitiveSignature> _signatures; // of every primitive, sorted by hash
+   vector<Aabb> _changedBounds; // where primitives came or went in the last compile
+   std::shared_ptr<const void> _mapping; // scene cache the arrays look into, if any
+
+   friend class SceneCache;
+
+   static bool sameMaterial(const Material& a, const Material& b)
+   {
+      return a.ambient() == b.ambient() && a.diffuse() == b.diffuse()
+            && a.specular() == b.specular()
+            && a.transparency() == b.transparency()
+            && a.refraction() == b.refraction();
+   }
+
+   Aabb primitiveBounds(unsigned int id) const
+   {
+      unsigned int i = id & PRIMITIVE_INDEX_MASK;
+      Aabb box;
+      if (primitiveType(id) == INSTANCE_PRIMITIVE)
+      {
+         const InstanceArrays& in = _instances;
+         const Aabb& mesh = _prototypes.nodes[_prototypes.root[in.prototype[i]]].box;
+         for (int a = 0; a < 3; a++)
+         {
+            box.lo[a] = in.position[a][i] + in.scale[i] * mesh.lo[a] - SMALL_NUMBER;
+            box.hi[a] = in.position[a][i] + in.scale[i] * mesh.hi[a] + SMALL_NUMBER;
+         }
+      }
+      else if (primitiveType(id) == TRIANGLE_PRIMITIVE)
+      {
+         const TriangleArrays& t = _triangles;
+         for (int a = 0; a < 3; a++)
+         {
+            Real p0 = t.v0[a][i], p1 = p0 + t.u[a][i], p2 = p0 + t.v[a][i];
+            box.lo[a] = min(p0, min(p1, p2)) - SMALL_NUMBER;
+            box.hi[a] = max(p0, max(p1, p2)) + SMALL_NUMBER;
+         }
+      }
+      else if (primitiveType(id) == BOARD_PRIMITIVE)
+      {
+         const BoardArrays& b = _boards;
+         box.lo[0] = b.originX[i];
+         box.lo[2] = b.originZ[i];
+         box.hi[0] = b.originX[i] + b.edgeSize[i];
+         box.hi[2] = b.originZ[i] + b.edgeSize[i];
+         box.lo[1] = box.hi[1] = b.height[i];
+         for (int a = 0; a < 3; a++)
+         {
+            box.lo[a] -= SMALL_NUMBER;
+            box.hi[a] += SMALL_NUMBER;
+         }
+      }
+      else if (primitiveType(id) == BOX_PRIMITIVE)
+      {
+         for (int a = 0; a < 3; a++)
+         {
+            box.lo[a] = _boxes.lo[a][i] - SMALL_NUMBER;
+            box.hi[a] = _boxes.hi[a][i] + SMALL_NUMBER;
+         }
+      }
+      else if (primitiveType(id) == CONE_PRIMITIVE)
+      {
+         const ConeArrays& c = _cones;
+         Real r = max(c.bottomRadius[i], c.topRadius[i]);
+         for (int a = 0; a < 3; a++)
+         {
+            box.lo[a] = c.base[a][i] - (a == 1 ? 0 : r) - SMALL_NUMBER;
+            box.hi[a] = c.base[a][i] + (a == 1 ? c.height[i] : r) + SMALL_NUMBER;
+         }
+      }
+      else
+      {
+         const SphereArrays& s = _spheres;
+         for (int a = 0; a < 3; a++)
+         {
+            box.lo[a] = s.center[a][i] - s.radius[i] - SMALL_NUMBER;
+            box.hi[a] = s.center[a][i] + s.radius[i] + SMALL_NUMBER;
+         }
+      }
+      return box;
+   }
+
+   /*
+    PURPOSE: puts the primitives in the order the Bvh's leaves reference them
+    RECEIVES: Nothing
+    RETURNS: nothing
+    REMARKS:
+    Afterwards a leaf's range [first, first + count) indexes straight into _primitives,
+    and within a leaf the triangles come first and are numbered consecutively, so a
+    leaf's triangles are one contiguous run of the triangle arrays the batch kernel
+    can sweep through. Neighbouring leaves also end up next to each other in memory.
+    */
+   void reorderForLeaves()
+   {
+      const SceneArray<BvhNode>& nodes = _bvh.nodes();
+      const SceneArray<unsigned int>& indices = _bvh.indices();
+
+      vector<unsigned int> ordered(indices.size());
+      for (size_t k = 0; k < indices.size(); k++)
+         ordered[k] = _primitives[indices[k]];
+      for (size_t n = 0; n < nodes.size(); n++)
+      {
+         if (nodes[n].count > 0)
+            stable_partition(ordered.begin() + nodes[n].first,
+                  ordered.begin() + nodes[n].first + nodes[n].count, isTriangle);
+      }
+
+      TriangleArrays triangles;
+      SphereArrays spheres;
+      BoxArrays boxes;
+      ConeArrays cones;
+      InstanceArrays instances;
+      for (size_t k = 0; k < ordered.size(); k++)
+      {
+         unsigned int i = ordered[k] & PRIMITIVE_INDEX_MASK;
+         if (isTriangle(ordered[k]))
+         {
+            ordered[k] = primitiveId(TRIANGLE_PRIMITIVE, triangles.size());
+            triangles.append(_triangles, i);
+         }
+         else if (primitiveType(ordered[k]) == SPHERE_PRIMITIVE)
+         {
+            ordered[k] = primitiveId(SPHERE_PRIMITIVE, spheres.size());
+            spheres.append(_spheres, i);
+         }
+         else if (primitiveType(ordered[k]) == BOX_PRIMITIVE)
+         {
+            ordered[k] = primitiveId(BOX_PRIMITIVE, boxes.size());
+            boxes.append(_boxes, i);
+         }
+         else if (primitiveType(ordered[k]) == CONE_PRIMITIVE)
+         {
+            ordered[k] = primitiveId(CONE_PRIMITIVE, cones.size());
+            cones.append(_cones, i);
+         }
+         else
+         {
+            ordered[k] = primitiveId(INSTANCE_PRIMITIVE, instances.size());
+            instances.append(_instances, i);
+         }
+      }
+      triangles.pad();
+
+      _triangles = triangles;
+      _spheres = spheres;
+      _boxes = boxes;
+      _cones = cones;
+      _instances = instances;
+      _primitives.swap(ordered);
+   }
+
+   static bool isTriangle(unsigned int id)
+   {
+      return id >> PRIMITIVE_TYPE_SHIFT == TRIANGLE_PRIMITIVE;
+   }
+
+   /*
+    PURPOSE: fills in the Intersection of a ray with a triangle it is known to hit
+    RECEIVES:
+    i -- index of the triangle
+    p0 -- start of the ray
+    diffP -- end minus start of the ray
+    inter -- Intersection object to fill in
+    RETURNS: nothing
+    REMARKS: the triangle was picked in single precision; the hit point is worked out
+    again in Real precision against the triangle's plane so secondary rays start
+    exactly on the surface
+    */
+   void shadeTriangle(unsigned int i, const Point& p0, const Point& diffP,
+         Intersection& inter) const
+   {
+      const TriangleArrays& t = _triangles;
+      Point n(t.n[0][i], t.n[1][i], t.n[2][i]);
+      Point v(t.v0[0][i], t.v0[1][i], t.v0[2][i]);
+      Real m = (n & (v - p0)) / (n & diffP);
+
+      Point p = p0 + m * diffP;
+      Point u = diffP;
+      u.normalize();
+      setHit(inter, p, u, n, _materials[t.material[i]]);
+   }
+
+   /*
+    PURPOSE: fills in the Intersection of a ray with a sphere it is known to hit
+    RECEIVES:
+    i -- index of the sphere
+    p0 -- start of the ray
+    u -- normalized direction of the ray
+    distance -- how far along the ray the sphere was found to be hit
+    inter -- Intersection object to fill in
+    RETURNS: nothing
+    REMARKS: the distance is recomputed in Real precision for the same reason as in
+    shadeTriangle; for a ray just grazing the sphere that can come out as a miss, in
+    which case the distance given is used as is
+    */
+   void shadeSphere(unsigned int i, const Point& p0, const Point& u,
+         Real distance, Intersection& inter) const
+   {
+      const SphereArrays& sp = _spheres;
+      Point position(sp.center[0][i], sp.center[1][i], sp.center[2][i]);
+      Real s = sphereDistance(i, p0, u);
+      Point p = p0 + (s == HUGE_VAL ? distance : s) * u;
+      Point n = p - position;
+      n.normalize();
+      setHit(inter, p, u, n, _materials[sp.material[i]]);
+   }
+
+   // corner of board i the squares start from
+   Point boardCorner(unsigned int i) const
+   {
+      return Point(_boards.originX[i], _boards.height[i], _boards.originZ[i]);
+   }
+
+   // where a ray hits board i, see boardDistance
+   Real boardDistance(unsigned int i, const Point& p0, const Point& u, bool& black) const
+   {
+      COUNT(boardTests, 1);
+      Real s = ::boardDistance(boardCorner(i), _boards.edgeSize[i], _boards.squareSize[i],
+            p0, u, black);
+      COUNTING(if (s != HUGE_VAL) COUNT(boardHits, 1));
+      return s;
+   }
+
+   /*
+    PURPOSE: fills in the Intersection of a ray with a board it is known to hit
+    RECEIVES:
+    i -- index of the board
+    black -- whether the hit is on a black square, as found along with the hit
+    p0 -- start of the ray
+    u -- normalized direction of the ray
+    RETURNS: nothing
+    REMARKS: the hit point is worked out again in Real precision, as in shadeTriangle
+    */
+   void shadeBoard(unsigned int i, bool black, const Point& p0, const Point& u,
+         Intersection& inter) const
+   {
+      const BoardArrays& b = _boards;
+      Point p = p0 + ((b.height[i] - p0.y()) / u.y()) * u;
+      setHit(inter, p, u, Point(0.0, 1.0, 0.0),
+            _materials[black ? b.blackMaterial[i] : b.whiteMaterial[i]]);
+   }
+
+   /*
+    PURPOSE: finds out whether a ray hits a board closer than its closest hit so far
+    RECEIVES:
+    p0 -- start of the ray
+    u -- normalized direction of the ray
+    hit -- closest hit so far; replaced if a board is hit closer
+    RETURNS: nothing
+    */
+   void intersectBoards(const Point& p0, const Point& u, Hit& hit) const
+   {
+      for (unsigned int i = 0; i < _boards.size(); i++)
+      {
+         bool black = false;
+         Real s = boardDistance(i, p0, u, black);
+         if (s < hit.distance)
+         {
+            hit = Hit();
+            hit.distance = s;
+            hit.primitive = primitiveId(BOARD_PRIMITIVE, i);
+            hit.element = black;
+         }
+      }
+   }
+
+   // whether a ray hits an opaque square of some board before maxDistance
+   bool boardsOcclude(const Point& p0, const Point& u, Real maxDistance) const
+   {
+      for (unsigned int i = 0; i < _boards.size(); i++)
+      {
+         bool black = false;
+         if (boardDistance(i, p0, u, black) < maxDistance && boardSquareOpaque(i, black))
+            return true;
+      }
+      return false;
+   }
+
+   // fills in the Intersection of a ray with a box it is known to hit, as shadeSphere
+   void shadeBox(unsigned int i, const Point& p0, const Point& u, Real distance,
+         Intersection& inter) const
+   {
+      const BoxArrays& b = _boxes;
+      Point lo(b.lo[0][i], b.lo[1][i], b.lo[2][i]);
+      Point hi(b.hi[0][i], b.hi[1][i], b.hi[2][i]);
+      Real s = boxDistance(lo, hi, p0, u);
+      Point p = p0 + (s == HUGE_VAL ? distance : s) * u;
+      setHit(inter, p, u, boxNormal(0.5 * (lo + hi), 0.5 * (hi - lo), p),
+            _materials[b.material[i]]);
+   }
+
+   /*
+    PURPOSE: fills in the Intersection of a ray with a capped cone it is known to hit
+    RECEIVES:
+    i -- index of the cone
+    part -- ConePart hit
+    p0 -- start of the ray
+    u -- normalized direction of the ray
+    distance -- how far along the ray the cone was found to be hit
+    inter -- Intersection object to fill in
+    RETURNS: nothing
+    REMARKS: as shadeSphere; the part found then is kept, so the normal belongs to the
+    part the hit was counted on even right at a rim
+    */
+   void shadeCone(unsigned int i, unsigned int part, const Point& p0, const Point& u,
+         Real distance, Intersection& inter) const
+   {
+      const ConeArrays& c = _cones;
+      Point base(c.base[0][i], c.base[1][i], c.base[2][i]);
+      unsigned int again;
+      Real s = cappedConeDistance(base, c.height[i], c.bottomRadius[i], c.topRadius[i], p0,
+            u, again);
+      Point p = p0 + (s == HUGE_VAL ? distance : s) * u;
+      setHit(inter, p, u, cappedConeNormal(base, c.height[i], c.bottomRadius[i],
+            c.topRadius[i], p, part), _materials[c.material[i]]);
+   }
+
+   /*
+    PURPOSE: fills in the Intersection of a ray with an instance it is known to hit
+    RECEIVES:
+    i -- index of the instance
+    element -- which of its prototype's triangles was hit
+    p0 -- start of the ray
+    diffP -- end minus start of the ray
+    inter -- Intersection object to fill in
+    RETURNS: nothing
+    REMARKS: as shadeTriangle, with the triangle's corner moved into the scene; the
+    normal needs no change since instances are only scaled uniformly
+    */
+   void shadeInstance(unsigned int i, unsigned int element, const Point& p0,
+         const Point& diffP, Intersection& inter) const
+   {
+      const InstanceArrays& in = _instances;
+      const TriangleArrays& t = _prototypes.triangles;
+      Point n(t.n[0][element], t.n[1][element], t.n[2][element]);
+      Point v = Point(in.position[0][i], in.position[1][i], in.position[2][i])
+            + Real(in.scale[i]) * Point(t.v0[0][element], t.v0[1][element], t.v0[2][element]);
+      Real m = (n & (v - p0)) / (n & diffP);
+
+      Point p = p0 + m * diffP;
+      Point u = diffP;
+      u.normalize();
+      setHit(inter, p, u, n, _materials[in.material[i]]);
+   }
+
+   // the start of a ray in the space of instance i's prototype, see InstanceArrays
+   Point toPrototype(unsigned int i, const Point& p0) const
+   {
+      const InstanceArrays& in = _instances;
+      Point position(in.position[0][i], in.position[1][i], in.position[2][i]);
+      return (1 / Real(in.scale[i])) * (p0 - position);
+   }
+
+   /*
+    PURPOSE: finds out whether a ray hits one instance closer than its closest hit so far
+    RECEIVES:
+    i -- index of the instance
+    p0 -- start of the ray
+    u -- normalized direction of the ray
+    hit -- closest hit so far; replaced if the instance is hit closer
+    RETURNS: nothing
+    REMARKS: the ray is moved into the prototype's space and traced through the
+    prototype's own Bvh there, with the closest distance scaled to match, and so is
+    the distance below which hits don't count
+    */
+   void intersectInstance(unsigned int i, const Point& p0, const Point& u, Hit& hit) const
+   {
+      Real scale = _instances.scale[i];
+      Point o = toPrototype(i, p0);
+      float of[3] = { (float) o.x(), (float) o.y(), (float) o.z() };
+      float d[3] = { (float) u.x(), (float) u.y(), (float) u.z() };
+
+      Hit local;
+      local.distance = hit.distance / scale;
+      Bvh::closestHit(_prototypes.nodes.data(), _prototypes.root[_instances.prototype[i]],
+            BvhRay(o, u), local.distance, [&](unsigned int first, unsigned int count,
+                  Real& closestSoFar)
+      {
+         intersectTriangleBatch(_prototypes.triangles, first, count, of, d, local,
+               SMALL_NUMBER / scale);
+         closestSoFar = local.distance;
+      });
+
+      if (local.primitive != NO_PRIMITIVE)
+      {
+         hit.distance = local.distance * scale;
+         hit.primitive = primitiveId(INSTANCE_PRIMITIVE, i);
+         hit.element = local.primitive & PRIMITIVE_INDEX_MASK;
+         hit.b1 = local.b1;
+         hit.b2 = local.b2;
+      }
+   }
+
+   // whether a ray hits instance i before maxDistance, the way intersectInstance looks
+   bool instanceOccludes(unsigned int i, const Point& p0, const Point& u,
+         Real maxDistance) const
+   {
+      Point o = toPrototype(i, p0);
+      float of[3] = { (float) o.x(), (float) o.y(), (float) o.z() };
+      float d[3] = { (float) u.x(), (float) u.y(), (float) u.z() };
+      Real scale = _instances.scale[i];
+      Real limit = maxDistance / scale;
+
+      return Bvh::anyHit(_prototypes.nodes.data(), _prototypes.root[_instances.prototype[i]],
+            BvhRay(o, u), limit, [&](unsigned int first, unsigned int count)
+      {
+         COUNT(triangleTests, count);
+         for (unsigned int base = first; base < first + count; base += TRIANGLE_BATCH_WIDTH)
+         {
+            TriangleBatchHits hits = triangleBatchDistances(_prototypes.triangles, base,
+                  first + count, of, d, SMALL_NUMBER / scale);
+            for (unsigned int l = 0; l < TRIANGLE_BATCH_WIDTH; l++)
+               if (hits.distance[l] < limit)
+                  return true;
+         }
+         return false;
+      });
+   }
+
+   /*
+    PURPOSE: works out where a ray hits one sphere of the arrays
+    RECEIVES:
+    i -- index of the sphere
+    p0 -- start of the ray
+    u -- normalized direction of the ray
+    RETURNS: distance along the ray to the hit, HUGE_VAL if it misses
+    REMARKS: same test as the sphere case of Shape::doIIntersectWith
+    */
+   Real sphereDistance(unsigned int i, const Point& p0, const Point& u) const
+   {
+      const SphereArrays& sp = _spheres;
+      Point position(sp.center[0][i], sp.center[1][i], sp.center[2][i]);
+      Real radius = sp.radius[i];
+      Point deltaP = position - p0;
+
+      Real uDeltaP = u & deltaP;
+      Real discriminant = uDeltaP * uDeltaP - (deltaP & deltaP)
+            + radius * radius;
+      COUNT(sphereTests, 1);
+      if (discriminant < 0)
+         return HUGE_VAL;
+
+      Real s = uDeltaP - sqrt(discriminant); //other solution is on far side of sphere
+      if (s < SMALL_NUMBER)
+         return HUGE_VAL;
+      COUNT(sphereHits, 1);
+      return s;
+   }
+
+   // material of a primitive other than a triangle, which is the same all over it
+   unsigned int solidMaterial(unsigned int id) const
+   {
+      unsigned int i = id & PRIMITIVE_INDEX_MASK;
+      switch (primitiveType(id))
+      {
+      case SPHERE_PRIMITIVE:
+         return _spheres.material[i];
+      case BOX_PRIMITIVE:
+         return _boxes.material[i];
+      case CONE_PRIMITIVE:
+         return _cones.material[i];
+      default:
+         return _instances.material[i];
+      }
+   }
+
+   // whether light passes through a material or is stopped by it
+   bool isOpaque(unsigned int material) const
+   {
+      return _materials[material].transparency().isZero();
+   }
+
+   /*
+    PURPOSE: works out which primitives stop light
+    RECEIVES: Nothing
+    RETURNS: nothing
+    REMARKS: fills in _shadowKinds for the primitives in their final order
+    */
+   void classifyShadows()
+   {
+      _shadowKinds.resize(_primitives.size());
+      for (size_t k = 0; k < _primitives.size(); k++)
+      {
+         unsigned int i = _primitives[k] & PRIMITIVE_INDEX_MASK;
+         unsigned int material = isTriangle(_primitives[k]) ? _triangles.material[i]
+               : solidMaterial(_primitives[k]);
+         _shadowKinds[k] = isOpaque(material) ? CASTS_SHADOW : CASTS_NO_SHADOW;
+      }
+   }
+
+   uint64_t materialHash(uint64_t h, unsigned int material) const
+   {
+      const Material& m = _materials[material];
+      Point colors[4] = { m.ambient(), m.diffuse(), m.specular(), m.transparency() };
+      for (int c = 0; c < 4; c++)
+      {
+         h = hashFloat(h, colors[c].x());
+         h = hashFloat(h, colors[c].y());
+         h = hashFloat(h, colors[c].z());
+      }
+      return hashFloat(h, m.refraction());
+   }
+
+   PrimitiveSignature signature(unsigned int id) const
+   {
+      unsigned int i = id & PRIMITIVE_INDEX_MASK;
+      PrimitiveSignature sig;
+      sig.box = primitiveBounds(id);
+      if (primitiveType(id) == INSTANCE_PRIMITIVE)
+      {
+         const InstanceArrays& in = _instances;
+         uint64_t h = mixBits(INSTANCE_PRIMITIVE ^ (uint64_t) in.prototype[i] << 8);
+         for (int a = 0; a < 3; a++)
+            h = hashFloat(h, in.position[a][i]);
+         sig.hash = materialHash(hashFloat(h, in.scale[i]), in.material[i]);
+      }
+      else if (primitiveType(id) == TRIANGLE_PRIMITIVE)
+      {
+         const TriangleArrays& t = _triangles;
+         uint64_t h = TRIANGLE_PRIMITIVE;
+         for (int a = 0; a < 3; a++)
+         {
+            h = hashFloat(h, t.v0[a][i]);
+            h = hashFloat(h, t.u[a][i]);
+            h = hashFloat(h, t.v[a][i]);
+         }
+         sig.hash = materialHash(h, t.material[i]);
+      }
+      else if (primitiveType(id) == BOARD_PRIMITIVE)
+      {
+         const BoardArrays& b = _boards;
+         uint64_t h = hashFloat(BOARD_PRIMITIVE, b.squareSize[i]);
+         h = materialHash(materialHash(h, b.whiteMaterial[i]), b.blackMaterial[i]);
+         sig.hash = h; // the rest of the board's geometry is all in its box
+      }
+      else if (primitiveType(id) == BOX_PRIMITIVE)
+      {
+         uint64_t h = BOX_PRIMITIVE;
+         for (int a = 0; a < 3; a++)
+            h = hashFloat(hashFloat(h, _boxes.lo[a][i]), _boxes.hi[a][i]);
+         sig.hash = materialHash(h, _boxes.material[i]);
+      }
+      else if (primitiveType(id) == CONE_PRIMITIVE)
+      {
+         const ConeArrays& c = _cones;
+         uint64_t h = CONE_PRIMITIVE;
+         for (int a = 0; a < 3; a++)
+            h = hashFloat(h, c.base[a][i]);
+         h = hashFloat(hashFloat(hashFloat(h, c.height[i]), c.bottomRadius[i]), c.topRadius[i]);
+         sig.hash = materialHash(h, c.material[i]);
+      }
+      else
+      {
+         const SphereArrays& s = _spheres;
+         uint64_t h = SPHERE_PRIMITIVE;
+         for (int a = 0; a < 3; a++)
+            h = hashFloat(h, s.center[a][i]);
+         sig.hash = materialHash(hashFloat(h, s.radius[i]), s.material[i]);
+      }
+      return sig;
+   }
+
+   /*
+    PURPOSE: works out which parts of space look different since the previous compile
+    RECEIVES: Nothing
+    RETURNS: nothing
+    REMARKS: primitives, boards included, are matched up by signature, so any primitive
+    which changed, came or went counts, wherever it is in the tree. The boxes of the
+    unmatched ones are merged into _changedBounds wherever they overlap, which leaves
+    one box per edited object in the usual case of a few objects changing; past
+    MAX_CHANGED_BOUNDS boxes they are summed up as one.
+    */
+   void findChangedBounds()
+   {
+      vector<PrimitiveSignature> signatures(_primitives.size());
+      for (size_t k = 0; k < _primitives.size(); k++)
+         signatures[k] = signature(_primitives[k]);
+      for (unsigned int i = 0; i < _boards.size(); i++)
+         signatures.push_back(signature(primitiveId(BOARD_PRIMITIVE, i)));
+      sort(signatures.begin(), signatures.end(), signatureLess);
+
+      vector<PrimitiveSignature> changed;
+      set_symmetric_difference(_signatures.begin(), _signatures.end(), signatures.begin(),
+            signatures.end(), back_inserter(changed), signatureLess);
+      _signatures.swap(signatures);
+
+      _changedBounds.clear();
+      for (size_t k = 0; k < changed.size(); k++)
+      {
+         Aabb box = changed[k].box;
+         for (size_t i = 0; i < _changedBounds.size();)
+         {
+            if (_changedBounds[i].overlaps(box))
+            {
+               box.grow(_changedBounds[i]);
+               _changedBounds[i] = _changedBounds.back();
+               _changedBounds.pop_back();
+               i = 0;
+            }
+            else
+               i++;
+         }
+         _changedBounds.push_back(box);
+
+         if (_changedBounds.size() > MAX_CHANGED_BOUNDS)
+         {
+            for (size_t i = 1; i < _changedBounds.size(); i++)
+               _changedBounds[0].grow(_changedBounds[i]);
+            _changedBounds.resize(1);
+         }
+      }
+   }
+
+public:
+   CompiledScene()
+   {
+      _compileMillis = 0;
+      _version = 0;
+   }
+
+   /*
+    PURPOSE: throws away the current arrays and compiles them anew from a scene
+    RECEIVES: root -- the Shape holding the whole scene
+    RETURNS: nothing
+    REMARKS: also rebuilds the Bvh over the new primitives
+    */
+   void compile(Shape& root)
+   {
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+      _version++;
+      _materials.clear();
+      _triangles = TriangleArrays();
+      _spheres = SphereArrays();
+      _boxes = BoxArrays();
+      _cones = ConeArrays();
+      _boards = BoardArrays();
+      _instances = InstanceArrays();
+      _prototypes = PrototypeArrays();
+      _prototypeNames.clear();
+      _shadowKinds.clear();
+      _bvh = Bvh();
+      _mapping.reset();
+      root.compileInto(Point(0.0, 0.0, 0.0), *this);
+      _prototypes.triangles.pad();
+
+      _primitives.clear();
+      for (unsigned int i = 0; i < _triangles.size(); i++)
+         _primitives.push_back(primitiveId(TRIANGLE_PRIMITIVE, i));
+      for (unsigned int i = 0; i < _spheres.size(); i++)
+         _primitives.push_back(primitiveId(SPHERE_PRIMITIVE, i));
+      for (unsigned int i = 0; i < _boxes.size(); i++)
+         _primitives.push_back(primitiveId(BOX_PRIMITIVE, i));
+      for (unsigned int i = 0; i < _cones.size(); i++)
+         _primitives.push_back(primitiveId(CONE_PRIMITIVE, i));
+      for (unsigned int i = 0; i < _instances.size(); i++)
+         _primitives.push_back(primitiveId(INSTANCE_PRIMITIVE, i));
+
+      _compileMillis = chrono::duration<double, milli>(
+            chrono::steady_clock::now() - start).count();
+
+      vector<Aabb> bounds(_primitives.size());
+      for (size_t i = 0; i < _primitives.size(); i++)
+         bounds[i] = primitiveBounds(_primitives[i]);
+      _bvh.build(bounds);
+      reorderForLeaves();
+      classifyShadows();
+      findChangedBounds();
+   }
+
+   /*
+    PURPOSE: finds a material in the material table, adding it if it isn't there yet
+    RECEIVES: m -- Material to look up
+    RETURNS: its index in the table
+    REMARKS: scenes only have a handful of distinct materials so a linear search does
+    */
+   unsigned int addMaterial(const Material& m)
+   {
+      for (unsigned int i = 0; i < _materials.size(); i++)
+         if (sameMaterial(_materials[i], m))
+            return i;
+      _materials.push_back(m);
+      return _materials.size() - 1;
+   }
+
+   /*
+    PURPOSE: adds a triangle given by its corners in scene coordinates
+    RECEIVES:
+    p0, p1, p2 -- corners of the triangle
+    m -- Material it is made of
+    RETURNS: nothing
+    REMARKS: degenerate triangles are dropped, just like Triangle never lets them intersect.
+    */
+   void addTriangle(const Point& p0, const Point& p1, const Point& p2,
+         const Material& m)
+   {
+      Point u = p1 - p0;
+      Point v = p2 - p0;
+      Point n = u * v;
+      if (n.length() < SMALL_NUMBER)
+         return;
+      n.normalize();
+
+      Real uv = u & v, uu = u & u, vv = v & v;
+      Real denominator = uv * uv - uu * vv;
+      if (abs(denominator) < SMALL_NUMBER)
+         return;
+
+      TriangleArrays& t = _triangles;
+      Real v0[3] = { p0.x(), p0.y(), p0.z() };
+      Real ua[3] = { u.x(), u.y(), u.z() };
+      Real va[3] = { v.x(), v.y(), v.z() };
+      Real na[3] = { n.x(), n.y(), n.z() };
+      for (int a = 0; a < 3; a++)
+      {
+         t.v0[a].push_back(v0[a]);
+         t.u[a].push_back(ua[a]);
+         t.v[a].push_back(va[a]);
+         t.n[a].push_back(na[a]);
+      }
+      t.uu.push_back(uu);
+      t.uv.push_back(uv);
+      t.vv.push_back(vv);
+      t.denominator.push_back(denominator);
+      t.minDeterminant.push_back(SMALL_NUMBER * (u * v).length());
+      t.material.push_back(addMaterial(m));
+   }
+
+   void addSphere(const Point& center, Real radius, const Material& m)
+   {
+      SphereArrays& s = _spheres;
+      s.center[0].push_back(center.x());
+      s.center[1].push_back(center.y());
+      s.center[2].push_back(center.z());
+      s.radius.push_back(radius);
+      s.material.push_back(addMaterial(m));
+   }
+
+   // adds the axis aligned box from corner lo to corner hi
+   void addBox(const Point& lo, const Point& hi, const Material& m)
+   {
+      BoxArrays& b = _boxes;
+      b.lo[0].push_back(lo.x());
+      b.lo[1].push_back(lo.y());
+      b.lo[2].push_back(lo.z());
+      b.hi[0].push_back(hi.x());
+      b.hi[1].push_back(hi.y());
+      b.hi[2].push_back(hi.z());
+      b.material.push_back(addMaterial(m));
+   }
+
+   // adds an upright capped cone whose bottom is centred on base, see cappedConeDistance
+   void addCone(const Point& base, Real height, Real bottomRadius, Real topRadius,
+         const Material& m)
+   {
+      ConeArrays& c = _cones;
+      c.base[0].push_back(base.x());
+      c.base[1].push_back(base.y());
+      c.base[2].push_back(base.z());
+      c.height.push_back(height);
+      c.bottomRadius.push_back(bottomRadius);
+      c.topRadius.push_back(topRadius);
+      c.material.push_back(addMaterial(m));
+   }
+
+   // the prototype added under name in this compile, or NO_PROTOTYPE if there is none yet
+   unsigned int findPrototype(const char *name) const
+   {
+      for (unsigned int p = 0; p < _prototypeNames.size(); p++)
+         if (_prototypeNames[p] == name)
+            return p;
+      return NO_PROTOTYPE;
+   }
+
+   /*
+    PURPOSE: adds a prototype mesh for instances to share
+    RECEIVES:
+    name -- what to call it, see findPrototype
+    unit -- object whose triangles make up the mesh, in its own space; it has to have some
+    RETURNS: index of the prototype, to be passed to addInstance
+    REMARKS: the triangles are stored in the order of the Bvh built over them, so every
+    leaf is one run of them, as reorderForLeaves does for the scene
+    */
+   unsigned int addPrototype(const char *name, Shape& unit)
+   {
+      CompiledScene mesh;
+      unit.Shape::compileInto(Point(0.0, 0.0, 0.0), mesh);
+      vector<Aabb> bounds(mesh._triangles.size());
+      for (unsigned int i = 0; i < bounds.size(); i++)
+         bounds[i] = mesh.primitiveBounds(primitiveId(TRIANGLE_PRIMITIVE, i));
+      Bvh bvh;
+      bvh.build(bounds);
+
+      PrototypeArrays& p = _prototypes;
+      unsigned int firstTriangle = p.triangles.size(), firstNode = p.nodes.size();
+      for (size_t k = 0; k < bvh.indices().size(); k++)
+         p.triangles.append(mesh._triangles, bvh.indices()[k]);
+      for (size_t n = 0; n < bvh.nodes().size(); n++)
+      {
+         BvhNode node = bvh.nodes()[n];
+         node.first += node.count > 0 ? firstTriangle : firstNode;
+         p.nodes.push_back(node);
+      }
+      p.root.push_back(firstNode);
+      _prototypeNames.push_back(name);
+      return p.size() - 1;
+   }
+
+   /*
+    PURPOSE: adds an instance of a prototype
+    RECEIVES:
+    prototype -- which one, as returned by addPrototype
+    position -- where in the scene the prototype's origin goes
+    scale -- how much bigger than the prototype the instance is
+    m -- Material it is made of
+    RETURNS: nothing
+    REMARKS:
+    */
+   void addInstance(unsigned int prototype, const Point& position, Real scale,
+         const Material& m)
+   {
+      InstanceArrays& in = _instances;
+      in.position[0].push_back(position.x());
+      in.position[1].push_back(position.y());
+      in.position[2].push_back(position.z());
+      in.scale.push_back(scale);
+      in.prototype.push_back(prototype);
+      in.material.push_back(addMaterial(m));
+   }
+
+   /*
+    PURPOSE: adds a checkerboard lying flat
+    RECEIVES:
+    corner -- corner of the board with the smallest x and z; the squares start there
+    edgeSize -- how wide and deep the board is
+    squareSize -- edge length of a square
+    white, black -- Materials of the two kinds of square
+    RETURNS: nothing
+    REMARKS:
+    */
+   void addBoard(const Point& corner, Real edgeSize, Real squareSize,
+         const Material& white, const Material& black)
+   {
+      BoardArrays& b = _boards;
+      b.originX.push_back(corner.x());
+      b.originZ.push_back(corner.z());
+      b.height.push_back(corner.y());
+      b.edgeSize.push_back(edgeSize);
+      b.squareSize.push_back(squareSize);
+      b.whiteMaterial.push_back(addMaterial(white));
+      b.blackMaterial.push_back(addMaterial(black));
+   }
+
+   const TriangleArrays& triangles() const
+   {
+      return _triangles;
+   }
+   const SphereArrays& spheres() const
+   {
+      return _spheres;
+   }
+   const BoardArrays& boards() const
+   {
+      return _boards;
+   }
+   const BoxArrays& boxes() const
+   {
+      return _boxes;
+   }
+   const ConeArrays& cones() const
+   {
+      return _cones;
+   }
+   const InstanceArrays& instances() const
+   {
+      return _instances;
+   }
+   const PrototypeArrays& prototypes() const
+   {
+      return _prototypes;
+   }
+
+   // ShadowKind of each primitive, in the same order as primitives()
+   const SceneArray<unsigned char>& shadowKinds() const
+   {
+      return _shadowKinds;
+   }
+
+   // true if an opaque square of board i hides what lies behind it
+   bool boardSquareOpaque(unsigned int i, bool black) const
+   {
+      return isOpaque(black ? _boards.blackMaterial[i] : _boards.whiteMaterial[i]);
+   }
+   const SceneArray<unsigned int>& primitives() const
+   {
+      return _primitives;
+   }
+   const Bvh& bvh() const
+   {
+      return _bvh;
+   }
+
+   size_t triangleCount() const
+   {
+      return _triangles.size();
+   }
+   size_t sphereCount() const
+   {
+      return _spheres.size();
+   }
+   size_t boardCount() const
+   {
+      return _boards.size();
+   }
+   size_t boxCount() const
+   {
+      return _boxes.size();
+   }
+   size_t coneCount() const
+   {
+      return _cones.size();
+   }
+   size_t instanceCount() const
+   {
+      return _instances.size();
+   }
+   size_t prototypeCount() const
+   {
+      return _prototypes.size();
+   }
+   size_t materialCount() const
+   {
+      return _materials.size();
+   }
+   size_t nodeCount() const
+   {
+      return _bvh.nodeCount();
+   }
+   // changes every time the scene is compiled, so renderers can tell their pixels are stale
+   unsigned int version() const
+   {
+      return _version;
+   }
+
+   // boxes around everything that changed in the last compile, see findChangedBounds
+   const vector<Aabb>& changedBounds() const
+   {
+      return _changedBounds;
+   }
+
+   double compileMillis() const
+   {
+      return _compileMillis;
+   }
+   double buildMillis() const
+   {
+      return _bvh.buildMillis();
+   }
+
+   /*
+    PURPOSE: works out where a ray hits a sphere, box or capped cone
+    RECEIVES:
+    id -- primitive id of the sphere, box or cone
+    p0 -- start of the ray
+    u -- normalized direction of the ray
+    element -- set to what goes in Hit::element if it is hit
+    RETURNS: distance along the ray to the hit, HUGE_VAL if it misses
+    REMARKS: these are tested in Real precision straight from their few numbers, so
+    there is nothing to batch
+    */
+   Real solidDistance(unsigned int id, const Point& p0, const Point& u,
+         unsigned int& element) const
+   {
+      unsigned int i = id & PRIMITIVE_INDEX_MASK;
+      element = 0;
+      Real s;
+      if (primitiveType(id) == BOX_PRIMITIVE)
+      {
+         const BoxArrays& b = _boxes;
+         COUNT(boxTests, 1);
+         s = boxDistance(Point(b.lo[0][i], b.lo[1][i], b.lo[2][i]),
+               Point(b.hi[0][i], b.hi[1][i], b.hi[2][i]), p0, u);
+         COUNTING(if (s != HUGE_VAL) COUNT(boxHits, 1));
+      }
+      else if (primitiveType(id) == CONE_PRIMITIVE)
+      {
+         const ConeArrays& c = _cones;
+         COUNT(coneTests, 1);
+         s = cappedConeDistance(Point(c.base[0][i], c.base[1][i], c.base[2][i]),
+               c.height[i], c.bottomRadius[i], c.topRadius[i], p0, u, element);
+         COUNTING(if (s != HUGE_VAL) COUNT(coneHits, 1));
+      }
+      else
+         s = sphereDistance(i, p0, u);
+      return s;
+   }
+
+   /*
+    PURPOSE: finds the closest primitive a ray hits in the scene
+    RECEIVES:
+    ray -- ray to intersect with the scene
+    hit -- filled in with the closest hit, if any
+    RETURNS: true if the ray hits anything
+    REMARKS:
+    Distances are measured from the start of the ray as in Shape::doIIntersectWith.
+    Only distances are compared along the way; nothing is shaded for the candidates a
+    nearer primitive later replaces. Pass the hit to shade to get the full Intersection.
+    The boards are tested before the Bvh, so a ray going down to one never visits the
+    parts of the tree beyond it.
+    */
+   bool closestHit(const Line& ray, Hit& hit) const
+   {
+      hit = Hit();
+
+      BvhRay bvhRay(ray);
+      Point p0 = ray.startPoint();
+      Point u = ray.direction();
+      float o[3] = { (float) p0.x(), (float) p0.y(), (float) p0.z() };
+      float d[3] = { (float) u.x(), (float) u.y(), (float) u.z() };
+
+      intersectBoards(p0, u, hit);
+      Real closest = hit.distance;
+      _bvh.closestHit(bvhRay, closest, [&](unsigned int first, unsigned int count,
+            Real& closestSoFar)
+      {
+         unsigned int k = first, end = first + count;
+         while (k < end && isTriangle(_primitives[k]))
+            k++;
+         if (k > first)
+            intersectTriangleBatch(_triangles, _primitives[first] & PRIMITIVE_INDEX_MASK,
+                  k - first, o, d, hit);
+         for (; k < end; k++)
+         {
+            if (primitiveType(_primitives[k]) == INSTANCE_PRIMITIVE)
+            {
+               intersectInstance(_primitives[k] & PRIMITIVE_INDEX_MASK, p0, u, hit);
+               continue;
+            }
+            unsigned int element;
+            Real s = solidDistance(_primitives[k], p0, u, element);
+            if (s < hit.distance)
+            {
+               hit = Hit();
+               hit.distance = s;
+               hit.primitive = _primitives[k];
+               hit.element = element;
+            }
+         }
+         closestSoFar = hit.distance;
+      });
+
+      return hit.distance != HUGE_VAL;
+   }
+
+   /*
+    PURPOSE: works out everything needed to shade the point a ray hits
+    RECEIVES:
+    ray -- ray which was traced
+    hit -- where it hits, as found by closestHit or a ray packet
+    inter -- filled in with the point, normal, material and the reflected and
+    transmitted rays
+    RETURNS: nothing
+    REMARKS:
+    */
+   void shade(const Line& ray, const Hit& hit, Intersection& inter) const
+   {
+      Point p0 = ray.startPoint();
+      unsigned int i = hit.primitive & PRIMITIVE_INDEX_MASK;
+      if (isTriangle(hit.primitive))
+         shadeTriangle(i, p0, ray.endPoint() - p0, inter);
+      else if (primitiveType(hit.primitive) == INSTANCE_PRIMITIVE)
+         shadeInstance(i, hit.element, p0, ray.endPoint() - p0, inter);
+      else if (primitiveType(hit.primitive) == BOX_PRIMITIVE)
+         shadeBox(i, p0, ray.direction(), hit.distance, inter);
+      else if (primitiveType(hit.primitive) == CONE_PRIMITIVE)
+         shadeCone(i, hit.element, p0, ray.direction(), hit.distance, inter);
+      else if (primitiveType(hit.primitive) == BOARD_PRIMITIVE)
+         shadeBoard(i, hit.element != 0, p0, ray.direction(), inter);
+      else
+         shadeSphere(i, p0, ray.direction(), hit.distance, inter);
+   }
+
+   /*
+    PURPOSE: checks whether anything opaque lies on a ray before a given distance
+    RECEIVES:
+    ray -- ray to test, usually from a surface point towards a light
+    maxDistance -- only hits closer than this count, usually the distance to the light
+    RETURNS: true if an opaque primitive is hit within maxDistance
+    REMARKS:
+    Shadow ray query. Unlike closestHit there is no need to find the closest hit:
+    the first opaque one ends the search, and nothing is shaded along the way. Hits on
+    transparent primitives let the light through and are skipped. The boards come
+    first, so a ray blocked by one never gets to the Bvh.
+    */
+   bool occluded(const Line& ray, Real maxDistance) const
+   {
+      BvhRay bvhRay(ray);
+      Point p0 = ray.startPoint();
+      Point u = ray.direction();
+      float o[3] = { (float) p0.x(), (float) p0.y(), (float) p0.z() };
+      float d[3] = { (float) u.x(), (float) u.y(), (float) u.z() };
+
+      if (boardsOcclude(p0, u, maxDistance))
+         return true;
+
+      return _bvh.anyHit(bvhRay, maxDistance, [&](unsigned int first, unsigned int count)
+      {
+         unsigned int k = first, end = first + count;
+         while (k < end && isTriangle(_primitives[k]))
+            k++;
+         unsigned int t0 = _primitives[first] & PRIMITIVE_INDEX_MASK;
+         COUNT(triangleTests, k - first);
+         for (unsigned int base = t0; k > first && base < t0 + k - first;
+               base += TRIANGLE_BATCH_WIDTH)
+         {
+            TriangleBatchHits hits = triangleBatchDistances(_triangles, base,
+                  t0 + k - first, o, d);
+            for (unsigned int l = 0; l < TRIANGLE_BATCH_WIDTH; l++)
+            {
+               COUNTING(if (hits.distance[l] != HUGE_VALF) COUNT(triangleHits, 1));
+               if (hits.distance[l] < maxDistance
+                     && _shadowKinds[first + base - t0 + l] == CASTS_SHADOW)
+                  return true;
+            }
+         }
+         for (; k < end; k++)
+         {
+            unsigned int i = _primitives[k] & PRIMITIVE_INDEX_MASK, element;
+            if (_shadowKinds[k] != CASTS_SHADOW)
+               continue;
+            if (primitiveType(_primitives[k]) == INSTANCE_PRIMITIVE
+                  ? instanceOccludes(i, p0, u, maxDistance)
+                  : solidDistance(_primitives[k], p0, u, element) < maxDistance)
+               return true;
+         }
+         return false;
+      });
+   }
+};
+
+/*---------------------------------------------------------------------------*/
+/* SCENE COMPILATION */
+inline void Triangle::compileInto(const Point& positionOffset, CompiledScene& out)
+{
+   if (_degenerate)
+      return;
+
+   Point position = _position + positionOffset;
+   out.addTriangle(position + _vertex0, position + _vertex1,
+         position + _vertex2, _material);
+}
+
+inline void Shape::compileInto(const Point& positionOffset, CompiledScene& out)
+{
+   Point position = _position + positionOffset;
+   if (_amSphere)
+   {
+      out.addSphere(position, _radius, _material);
+      return;
+   }
+
+   for (size_t i = 0; i < _subObjects.size(); i++)
+      _subObjects[i]->compileInto(position, out);
+}
+
+// compiles the cube as one box
+inline void Cube::compileInto(const Point& positionOffset, CompiledScene& out)
+{
+   Point lo, hi;
+   bounds(positionOffset, lo, hi);
+   out.addBox(lo, hi, _material);
+}
+
+inline void CappedCone::compileInto(const Point& positionOffset, CompiledScene& out)
+{
+   out.addCone(base(positionOffset), _height, _bottomRadius, _topRadius, _material);
+}
+
+/*
+ PURPOSE: compiles the tetrahedron as an instance of a shared unit tetrahedron
+ RECEIVES:
+ positionOffset -- where in the overall scene this Tetrahedron lives
+ out -- CompiledScene to add to
+ RETURNS: nothing
+ REMARKS: the unit tetrahedron is built, and its prototype added, by the first one
+ compiled
+ */
+inline void Tetrahedron::compileInto(const Point& positionOffset, CompiledScene& out)
+{
+   unsigned int prototype = out.findPrototype("tetrahedron");
+   if (prototype == NO_PROTOTYPE)
+   {
+      SceneArena scratch; // keeps the unit's parts out of whatever arena the scene is in
+      ArenaScope scope(scratch);
+      Tetrahedron unit(Point(0.0, 0.0, 0.0), 1.0);
+      prototype = out.addPrototype("tetrahedron", unit);
+   }
+   out.addInstance(prototype, _position + positionOffset, _edgeSize, _material);
+}
+
+// compiles the board as a board primitive, its squares counted as doIIntersectWith does
+inline void CheckerBoard::compileInto(const Point& positionOffset,
+      CompiledScene& out)
+{
+   out.addBoard(corner(positionOffset), BOARD_EDGE_SIZE, SQUARE_EDGE_SIZE, whiteSquare,
+         blackSquare);
+}
+
+#endif
@@ -0,0 +1,279 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+/*---------------------------------------------------------------------------*/
+/* INCLUDES */
+#include <vector>
+#include <mutex>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <stdint.h>
+
+/*
+ Counters of what the tracer does, for finding out where its time goes. They are only
+ there when built with make COUNTERS=1 (-DTRACE_COUNTERS); otherwise COUNT expands to
+ nothing and the tracer is exactly what it was. Every thread counts into a
+ TraceCounters of its own, so counting takes no locks or atomics; collectTraceCounters
+ adds them all up at the end of a frame.
+ */
+
+/*---------------------------------------------------------------------------*/
+/*  VARIABLES */
+const unsigned int COUNTED_DEPTHS = 8; // rays of deeper bounces are counted with the last
+const unsigned int COUNTED_SAMPLES = 64; // pixels taking more samples are counted with the last
+
+// kinds of rays; depth 0 is the primary rays' bounce
+enum CountedRay
+{
+   PRIMARY_RAY, REFLECTED_RAY, TRANSMITTED_RAY, SHADOW_RAY, NUM_COUNTED_RAYS
+};
+const char *const COUNTED_RAY_NAMES[NUM_COUNTED_RAYS] =
+{ "primary", "reflected", "transmitted", "shadow" };
+
+/*---------------------------------------------------------------------------*/
+/* CLASS DEFINITIONS */
+/*
+ PURPOSE: counts of one thread's, or one frame's, work
+ REMARK: every field is a uint64_t count, so adding and clearing treat the whole struct
+ as an array of them. Triangle tests are counted per triangle of a batch, not per batch.
+ */
+struct TraceCounters
+{
+   uint64_t rays[NUM_COUNTED_RAYS][COUNTED_DEPTHS]; // by kind and bounce
+   uint64_t rayHits; // rays which hit something; the rest of the non-shadow rays missed
+   uint64_t shadowsBlocked; // shadow rays which found something in the way
+   uint64_t bvhNodes; // nodes whose box was tested
+   uint64_t bvhRejections; // of those, the ones the ray missed
+   uint64_t triangleTests;
+   uint64_t triangleHits;
+   uint64_t sphereTests;
+   uint64_t sphereHits;
+   uint64_t boxTests;
+   uint64_t boxHits;
+   uint64_t coneTests; // of capped cones, cylinders included
+   uint64_t coneHits;
+   uint64_t boardTests;
+   uint64_t boardHits;
+   uint64_t lightNodes; // of the LightTree, visited choosing lights
+   uint64_t lightsShaded; // exactly, from a hit point
+   uint64_t lightsSampled; // picked at random to stand for the dimmer lights of a hit point
+   uint64_t boundingSphereTests; // in Shape::doIIntersectWith
+   uint64_t boundingSphereRejections;
+   uint64_t pixels; // of finished frames, see countFramePixels
+   uint64_t samples; // primary samples traced
+   uint64_t samplesPerPixel[COUNTED_SAMPLES + 1]; // how many pixels took each count
+
+   TraceCounters()
+   {
+      clear();
+   }
+
+   void clear()
+   {
+      memset(this, 0, sizeof(*this));
+   }
+
+   void add(const TraceCounters& c)
+   {
+      uint64_t *to = (uint64_t *) this;
+      const uint64_t *from = (const uint64_t *) &c;
+      for (size_t i = 0; i < sizeof(*this) / sizeof(uint64_t); i++)
+         to[i] += from[i];
+   }
+
+   uint64_t totalRays(CountedRay kind) const
+   {
+      uint64_t total = 0;
+      for (unsigned int d = 0; d < COUNTED_DEPTHS; d++)
+         total += rays[kind][d];
+      return total;
+   }
+
+   // fraction of part in whole, 0 if whole is
+   static double ratio(uint64_t part, uint64_t whole)
+   {
+      return whole == 0 ? 0.0 : (double) part / whole;
+   }
+
+   /*
+    PURPOSE: lists the counters by name, along with a few ratios worked out from them
+    RECEIVES: out -- the name and value of each counter are appended to it
+    RETURNS: nothing
+    REMARKS: counts by depth are named kind_rays_depth_d, pixels by sample count
+    pixels_with_n_samples, the last of them counting every pixel with as many or more
+    */
+   void list(std::vector<std::pair<std::string, double> >& out) const
+   {
+      char name[64];
+      for (int k = 0; k < NUM_COUNTED_RAYS; k++)
+      {
+         for (unsigned int d = 0; d < COUNTED_DEPTHS; d++)
+         {
+            snprintf(name, sizeof(name), "%s_rays_depth_%u", COUNTED_RAY_NAMES[k], d);
+            out.push_back(std::make_pair(name, (double) rays[k][d]));
+         }
+         snprintf(name, sizeof(name), "%s_rays", COUNTED_RAY_NAMES[k]);
+         out.push_back(std::make_pair(name, (double) totalRays((CountedRay) k)));
+      }
+      uint64_t traced = totalRays(PRIMARY_RAY) + totalRays(REFLECTED_RAY)
+            + totalRays(TRANSMITTED_RAY);
+      out.push_back(std::make_pair("ray_hits", (double) rayHits));
+      out.push_back(std::make_pair("ray_misses", (double) (traced - rayHits)));
+      out.push_back(std::make_pair("ray_hit_ratio", ratio(rayHits, traced)));
+      out.push_back(std::make_pair("shadows_blocked", (double) shadowsBlocked));
+      out.push_back(std::make_pair("shadow_blocked_ratio",
+            ratio(shadowsBlocked, totalRays(SHADOW_RAY))));
+      out.push_back(std::make_pair("bvh_nodes", (double) bvhNodes));
+      out.push_back(std::make_pair("bvh_rejections", (double) bvhRejections));
+      out.push_back(std::make_pair("triangle_tests", (double) triangleTests));
+      out.push_back(std::make_pair("triangle_hits", (double) triangleHits));
+      out.push_back(std::make_pair("triangle_hit_ratio", ratio(triangleHits, triangleTests)));
+      out.push_back(std::make_pair("sphere_tests", (double) sphereTests));
+      out.push_back(std::make_pair("sphere_hits", (double) sphereHits));
+      out.push_back(std::make_pair("sphere_hit_ratio", ratio(sphereHits, sphereTests)));
+      out.push_back(std::make_pair("box_tests", (double) boxTests));
+      out.push_back(std::make_pair("box_hits", (double) boxHits));
+      out.push_back(std::make_pair("cone_tests", (double) coneTests));
+      out.push_back(std::make_pair("cone_hits", (double) coneHits));
+      out.push_back(std::make_pair("board_tests", (double) boardTests));
+      out.push_back(std::make_pair("board_hits", (double) boardHits));
+      out.push_back(std::make_pair("light_nodes", (double) lightNodes));
+      out.push_back(std::make_pair("lights_shaded", (double) lightsShaded));
+      out.push_back(std::make_pair("lights_sampled", (double) lightsSampled));
+      out.push_back(std::make_pair("bounding_sphere_tests", (double) boundingSphereTests));
+      out.push_back(std::make_pair("bounding_sphere_rejections",
+            (double) boundingSphereRejections));
+      out.push_back(std::make_pair("pixels", (double) pixels));
+      out.push_back(std::make_pair("samples", (double) samples));
+      out.push_back(std::make_pair("samples_per_pixel", ratio(samples, pixels)));
+      for (unsigned int n = 0; n <= COUNTED_SAMPLES; n++)
+      {
+         if (samplesPerPixel[n] == 0)
+            continue;
+         snprintf(name, sizeof(name), "pixels_with_%u_samples", n);
+         out.push_back(std::make_pair(name, (double) samplesPerPixel[n]));
+      }
+   }
+
+   /*
+    PURPOSE: writes the counters to a file
+    RECEIVES: filename -- file to write; JSON if its name ends in .json, else CSV
+    RETURNS: true if the file could be written
+    REMARKS: CSV has a name,value line per counter, JSON is one flat object
+    */
+   bool write(const char *filename) const
+   {
+      FILE *out = fopen(filename, "w");
+      if (!out)
+         return false;
+      std::vector<std::pair<std::string, double> > entries;
+      list(entries);
+      size_t length = strlen(filename);
+      bool json = length >= 5 && strcmp(filename + length - 5, ".json") == 0;
+      fprintf(out, json ? "{" : "counter,value\n");
+      for (size_t i = 0; i < entries.size(); i++)
+         fprintf(out, json ? "%s\n  \"%s\": %.15g" : "%s%s,%.15g\n", json && i > 0 ? "," : "",
+               entries[i].first.c_str(), entries[i].second);
+      fprintf(out, json ? "\n}\n" : "");
+      return fclose(out) == 0;
+   }
+};
+
+/*
+ PURPOSE: keeps track of the counters of every thread
+ REMARK: threads enrol the first time they count and retire when they end, handing
+ over what they counted so nothing is lost. collect must only be called while no thread
+ is counting, e.g. between frames.
+ */
+class CounterRegistry
+{
+private:
+   std::mutex _lock;
+   std::vector<TraceCounters *> _threads;
+   TraceCounters _retired; // counted by threads which have since ended
+
+public:
+   static CounterRegistry& instance()
+   {
+      static CounterRegistry registry;
+      return registry;
+   }
+
+   void enrol(TraceCounters *counters)
+   {
+      std::lock_guard<std::mutex> hold(_lock);
+      _threads.push_back(counters);
+   }
+
+   void retire(TraceCounters *counters)
+   {
+      std::lock_guard<std::mutex> hold(_lock);
+      _retired.add(*counters);
+      for (size_t i = 0; i < _threads.size(); i++)
+      {
+         if (_threads[i] == counters)
+         {
+            _threads[i] = _threads.back();
+            _threads.pop_back();
+            break;
+         }
+      }
+   }
+
+   // adds up everything counted since the last collect, and starts counting from 0 again
+   TraceCounters collect()
+   {
+      std::lock_guard<std::mutex> hold(_lock);
+      TraceCounters total = _retired;
+      _retired.clear();
+      for (size_t i = 0; i < _threads.size(); i++)
+      {
+         total.add(*_threads[i]);
+         _threads[i]->clear();
+      }
+      return total;
+   }
+};
+
+// a thread's counters, enrolled for as long as the thread lives
+struct ThreadCounters
+{
+   TraceCounters counters;
+
+   ThreadCounters()
+   {
+      CounterRegistry::instance().enrol(&counters);
+   }
+   ~ThreadCounters()
+   {
+      CounterRegistry::instance().retire(&counters);
+   }
+};
+
+/*---------------------------------------------------------------------------*/
+/* FUNCTIONS */
+inline TraceCounters& threadCounters()
+{
+   thread_local ThreadCounters mine;
+   return mine.counters;
+}
+
+// everything counted by every thread since the last call, see CounterRegistry::collect
+inline TraceCounters collectTraceCounters()
+{
+   return CounterRegistry::instance().collect();
+}
+
+// COUNT(field, n) adds n to a field of this thread's TraceCounters in counting builds;
+// COUNTING(statement) runs a statement only in them
+#ifdef TRACE_COUNTERS
+#define COUNT(field, n) (threadCounters().field += (n))
+#define COUNTING(statement) statement
+#else
+#define COUNT(field, n) ((void) 0)
+#define COUNTING(statement)
+#endif
+
+#endif
@@ -0,0 +1,1301 @@
+#ifndef DISTRIBUTEDRENDERER_H
+#define DISTRIBUTEDRENDERER_H
+
+/*---------------------------------------------------------------------------*/
+/* INCLUDES */
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <iostream>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "RayTracer.h"
+#include "SceneCache.h"
+
+/*
+ Renders a frame on several processes, on one machine or on several. A TileCoordinator
+ listens on a socket; every TileWorker connecting to it is sent the text of the scene
+ file once, which it parses and compiles itself, and is then handed regions of the
+ screen to trace as jobs. Workers trace a job on a ThreadPool of their own and send its
+ pixels back packed with packTile.
+ Jobs are handed out as workers finish them, a couple at a time so a worker has its
+ next job by the time it sends a result, which spreads the work by how fast each worker
+ turns out to be. A worker which drops its connection, or is silent for too long, is
+ given up on and its jobs go to the others; once there are no jobs left to hand out, a
+ job out for much longer than jobs usually take is handed to an idle worker as well and
+ whichever result comes first is kept.
+ Which samples a pixel takes doesn't depend on who traces it (see traceTile), but the
+ edge pass of traceRayScreen does depend on the pixels around it. So that jobs stand on
+ their own, a worker traces the first pass of a job over its region and a border of one
+ pixel around it, marks the edges of the region and then traces its second pass; the
+ image is the one traceRayScreen makes, for a few percent of the first pass traced
+ twice along the borders of the regions.
+ Messages are a TileMessageHeader followed by its length in bytes of payload, numbers in
+ the byte order of the machine, so all the processes have to share one:
+ HELLO (worker) -- protocol version, sizeof(Real)
+ SCENE -- hash of the scene text (see hashSceneText), the text
+ FRAME -- frame number, width, height, bottomX, bottomY, then the SamplingSettings:
+ minSamples, maxSamples, edgeSamples, sampler, errorThreshold, contrastThreshold
+ JOB -- frame number, job number, region x0, y0, x1, y1
+ RESULT (worker) -- frame number, job number, primary, secondary and shadow rays traced,
+ the packed pixels
+ FAILED (either) -- what went wrong; the sender gives up
+ BYE -- the worker is done
+ Addresses are host:port for TCP, anything else is the path of a Unix domain socket.
+ */
+
+/*---------------------------------------------------------------------------*/
+/*  VARIABLES */
+const uint32_t TILE_PROTOCOL_VERSION = 1;
+const int JOB_SIZE = 64; // edge length in pixels of the regions handed out as jobs
+const unsigned int JOBS_IN_FLIGHT = 2; // most jobs a worker is given at once
+const unsigned int MAX_JOB_COPIES = 2; // most workers a job is out with at once
+const double SLOW_JOB_FACTOR = 3; // a job out this many times as long as jobs take on
+// average is handed to an idle worker as well
+const double SILENT_JOB_FACTOR = 20; // a worker with jobs which hasn't been heard from in
+// this many times as long as jobs take, or in WORKER_TIMEOUT_MILLIS, is given up on
+const double WORKER_TIMEOUT_MILLIS = 10000;
+const double NO_WORKERS_TIMEOUT_MILLIS = 30000; // a frame fails when it has had no workers
+// for this long
+const double CONNECT_TIMEOUT_MILLIS = 10000; // how long a worker keeps trying to reach
+// the coordinator, which may not be listening yet
+const int POLL_MILLIS = 20; // how often the coordinator looks for slow and silent workers
+const uint32_t MAX_MESSAGE_BYTES = 1u << 30;
+const unsigned int MAX_MESSAGE_SAMPLES = 1024; // most samples per pixel a message may ask for
+
+enum TileMessageType
+{
+   HELLO_MESSAGE = 1,
+   SCENE_MESSAGE,
+   FRAME_MESSAGE,
+   JOB_MESSAGE,
+   RESULT_MESSAGE,
+   FAILED_MESSAGE,
+   BYE_MESSAGE,
+   RENDER_MESSAGE, // to a RenderDaemon, see RenderDaemon.h
+   IMAGE_MESSAGE
+};
+
+/*---------------------------------------------------------------------------*/
+/* CLASS DEFINITIONS */
+struct TileMessageHeader
+{
+   uint32_t type;
+   uint32_t length; // of the payload after the header
+};
+
+/*
+ PURPOSE: builds a message to send
+ REMARK: the header is filled in when the message is sent
+ */
+class MessageWriter
+{
+private:
+   vector<char> _bytes;
+
+public:
+   explicit MessageWriter(TileMessageType type)
+   {
+      TileMessageHeader header = { (uint32_t) type, 0 };
+      putBytes(&header, sizeof(header));
+   }
+
+   template<class T>
+   void put(const T& value)
+   {
+      putBytes(&value, sizeof(T));
+   }
+
+   void putBytes(const void *p, size_t size)
+   {
+      _bytes.insert(_bytes.end(), (const char *) p, (const char *) p + size);
+   }
+
+   // the message with its header filled in
+   const vector<char>& bytes()
+   {
+      TileMessageHeader header;
+      memcpy(&header, &_bytes[0], sizeof(header));
+      header.length = _bytes.size() - sizeof(header);
+      memcpy(&_bytes[0], &header, sizeof(header));
+      return _bytes;
+   }
+};
+
+/*
+ PURPOSE: reads the payload of a message received
+ REMARK: throws runtime_error if the payload is shorter than what is read from it
+ */
+class MessageReader
+{
+private:
+   const char *_at;
+   const char *_end;
+
+public:
+   explicit MessageReader(const vector<char>& payload)
+   {
+      _at = payload.empty() ? 0 : &payload[0];
+      _end = _at + payload.size();
+   }
+
+   template<class T>
+   T get()
+   {
+      if ((size_t) (_end - _at) < sizeof(T))
+         throw runtime_error("tile message too short");
+      T value;
+      memcpy(&value, _at, sizeof(T));
+      _at += sizeof(T);
+      return value;
+   }
+
+   // whatever is left of the payload; size is set to its length
+   const char *rest(size_t& size)
+   {
+      size = _end - _at;
+      const char *p = _at;
+      _at = _end;
+      return p;
+   }
+};
+
+/*---------------------------------------------------------------------------*/
+/* FUNCTIONS */
+inline double millisSince(chrono::steady_clock::time_point start)
+{
+   return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+/*
+ PURPOSE: run-length codes bytes
+ RECEIVES:
+ bytes, size -- what to code
+ out -- the code is appended to it
+ RETURNS: nothing
+ REMARKS: PackBits: a control byte c below 128 is followed by c + 1 bytes taken as they
+ are, one from 128 up by a byte repeated c - 125 times
+ */
+inline void packBytes(const unsigned char *bytes, size_t size, vector<char>& out)
+{
+   size_t i = 0;
+   while (i < size)
+   {
+      size_t run = 1;
+      while (i + run < size && run < 130 && bytes[i + run] == bytes[i])
+         run++;
+      if (run >= 3)
+      {
+         out.push_back((char) (run + 125));
+         out.push_back((char) bytes[i]);
+         i += run;
+         continue;
+      }
+      // literals up to the next run worth coding as one
+      size_t literal = 0;
+      while (i + literal < size && literal < 128
+            && !(i + literal + 2 < size && bytes[i + literal] == bytes[i + literal + 1]
+                  && bytes[i + literal] == bytes[i + literal + 2]))
+         literal++;
+      out.push_back((char) (literal - 1));
+      out.insert(out.end(), bytes + i, bytes + i + literal);
+      i += literal;
+   }
+}
+
+/*
+ PURPOSE: undoes packBytes
+ RECEIVES:
+ code, size -- what packBytes made
+ bytes -- set to the bytes it was made from
+ expected -- how many bytes that has to be
+ RETURNS: nothing
+ REMARKS: throws runtime_error if the code is damaged or comes out at another length
+ */
+inline void unpackBytes(const char *code, size_t size, vector<unsigned char>& bytes,
+      size_t expected)
+{
+   bytes.clear();
+   bytes.reserve(expected);
+   const unsigned char *p = (const unsigned char *) code, *end = p + size;
+   while (p < end)
+   {
+      unsigned int c = *p++;
+      size_t n = c < 128 ? c + 1 : c - 125;
+      if (bytes.size() + n > expected || (c < 128 ? (size_t) (end - p) < n : p == end))
+         throw runtime_error("damaged tile result");
+      if (c < 128)
+      {
+         bytes.insert(bytes.end(), p, p + n);
+         p += n;
+      }
+      else
+         bytes.insert(bytes.end(), n, *p++);
+   }
+   if (bytes.size() != expected)
+      throw runtime_error("damaged tile result");
+}
+
+/*
+ PURPOSE: packs the pixels of a region of a frame to send them
+ RECEIVES:
+ frame -- where the pixels are
+ region -- which of them
+ out -- the packed pixels are appended to it
+ RETURNS: nothing
+ REMARKS: lossless. Every pixel is four 32 bit words, its colour channels and its sample
+ count, each XORed with the same word of the pixel before it, so a pixel much like the
+ one before it comes out mostly zero bits. The words are cut into four planes of bytes,
+ least significant first, and the planes run-length coded together: sky and flat parts
+ of the board become a few long runs, and even in noisy parts the planes of exponent and
+ high mantissa bits are mostly zeros.
+ */
+inline void packTile(const FrameBuffer& frame, const Tile& region, vector<char>& out)
+{
+   size_t words = 4 * (size_t) (region.x1 - region.x0) * (region.y1 - region.y0);
+   vector<unsigned char> planes(4 * words);
+   uint32_t previous[4] = { 0, 0, 0, 0 };
+   size_t k = 0;
+   for (int y = region.y0; y < region.y1; y++)
+   {
+      for (int x = region.x0; x < region.x1; x++)
+      {
+         uint32_t word[4];
+         memcpy(word, frame.pixel(x, y), 3 * sizeof(float));
+         word[3] = frame.sampleCount(x, y);
+         for (int c = 0; c < 4; c++, k++)
+         {
+            uint32_t delta = word[c] ^ previous[c];
+            previous[c] = word[c];
+            for (int b = 0; b < 4; b++)
+               planes[b * words + k] = (unsigned char) (delta >> (8 * b));
+         }
+      }
+   }
+   packBytes(planes.empty() ? 0 : &planes[0], planes.size(), out);
+}
+
+/*
+ PURPOSE: puts pixels packed by packTile into a frame
+ RECEIVES:
+ packed, size -- what packTile made
+ region -- which pixels they are
+ frame -- where to put them
+ RETURNS: nothing
+ REMARKS: throws runtime_error if they don't unpack to the region
+ */
+inline void unpackTile(const char *packed, size_t size, const Tile& region,
+      FrameBuffer& frame)
+{
+   size_t words = 4 * (size_t) (region.x1 - region.x0) * (region.y1 - region.y0);
+   vector<unsigned char> planes;
+   unpackBytes(packed, size, planes, 4 * words);
+   uint32_t previous[4] = { 0, 0, 0, 0 };
+   size_t k = 0;
+   for (int y = region.y0; y < region.y1; y++)
+   {
+      for (int x = region.x0; x < region.x1; x++)
+      {
+         for (int c = 0; c < 4; c++, k++)
+         {
+            uint32_t delta = 0;
+            for (int b = 0; b < 4; b++)
+               delta |= (uint32_t) planes[b * words + k] << (8 * b);
+            previous[c] ^= delta;
+         }
+         float color[3];
+         memcpy(color, previous, sizeof(color));
+         frame.setPixel(x, y, color[0], color[1], color[2]);
+         frame.setSampleCount(x, y, previous[3]);
+      }
+   }
+}
+
+/*
+ PURPOSE: cuts a region of the screen into tiles
+ RECEIVES: region -- pixels to cut up
+ RETURNS: the tiles, in Morton order within the region
+ REMARKS: see makeTiles
+ */
+inline vector<Tile> regionTiles(const Tile& region)
+{
+   vector<Tile> tiles = makeTiles(region.x1 - region.x0, region.y1 - region.y0);
+   for (size_t t = 0; t < tiles.size(); t++)
+   {
+      tiles[t].x0 += region.x0;
+      tiles[t].x1 += region.x0;
+      tiles[t].y0 += region.y0;
+      tiles[t].y1 += region.y0;
+   }
+   return tiles;
+}
+
+// true if address names a TCP host:port rather than a Unix domain socket
+inline bool isTcpAddress(const string& address)
+{
+   return address.find(':') != string::npos && address.find('/') == string::npos;
+}
+
+/*
+ PURPOSE: opens a socket for an address
+ RECEIVES:
+ address -- host:port or the path of a Unix domain socket; the host may be left out
+ when listening, to listen on every interface
+ listening -- true to listen on the address, false to connect to it
+ RETURNS: the socket, or -1 if it couldn't be opened, with errno saying why
+ REMARKS: a Unix domain socket left behind by an earlier listener, one nothing accepts
+ connections on any more, is removed first. If a listener is still there, or anything
+ other than a socket is at the path, it is left alone and the bind fails, with
+ EADDRINUSE. TCP sockets send small messages straight away rather than wait for more.
+ */
+inline int openSocket(const string& address, bool listening)
+{
+   int fd = -1;
+   if (!isTcpAddress(address))
+   {
+      struct sockaddr_un where;
+      memset(&where, 0, sizeof(where));
+      where.sun_family = AF_UNIX;
+      if (address.size() >= sizeof(where.sun_path))
+      {
+         errno = ENAMETOOLONG;
+         return -1;
+      }
+      strcpy(where.sun_path, address.c_str());
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd < 0)
+         return -1;
+      struct stat info;
+      if (listening && lstat(address.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+      {
+         int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+         bool stale = probe >= 0
+               && connect(probe, (struct sockaddr *) &where, sizeof(where)) != 0
+               && errno == ECONNREFUSED;
+         if (probe >= 0)
+            close(probe);
+         if (!stale)
+         {
+            close(fd);
+            errno = EADDRINUSE;
+            return -1;
+         }
+         unlink(address.c_str());
+      }
+      if ((listening ? ::bind(fd, (struct sockaddr *) &where, sizeof(where))
+            : connect(fd, (struct sockaddr *) &where, sizeof(where))) != 0)
+      {
+         int error = errno;
+         close(fd);
+         errno = error;
+         return -1;
+      }
+   }
+   else
+   {
+      size_t colon = address.rfind(':');
+      string host = address.substr(0, colon), port = address.substr(colon + 1);
+      struct addrinfo hints, *found;
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      hints.ai_flags = listening ? AI_PASSIVE : 0;
+      if (getaddrinfo(host.empty() ? 0 : host.c_str(), port.c_str(), &hints, &found) != 0)
+      {
+         errno = EADDRNOTAVAIL;
+         return -1;
+      }
+      int error = EADDRNOTAVAIL;
+      for (struct addrinfo *a = found; a && fd < 0; a = a->ai_next)
+      {
+         fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+         if (fd < 0)
+         {
+            error = errno;
+            continue;
+         }
+         int on = 1;
+         if (listening)
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+         setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+         if ((listening ? ::bind(fd, a->ai_addr, a->ai_addrlen)
+               : connect(fd, a->ai_addr, a->ai_addrlen)) != 0)
+         {
+            error = errno;
+            close(fd);
+            fd = -1;
+         }
+      }
+      freeaddrinfo(found);
+      if (fd < 0)
+      {
+         errno = error;
+         return -1;
+      }
+   }
+   if (listening && listen(fd, SOMAXCONN) != 0)
+   {
+      int error = errno;
+      close(fd);
+      errno = error;
+      return -1;
+   }
+#ifdef __MAC__
+   int on = 1;
+   setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+   return fd;
+}
+
+/*
+ PURPOSE: sends a whole message
+ RECEIVES:
+ fd -- socket to send it on
+ message -- the message, see MessageWriter
+ RETURNS: true if it was sent, false if the other end has gone away
+ REMARKS: a peer which has gone away is an error to handle, not a SIGPIPE
+ */
+inline bool sendMessage(int fd, MessageWriter& message)
+{
+   const vector<char>& bytes = message.bytes();
+#ifdef MSG_NOSIGNAL
+   const int flags = MSG_NOSIGNAL;
+#else
+   const int flags = 0;
+#endif
+   size_t sent = 0;
+   while (sent < bytes.size())
+   {
+      ssize_t n = send(fd, &bytes[sent], bytes.size() - sent, flags);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         return false;
+      sent += n;
+   }
+   return true;
+}
+
+/*
+ PURPOSE: waits for the next message
+ RECEIVES:
+ fd -- socket to read it from
+ type -- set to the type of the message
+ payload -- set to what follows its header
+ maxLength -- longest payload to take; a longer one isn't read
+ RETURNS: true if a message came, false if the other end closed the connection
+ REMARKS: throws runtime_error if the connection fails part way through a message or
+ the message is too long
+ */
+inline bool receiveMessage(int fd, uint32_t& type, vector<char>& payload,
+      uint32_t maxLength = MAX_MESSAGE_BYTES)
+{
+   TileMessageHeader header;
+   char *into = (char *) &header;
+   size_t wanted = sizeof(header), got = 0;
+   for (int part = 0; part < 2; part++)
+   {
+      while (got < wanted)
+      {
+         ssize_t n = read(fd, into + got, wanted - got);
+         if (n < 0 && errno == EINTR)
+            continue;
+         if (n == 0 && part == 0 && got == 0)
+            return false;
+         if (n <= 0)
+            throw runtime_error("connection lost in the middle of a message");
+         got += n;
+      }
+      if (part == 0)
+      {
+         if (header.length > maxLength)
+            throw runtime_error("message too long");
+         type = header.type;
+         payload.resize(header.length);
+         into = payload.empty() ? 0 : &payload[0];
+         wanted = payload.size();
+         got = 0;
+      }
+   }
+   return true;
+}
+
+// adds SamplingSettings to a message, in the order FRAME has them
+inline void putSettings(MessageWriter& message, const SamplingSettings& settings)
+{
+   message.put((uint32_t) settings.minSamples);
+   message.put((uint32_t) settings.maxSamples);
+   message.put((uint32_t) settings.edgeSamples);
+   message.put((uint32_t) settings.sampler);
+   message.put((double) settings.errorThreshold);
+   message.put((double) settings.contrastThreshold);
+}
+
+// reads the SamplingSettings of a message; throws runtime_error if they are out of range
+inline SamplingSettings getSettings(MessageReader& in)
+{
+   SamplingSettings settings;
+   settings.minSamples = in.get<uint32_t>();
+   settings.maxSamples = in.get<uint32_t>();
+   settings.edgeSamples = in.get<uint32_t>();
+   uint32_t sampler = in.get<uint32_t>();
+   if (sampler > BLUE_NOISE_SAMPLER)
+      throw runtime_error("unknown sampler");
+   settings.sampler = (SamplerType) sampler;
+   settings.errorThreshold = in.get<double>();
+   settings.contrastThreshold = in.get<double>();
+   if (settings.minSamples == 0 || settings.minSamples > settings.maxSamples)
+      throw runtime_error("minimum samples not between 1 and the maximum");
+   if (settings.maxSamples > MAX_MESSAGE_SAMPLES || settings.edgeSamples > MAX_MESSAGE_SAMPLES)
+      throw runtime_error("samples per pixel out of range");
+   if (!isfinite(settings.errorThreshold) || settings.errorThreshold < 0
+         || !isfinite(settings.contrastThreshold) || settings.contrastThreshold < 0)
+      throw runtime_error("sampling threshold out of range");
+   return settings;
+}
+
+// tells the other end what went wrong before giving up on it; it may not be listening
+inline void sendFailure(int fd, const char *what)
+{
+   MessageWriter failed(FAILED_MESSAGE);
+   failed.putBytes(what, strlen(what));
+   sendMessage(fd, failed);
+}
+
+/*---------------------------------------------------------------------------*/
+/* CLASS DEFINITIONS */
+// what happened in the last frame a TileCoordinator rendered
+struct DistributedStats
+{
+   unsigned int workers; // which sent results
+   unsigned int jobs;
+   unsigned int reissued; // times a job was handed out again, to replace or race a worker
+   unsigned int lost; // workers given up on
+   uint64_t pixelBytes; // of the results' pixels before packing
+   uint64_t packedBytes; // of the results' pixels as sent
+
+   DistributedStats()
+   {
+      workers = jobs = reissued = lost = 0;
+      pixelBytes = packedBytes = 0;
+   }
+};
+
+/*
+ PURPOSE: a scene built from the text of a scene file, ready to trace
+ REMARK: the objects live in an arena of the scene's own and go with it
+ */
+struct LoadedScene
+{
+   std::unique_ptr<SceneArena> arena;
+   std::unique_ptr<Shape> root; // goes before the arena it lives in
+   CompiledScene compiled;
+   vector<Light> lights;
+   SceneCamera camera;
+   LightTree lightTree;
+   bool mapped; // from a SceneCache rather than parsed and compiled
+   double millis; // it took to load
+
+   LoadedScene()
+   {
+      mapped = false;
+      millis = 0;
+   }
+
+   /*
+    PURPOSE: loads a scene, replacing whatever was loaded before
+    RECEIVES:
+    text, size -- text of the scene file
+    hash -- its hash, see hashSceneText
+    cacheDir -- directory of SceneCache files, or 0 for none
+    RETURNS: nothing
+    REMARKS: with a cache directory the compiled scene is mapped from there if it is
+    cached, and cached if it isn't, like RenderBench -cache does. Throws runtime_error
+    if the text has an error in it.
+    */
+   void load(const char *text, size_t size, uint64_t hash, const char *cacheDir)
+   {
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      string cacheFile;
+      mapped = false;
+      if (cacheDir)
+      {
+         cacheFile = SceneCache::path(cacheDir, hash);
+         mapped = SceneCache::load(cacheFile.c_str(), hash, compiled, lights, camera);
+      }
+      if (!mapped)
+      {
+         root.reset();
+         arena.reset(new SceneArena);
+         ArenaScope inArena(*arena);
+         root.reset(new Shape(BOARD_POSITION, Material(), 0, false));
+         lights.clear();
+         camera = SceneCamera();
+         SceneFileStats stats;
+         SceneParser parser(text, size, "scene text");
+         parser.parse(*root, lights, camera, stats);
+         compiled.compile(*root);
+         if (cacheDir)
+            SceneCache::save(cacheFile.c_str(), hash, compiled, lights, camera);
+      }
+      lightTree.build(lights);
+      millis = millisSince(start);
+   }
+};
+
+/*
+ PURPOSE: hands the jobs of frames out to TileWorkers and puts their results together
+ REMARK: workers can connect at any time and get the scene when they do; between frames
+ they wait for the next one. A worker which fails or sends a damaged result is dropped,
+ saying why on cerr, and its jobs go to the others. Throws runtime_error if every
+ worker has failed, e.g. because the scene has an error in it, or if a frame has had no
+ workers for NO_WORKERS_TIMEOUT_MILLIS.
+ */
+class TileCoordinator
+{
+private:
+   struct Connection
+   {
+      int fd;
+      vector<char> input; // received, not yet a whole message
+      vector<unsigned int> jobs; // of this frame, which it has been given
+      bool ready; // said hello and was sent the scene
+      bool worked; // sent a result this frame
+      bool lost;
+      chrono::steady_clock::time_point heard; // last time anything came from it
+   };
+
+   struct Job
+   {
+      Tile region;
+      bool done;
+      unsigned int copies; // workers it is out with
+      unsigned int handedOut; // times
+      chrono::steady_clock::time_point sent; // to the last of them
+   };
+
+   int _listener;
+   bool _tcp;
+   string _socketPath; // to remove when done, if the socket is a Unix domain one
+   MessageWriter _sceneMessage;
+   MessageWriter _frameMessage;
+   vector<Connection> _connections;
+   vector<Job> _jobs;
+   deque<unsigned int> _unassigned;
+   size_t _remaining; // jobs of the frame without a result
+   FrameBuffer *_frame;
+   uint32_t _frameNumber;
+   RayCounts _counts;
+   DistributedStats _stats;
+   double _jobMillis; // total time from handing out to result of the jobs timed
+   unsigned int _jobsTimed;
+   string _failure; // why the last worker to fail this frame did
+
+   TileCoordinator(const TileCoordinator&);
+   TileCoordinator& operator=(const TileCoordinator&);
+
+   double averageJobMillis() const
+   {
+      return _jobsTimed == 0 ? HUGE_VAL : _jobMillis / _jobsTimed;
+   }
+
+   // gives up on a worker; jobs it had which nobody else has go back to be handed out.
+   // Given a reason, it is told on cerr and kept for when no workers are left.
+   void drop(Connection& c, const string& why = string())
+   {
+      if (c.lost)
+         return;
+      if (!why.empty())
+      {
+         cerr << "dropping worker: " << why << endl;
+         _failure = why;
+      }
+      for (size_t i = 0; i < c.jobs.size(); i++)
+      {
+         Job& job = _jobs[c.jobs[i]];
+         job.copies--;
+         if (!job.done && job.copies == 0)
+            _unassigned.push_front(c.jobs[i]);
+      }
+      c.jobs.clear();
+      close(c.fd);
+      c.lost = true;
+      if (c.ready)
+         _stats.lost++;
+   }
+
+   /*
+    PURPOSE: picks the next job for a worker
+    RECEIVES: c -- worker with room for another job
+    RETURNS: the job, or -1 if there is none for it
+    REMARKS: jobs nobody has come first. Once they are all out, the job which has been
+    out longest is handed out again, if it has been out SLOW_JOB_FACTOR times as long
+    as jobs take on average and this worker doesn't already have it.
+    */
+   int nextJob(const Connection& c)
+   {
+      while (!_unassigned.empty())
+      {
+         unsigned int j = _unassigned.front();
+         _unassigned.pop_front();
+         if (!_jobs[j].done)
+            return j;
+      }
+      double slow = SLOW_JOB_FACTOR * averageJobMillis();
+      int oldest = -1;
+      for (size_t i = 0; i < _connections.size(); i++)
+      {
+         const Connection& other = _connections[i];
+         for (size_t k = 0; !other.lost && k < other.jobs.size(); k++)
+         {
+            unsigned int j = other.jobs[k];
+            const Job& job = _jobs[j];
+            if (job.done || job.copies >= MAX_JOB_COPIES || millisSince(job.sent) < slow
+                  || find(c.jobs.begin(), c.jobs.end(), j) != c.jobs.end())
+               continue;
+            if (oldest < 0 || job.sent < _jobs[oldest].sent)
+               oldest = j;
+         }
+      }
+      return oldest;
+   }
+
+   // fills every worker up to JOBS_IN_FLIGHT jobs, as far as there are jobs for them
+   void handOutJobs()
+   {
+      for (size_t i = 0; i < _connections.size(); i++)
+      {
+         Connection& c = _connections[i];
+         while (c.ready && !c.lost && c.jobs.size() < JOBS_IN_FLIGHT)
+         {
+            int j = nextJob(c);
+            if (j < 0)
+               break;
+            Job& job = _jobs[j];
+            MessageWriter message(JOB_MESSAGE);
+            message.put(_frameNumber);
+            message.put((uint32_t) j);
+            message.put((int32_t) job.region.x0);
+            message.put((int32_t) job.region.y0);
+            message.put((int32_t) job.region.x1);
+            message.put((int32_t) job.region.y1);
+            _stats.reissued += job.handedOut > 0;
+            job.handedOut++;
+            job.copies++;
+            job.sent = chrono::steady_clock::now();
+            c.jobs.push_back(j);
+            if (!sendMessage(c.fd, message))
+               drop(c);
+         }
+      }
+   }
+
+   // takes in a worker's result, unless another worker's came first; throws
+   // runtime_error if the result is damaged, leaving the job with the worker
+   void takeResult(Connection& c, const vector<char>& payload)
+   {
+      MessageReader in(payload);
+      uint32_t frameNumber = in.get<uint32_t>(), j = in.get<uint32_t>();
+      RayCounts counts;
+      counts.primary = in.get<uint64_t>();
+      counts.secondary = in.get<uint64_t>();
+      counts.shadow = in.get<uint64_t>();
+      vector<unsigned int>::iterator mine = find(c.jobs.begin(), c.jobs.end(), j);
+      if (frameNumber != _frameNumber || mine == c.jobs.end())
+         return; // a slow copy of a job of an earlier frame
+      Job& job = _jobs[j];
+      size_t size;
+      const char *packed = in.rest(size);
+      if (!job.done)
+         unpackTile(packed, size, job.region, *_frame);
+      c.jobs.erase(mine);
+      job.copies--;
+      if (job.done)
+         return;
+
+      job.done = true;
+      _remaining--;
+      c.worked = true;
+      _counts.add(counts);
+      _jobMillis += millisSince(job.sent);
+      _jobsTimed++;
+      _stats.packedBytes += size;
+      _stats.pixelBytes += 16 * (uint64_t) (job.region.x1 - job.region.x0)
+            * (job.region.y1 - job.region.y0);
+   }
+
+   // acts on one message from a worker
+   void receive(Connection& c, uint32_t type, const vector<char>& payload)
+   {
+      if (type == HELLO_MESSAGE)
+      {
+         MessageReader in(payload);
+         uint32_t version = in.get<uint32_t>(), realSize = in.get<uint32_t>();
+         if (version != TILE_PROTOCOL_VERSION || realSize != sizeof(Real))
+         {
+            sendFailure(c.fd, "worker of another version or precision");
+            drop(c);
+            return;
+         }
+         c.ready = true;
+         if (!sendMessage(c.fd, _sceneMessage) || !sendMessage(c.fd, _frameMessage))
+            drop(c);
+      }
+      else if (type == RESULT_MESSAGE)
+      {
+         try
+         {
+            takeResult(c, payload);
+         }
+         catch (const exception& e)
+         {
+            drop(c, e.what());
+         }
+      }
+      else if (type == FAILED_MESSAGE)
+         drop(c, string(payload.begin(), payload.end()));
+      else
+         drop(c);
+   }
+
+   // reads what a worker has sent and acts on every whole message in it
+   void readFrom(Connection& c)
+   {
+      char buffer[64 * 1024];
+      ssize_t n = read(c.fd, buffer, sizeof(buffer));
+      if (n < 0 && errno == EINTR)
+         return;
+      if (n <= 0)
+      {
+         drop(c);
+         return;
+      }
+      c.heard = chrono::steady_clock::now();
+      c.input.insert(c.input.end(), buffer, buffer + n);
+      size_t used = 0;
+      TileMessageHeader header;
+      while (!c.lost && c.input.size() - used >= sizeof(header))
+      {
+         memcpy(&header, &c.input[used], sizeof(header));
+         if (header.length > MAX_MESSAGE_BYTES)
+         {
+            drop(c);
+            break;
+         }
+         if (c.input.size() - used - sizeof(header) < header.length)
+            break;
+         vector<char> payload(c.input.begin() + used + sizeof(header),
+               c.input.begin() + used + sizeof(header) + header.length);
+         used += sizeof(header) + header.length;
+         receive(c, header.type, payload);
+      }
+      if (!c.lost)
+         c.input.erase(c.input.begin(), c.input.begin() + used);
+   }
+
+   // waits up to POLL_MILLIS for workers to connect or send something
+   void poll()
+   {
+      vector<struct pollfd> fds(1 + _connections.size());
+      fds[0].fd = _listener;
+      fds[0].events = POLLIN;
+      for (size_t i = 0; i < _connections.size(); i++)
+      {
+         fds[1 + i].fd = _connections[i].fd;
+         fds[1 + i].events = POLLIN;
+      }
+      if (::poll(&fds[0], fds.size(), POLL_MILLIS) <= 0)
+         return;
+
+      for (size_t i = 0; i < _connections.size(); i++)
+         if (fds[1 + i].revents != 0)
+            readFrom(_connections[i]);
+
+      if (fds[0].revents & POLLIN)
+      {
+         int fd = accept(_listener, 0, 0);
+         if (fd >= 0)
+         {
+#ifdef __MAC__
+            int on = 1;
+            setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+            if (_tcp)
+            {
+               int on = 1;
+               setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            }
+            Connection c;
+            c.fd = fd;
+            c.ready = c.worked = c.lost = false;
+            c.heard = chrono::steady_clock::now();
+            _connections.push_back(c);
+         }
+      }
+   }
+
+   // gives up on workers which have jobs but haven't been heard from in a long while
+   void dropSilentWorkers()
+   {
+      double silent = max(WORKER_TIMEOUT_MILLIS, SILENT_JOB_FACTOR * averageJobMillis());
+      for (size_t i = 0; i < _connections.size(); i++)
+         if (!_connections[i].lost && !_connections[i].jobs.empty()
+               && millisSince(_connections[i].heard) > silent)
+            drop(_connections[i]);
+
+      size_t kept = 0;
+      for (size_t i = 0; i < _connections.size(); i++)
+         if (!_connections[i].lost)
+            _connections[kept++] = _connections[i];
+      _connections.resize(kept);
+   }
+
+   bool haveWorkers() const
+   {
+      for (size_t i = 0; i < _connections.size(); i++)
+         if (_connections[i].ready && !_connections[i].lost)
+            return true;
+      return false;
+   }
+
+public:
+   /*
+    PURPOSE: starts listening for workers
+    RECEIVES:
+    address -- where to listen, see openSocket
+    sceneText, size -- the scene file to send the workers
+    RETURNS: nothing
+    REMARKS: throws runtime_error if the address can't be listened on
+    */
+   TileCoordinator(const char *address, const char *sceneText, size_t size) :
+         _sceneMessage(SCENE_MESSAGE), _frameMessage(FRAME_MESSAGE)
+   {
+      _listener = openSocket(address, true);
+      if (_listener < 0)
+         throw runtime_error(string("can't listen on ") + address + ": " + strerror(errno));
+      _tcp = isTcpAddress(address);
+      if (!_tcp)
+         _socketPath = address;
+      _sceneMessage.put(hashSceneText(sceneText, size));
+      _sceneMessage.putBytes(sceneText, size);
+      _remaining = 0;
+      _frame = 0;
+      _frameNumber = 0;
+      _jobMillis = 0;
+      _jobsTimed = 0;
+   }
+
+   // lets the workers go
+   ~TileCoordinator()
+   {
+      for (size_t i = 0; i < _connections.size(); i++)
+      {
+         if (_connections[i].lost)
+            continue;
+         MessageWriter bye(BYE_MESSAGE);
+         sendMessage(_connections[i].fd, bye);
+         close(_connections[i].fd);
+      }
+      close(_listener);
+      if (!_socketPath.empty())
+         unlink(_socketPath.c_str());
+   }
+
+   /*
+    PURPOSE: renders a frame on the workers
+    RECEIVES:
+    frame -- FrameBuffer to write the pixels to; its size gives the size of the screen
+    bottomX, bottomY -- where the screen starts, see makeScreenSetup; the camera is the
+    scene file's
+    settings -- how many samples to take per pixel
+    counts -- if given, the rays the workers traced for the frame are added to it
+    RETURNS: nothing
+    REMARKS: the pixels are those traceRayScreen would make
+    */
+   void render(FrameBuffer& frame, int bottomX, int bottomY,
+         const SamplingSettings& settings = SamplingSettings(), RayCounts *counts = 0)
+   {
+      _frameNumber++;
+      _frameMessage = MessageWriter(FRAME_MESSAGE);
+      _frameMessage.put(_frameNumber);
+      _frameMessage.put((int32_t) frame.width());
+      _frameMessage.put((int32_t) frame.height());
+      _frameMessage.put((int32_t) bottomX);
+      _frameMessage.put((int32_t) bottomY);
+      putSettings(_frameMessage, settings);
+
+      _frame = &frame;
+      _counts = RayCounts();
+      _stats = DistributedStats();
+      _failure.clear();
+      vector<Tile> regions = makeTiles(frame.width(), frame.height(), JOB_SIZE);
+      _jobs.resize(regions.size());
+      _unassigned.clear();
+      for (size_t j = 0; j < regions.size(); j++)
+      {
+         _jobs[j].region = regions[j];
+         _jobs[j].done = false;
+         _jobs[j].copies = 0;
+         _jobs[j].handedOut = 0;
+         _unassigned.push_back(j);
+      }
+      _remaining = _jobs.size();
+      _stats.jobs = _jobs.size();
+      for (size_t i = 0; i < _connections.size(); i++)
+      {
+         Connection& c = _connections[i];
+         c.jobs.clear(); // anything still out belongs to the last frame
+         c.worked = false;
+         if (c.ready && !sendMessage(c.fd, _frameMessage))
+            drop(c);
+      }
+
+      chrono::steady_clock::time_point lastWorker = chrono::steady_clock::now();
+      while (_remaining > 0)
+      {
+         handOutJobs();
+         poll();
+         dropSilentWorkers();
+         if (haveWorkers())
+            lastWorker = chrono::steady_clock::now();
+         else if (!_failure.empty() && _connections.empty())
+            throw runtime_error("every worker failed, the last with: " + _failure);
+         else if (millisSince(lastWorker) > NO_WORKERS_TIMEOUT_MILLIS)
+            throw runtime_error("no workers to render on");
+      }
+
+      for (size_t i = 0; i < _connections.size(); i++)
+         _stats.workers += _connections[i].worked;
+      if (counts)
+         counts->add(_counts);
+      _frame = 0;
+   }
+
+   const DistributedStats& stats() const
+   {
+      return _stats;
+   }
+};
+
+/*
+ PURPOSE: traces the jobs a TileCoordinator hands out
+ REMARK: keeps the scene it was sent, and the frame, until the coordinator sends others.
+ Errors throw runtime_error, after telling the coordinator about them if it can still
+ be told.
+ */
+class TileWorker
+{
+private:
+   LoadedScene _scene;
+   ThreadPool _pool;
+   vector<RenderWorker> _workers;
+   const char *_cacheDir;
+   uint32_t _frameNumber;
+   FrameBuffer _frame;
+   vector<PixelSamples> _samples;
+   ScreenSetup _screen;
+   SamplingSettings _settings;
+   Sampler _sampler;
+
+   TileWorker(const TileWorker&);
+   TileWorker& operator=(const TileWorker&);
+
+   // connects to the coordinator, trying again until CONNECT_TIMEOUT_MILLIS have passed
+   static int connectTo(const char *address)
+   {
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      for (;;)
+      {
+         int fd = openSocket(address, false);
+         if (fd >= 0)
+            return fd;
+         if (millisSince(start) > CONNECT_TIMEOUT_MILLIS)
+            throw runtime_error(string("can't connect to ") + address + ": " + strerror(errno));
+         this_thread::sleep_for(chrono::milliseconds(100));
+      }
+   }
+
+   // sets up the frame the coordinator is about to hand out jobs of
+   void startFrame(MessageReader& in)
+   {
+      _frameNumber = in.get<uint32_t>();
+      int width = in.get<int32_t>(), height = in.get<int32_t>();
+      int bottomX = in.get<int32_t>(), bottomY = in.get<int32_t>();
+      _settings = getSettings(in);
+      if (width <= 0 || height <= 0)
+         throw runtime_error("frame has no pixels");
+      _frame.resize(width, height);
+      _samples.assign(width * height, PixelSamples());
+      _screen = makeScreenSetup(_scene.camera.position, _scene.camera.lookAt,
+            _scene.camera.up, bottomX, bottomY);
+      _sampler = Sampler(_settings.sampler);
+   }
+
+   /*
+    PURPOSE: traces a job
+    RECEIVES:
+    region -- its pixels
+    counts -- set to the rays traced
+    RETURNS: nothing
+    REMARKS: the first pass of traceRayScreen goes over the region and the pixels
+    around it, so the edges in the region come out as they do there
+    */
+   void renderJob(const Tile& region, RayCounts& counts)
+   {
+      int width = _frame.width(), height = _frame.height();
+      Tile around = { max(region.x0 - 1, 0), max(region.y0 - 1, 0), min(region.x1 + 1, width),
+            min(region.y1 + 1, height), 0 };
+      for (int y = around.y0; y < around.y1; y++)
+      {
+         for (int x = around.x0; x < around.x1; x++)
+         {
+            _samples[y * width + x] = PixelSamples();
+            _samples[y * width + x].target = _settings.minSamples;
+         }
+      }
+      for (size_t w = 0; w < _workers.size(); w++)
+         _workers[w].queues.counts = RayCounts();
+
+      vector<Tile> tiles = regionTiles(around);
+      _pool.run(tiles.size(), [&](size_t t, unsigned w)
+      {
+         traceTile(_scene.compiled, _scene.lightTree, _screen, tiles[t], _settings, _sampler, _samples,
+               _workers[w], _frame);
+      });
+
+      for (int y = region.y0; y < region.y1; y++)
+         for (int x = region.x0; x < region.x1; x++)
+            if (isEdgePixel(_samples, width, height, x, y, _settings.contrastThreshold))
+               _samples[y * width + x].target = _settings.edgeSamples;
+
+      tiles = regionTiles(region);
+      _pool.run(tiles.size(), [&](size_t t, unsigned w)
+      {
+         traceTile(_scene.compiled, _scene.lightTree, _screen, tiles[t], _settings, _sampler, _samples,
+               _workers[w], _frame);
+      });
+
+      counts = RayCounts();
+      for (size_t w = 0; w < _workers.size(); w++)
+         counts.add(_workers[w].queues.counts);
+   }
+
+   // traces a job and sends back its pixels; the coordinator may no longer want them
+   void doJob(int fd, MessageReader& in)
+   {
+      uint32_t frameNumber = in.get<uint32_t>(), j = in.get<uint32_t>();
+      Tile region;
+      region.x0 = in.get<int32_t>();
+      region.y0 = in.get<int32_t>();
+      region.x1 = in.get<int32_t>();
+      region.y1 = in.get<int32_t>();
+      region.code = 0;
+      if (frameNumber != _frameNumber || region.x0 < 0 || region.y0 < 0
+            || region.x1 > _frame.width() || region.y1 > _frame.height()
+            || region.x0 >= region.x1 || region.y0 >= region.y1)
+         throw runtime_error("job outside the frame");
+
+      RayCounts counts;
+      renderJob(region, counts);
+      MessageWriter result(RESULT_MESSAGE);
+      result.put(frameNumber);
+      result.put(j);
+      result.put(counts.primary);
+      result.put(counts.secondary);
+      result.put(counts.shadow);
+      vector<char> packed;
+      packTile(_frame, region, packed);
+      result.putBytes(packed.empty() ? 0 : &packed[0], packed.size());
+      sendMessage(fd, result);
+   }
+
+public:
+   /*
+    PURPOSE: sets up a worker
+    RECEIVES:
+    threads -- number of render threads, 0 for one per core
+    cacheDir -- directory to cache compiled scenes in, see SceneCache, or 0 for none
+    RETURNS: nothing
+    REMARKS:
+    */
+   explicit TileWorker(unsigned int threads = 0, const char *cacheDir = 0) :
+         _pool(threads)
+   {
+      _workers.resize(_pool.size());
+      _cacheDir = cacheDir;
+      _frameNumber = 0;
+   }
+
+   /*
+    PURPOSE: works for a coordinator until it is done
+    RECEIVES: address -- where the coordinator listens, see openSocket
+    RETURNS: nothing
+    REMARKS: returns when the coordinator says bye; throws runtime_error if it can't be
+    reached, goes away without saying so or fails, or if the scene has an error in it
+    */
+   void serve(const char *address)
+   {
+      int fd = connectTo(address);
+      try
+      {
+         MessageWriter hello(HELLO_MESSAGE);
+         hello.put(TILE_PROTOCOL_VERSION);
+         hello.put((uint32_t) sizeof(Real));
+         sendMessage(fd, hello);
+         uint32_t type;
+         vector<char> payload;
+         bool hasScene = false;
+         // a send failing isn't the end: a coordinator done with the frame may have sent
+         // bye and closed while a job it no longer needed was being traced
+         while (receiveMessage(fd, type, payload))
+         {
+            MessageReader in(payload);
+            if (type == BYE_MESSAGE)
+            {
+               close(fd);
+               return;
+            }
+            else if (type == FAILED_MESSAGE)
+               throw runtime_error("coordinator: " + string(payload.begin(), payload.end()));
+            else if (type == SCENE_MESSAGE)
+            {
+               uint64_t hash = in.get<uint64_t>();
+               size_t size;
+               const char *text = in.rest(size);
+               _scene.load(text, size, hash, _cacheDir);
+               hasScene = true;
+            }
+            else if (type == FRAME_MESSAGE && hasScene)
+               startFrame(in);
+            else if (type == JOB_MESSAGE && hasScene && _frame.width() > 0)
+               doJob(fd, in);
+            else
+               throw runtime_error("unexpected message from coordinator");
+         }
+         throw runtime_error("coordinator went away");
+      }
+      catch (const exception& e)
+      {
+         sendFailure(fd, e.what());
+         close(fd);
+         throw;
+      }
+   }
+};
+
+#endif
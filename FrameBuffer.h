@@ -0,0 +1,92 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <vector>
+
+/*
+ PURPOSE: CPU side image the ray tracer writes its pixels into
+ REMARK:
+ Pixels are stored as tightly packed RGB floats, row by row starting at the bottom
+ row, which is the layout glTexSubImage2D expects for a GL_RGB/GL_FLOAT upload.
+ Nothing in here touches GL, so the tracer can fill one in on any thread (or with no
+ GL context at all) and leave it to a separate present stage to get it on screen.
+ */
+class FrameBuffer
+{
+private:
+   int _width;
+   int _height;
+   std::vector<float> _pixels;
+   std::vector<unsigned short> _sampleCounts; // how many samples each pixel took
+
+public:
+   FrameBuffer()
+   {
+      _width = 0;
+      _height = 0;
+   }
+
+   FrameBuffer(int width, int height)
+   {
+      resize(width, height);
+   }
+
+   void resize(int width, int height)
+   {
+      _width = width;
+      _height = height;
+      _pixels.assign(3 * width * height, 0.0f);
+      _sampleCounts.assign(width * height, 0);
+   }
+
+   void clear()
+   {
+      _pixels.assign(_pixels.size(), 0.0f);
+      _sampleCounts.assign(_sampleCounts.size(), 0);
+   }
+
+   int width() const
+   {
+      return _width;
+   }
+   int height() const
+   {
+      return _height;
+   }
+
+   //size of the pixel data in bytes
+   size_t byteSize() const
+   {
+      return _pixels.size() * sizeof(float);
+   }
+
+   const float *data() const
+   {
+      return _pixels.empty() ? 0 : &_pixels[0];
+   }
+
+   void setPixel(int x, int y, float r, float g, float b)
+   {
+      float *p = &_pixels[3 * (y * _width + x)];
+      p[0] = r;
+      p[1] = g;
+      p[2] = b;
+   }
+
+   const float *pixel(int x, int y) const
+   {
+      return &_pixels[3 * (y * _width + x)];
+   }
+
+   void setSampleCount(int x, int y, unsigned int count)
+   {
+      _sampleCounts[y * _width + x] = count;
+   }
+
+   unsigned int sampleCount(int x, int y) const
+   {
+      return _sampleCounts[y * _width + x];
+   }
+};
+
+#endif
@@ -0,0 +1,386 @@
+#ifndef LIGHTTREE_H
+#define LIGHTTREE_H
+
+/*---------------------------------------------------------------------------*/
+/* INCLUDES */
+#include <vector>
+#include <algorithm>
+#include "Objects.h"
+#include "Bvh.h"
+#include "Sampler.h"
+#include "Counters.h"
+
+/*---------------------------------------------------------------------------*/
+/*  VARIABLES */
+const Real LIGHT_CUTOFF = .001; // lights which together could add less than this to a
+// colour channel of a sample are left out
+const unsigned int LIGHT_CUT_SIZE = 8; // most shadow rays a hit point sends; scenes
+// with no more lights than this shade every light that isn't cut off exactly
+const Real LIGHT_ERROR_BOUND = .5 * SAMPLE_ERROR_THRESHOLD; // standard error the sampled
+// lights may add to a sample, as far as LIGHT_CUT_SIZE shadow rays allow
+const unsigned int LIGHT_LEAF_SIZE = 4; // lights split into halves until this few are left
+
+/*---------------------------------------------------------------------------*/
+/* FUNCTIONS */
+/*
+ PURPOSE: calculates how much light intensities will decay with distance
+ RECEIVES: distanceSquared -- square of the distance to use
+ RETURNS: decimal value between 0 and 1 by which an intensity at the given distance
+ would be reduced
+ REMARKS:
+ */
+inline Real attenuateSquared(Real distanceSquared)
+{
+   return ATTENUATION_FACTOR / (ATTENUATION_FACTOR + distanceSquared);
+}
+
+// as attenuateSquared, given the distance itself
+inline Real attenuate(Real distance)
+{
+   return attenuateSquared(distance * distance);
+}
+
+// the largest of the three channels of a colour
+inline Real maxChannel(const Point& c)
+{
+   return max(c.x(), max(c.y(), c.z()));
+}
+
+// square of the distance from p to the nearest point of box, 0 if p is inside it
+inline Real distanceSquared(const Aabb& box, const Point& p)
+{
+   Real q[3] = { p.x(), p.y(), p.z() };
+   Real total = 0;
+   for (int a = 0; a < 3; a++)
+   {
+      Real d = max(box.lo[a] - q[a], max(Real(0), q[a] - box.hi[a]));
+      total += d * d;
+   }
+   return total;
+}
+
+/*---------------------------------------------------------------------------*/
+/* CLASS DEFINITIONS */
+/*
+ PURPOSE: a light chosen to shade a hit point
+ REMARK: scale is what the light's colour is multiplied by: 1 for a light shaded exactly,
+ 1 over the chance of picking it for one picked at random to stand for several, so that
+ on average the picks add up to the lights they stand for
+ */
+struct LightChoice
+{
+   unsigned int light; // index into LightTree::lights
+   Real scale;
+};
+
+/*
+ PURPOSE: the lights of a scene in a bounding volume hierarchy, for choosing which of
+ them to send shadow rays to
+ REMARK:
+ Every node knows the sum over its lights of their brightest channel, its power, so
+ power times the attenuation at the nearest point of its box bounds what all of its
+ lights together can add at a hit point; see nodeBound. A hit point shades the lights
+ of a cut through the tree, see choose: subtrees whose bound falls below LIGHT_CUTOFF
+ are left out, single lights of the cut are shaded exactly and the rest are sampled
+ with one light each. Work per hit point therefore grows with the depth of the tree,
+ not with the number of lights. The tree is laid out like a Bvh's but split at the
+ median of the longest axis instead of by SAH: lights are points, and what matters
+ here is a shallow tree rather than cheap ray traversal. Built once per set of lights,
+ which takes next to no time next to a frame.
+ */
+class LightTree
+{
+private:
+   // a node of the cut choose makes, or a single light of a leaf
+   struct CutEntry
+   {
+      unsigned int node;
+      unsigned int light; // NO_LIGHT unless a single light
+      Real bound; // on what it adds, before the material and ray weight
+   };
+   static const unsigned int NO_LIGHT = ~0u;
+
+   vector<Light> _lights;
+   vector<Real> _brightness; // of each light, its brightest channel
+   vector<BvhNode> _nodes;
+   vector<unsigned int> _indices; // leaves' lights, as in a Bvh
+   vector<Real> _power; // of each node
+
+   // splits node n until its leaves have at most LIGHT_LEAF_SIZE lights
+   void subdivide(unsigned int n)
+   {
+      BvhNode& node = _nodes[n];
+      node.box.reset();
+      _power[n] = 0;
+      for (unsigned int k = node.first; k < node.first + node.count; k++)
+      {
+         Point p = _lights[_indices[k]].position();
+         Real q[3] = { p.x(), p.y(), p.z() };
+         node.box.grow(q);
+         _power[n] += _brightness[_indices[k]];
+      }
+      if (node.count <= LIGHT_LEAF_SIZE)
+         return;
+
+      int axis = 0;
+      for (int a = 1; a < 3; a++)
+         if (node.box.hi[a] - node.box.lo[a] > node.box.hi[axis] - node.box.lo[axis])
+            axis = a;
+      unsigned int first = node.first, half = node.count / 2, count = node.count;
+      nth_element(_indices.begin() + first, _indices.begin() + first + half,
+            _indices.begin() + first + count, [&](unsigned int a, unsigned int b)
+            {
+               Point pa = _lights[a].position(), pb = _lights[b].position();
+               return axis == 0 ? pa.x() < pb.x() : axis == 1 ? pa.y() < pb.y() : pa.z() < pb.z();
+            });
+
+      unsigned int left = _nodes.size();
+      _nodes.resize(left + 2);
+      _power.resize(left + 2);
+      _nodes[left].first = first;
+      _nodes[left].count = half;
+      _nodes[left + 1].first = first + half;
+      _nodes[left + 1].count = count - half;
+      _nodes[n].first = left;
+      _nodes[n].count = 0;
+      subdivide(left);
+      subdivide(left + 1);
+   }
+
+   // bound on what the lights of node n can add at p
+   Real nodeBound(unsigned int n, const Point& p) const
+   {
+      COUNT(lightNodes, 1);
+      return _power[n] * attenuateSquared(distanceSquared(_nodes[n].box, p));
+   }
+
+   // bound on what light i adds at p
+   Real lightBound(unsigned int i, const Point& p) const
+   {
+      Point d = _lights[i].position() - p;
+      return _brightness[i] * attenuateSquared(d & d);
+   }
+
+   // adds node n to the cut unless it is cut off; a leaf of one light goes in as the light
+   void addToCut(unsigned int n, const Point& p, Real cutoff, CutEntry *cut,
+         unsigned int& size) const
+   {
+      CutEntry e;
+      e.node = n;
+      e.bound = nodeBound(n, p);
+      const BvhNode& node = _nodes[n];
+      e.light = node.count == 1 ? _indices[node.first] : NO_LIGHT;
+      if (e.light != NO_LIGHT)
+         e.bound = lightBound(e.light, p);
+      if (e.bound >= cutoff)
+         cut[size++] = e;
+   }
+
+   /*
+    PURPOSE: picks one light of a subtree at random
+    RECEIVES:
+    n -- root of the subtree
+    p -- the hit point
+    u -- random number in [0, 1) deciding which light
+    chance -- set to the chance the light had of being picked
+    RETURNS: index of the light
+    REMARKS: goes down the tree taking either child in proportion to its nodeBound, and
+    picks among the lights of the leaf it ends at in proportion to their bound; u is
+    stretched at every step to where it falls within the child taken, so one random
+    number does for the whole way down. As a node bounds at least as much as its two
+    children together, a light is picked with a chance of at least its bound over that
+    of n, so no pick ever counts for more than n's bound.
+    */
+   unsigned int pickLight(unsigned int n, const Point& p, Real u, Real& chance) const
+   {
+      chance = 1;
+      for (;;)
+      {
+         const BvhNode& node = _nodes[n];
+         if (node.count == 0)
+         {
+            // the children's nodeBounds over their sum, multiplied out to one divide
+            COUNT(lightNodes, 2);
+            Real left = _power[node.first] * (ATTENUATION_FACTOR
+                  + distanceSquared(_nodes[node.first + 1].box, p));
+            Real right = _power[node.first + 1] * (ATTENUATION_FACTOR
+                  + distanceSquared(_nodes[node.first].box, p));
+            if (left + right <= 0)
+               left = right = 1; // only lights with no colour below; any will do
+            Real split = left / (left + right);
+            if (u < split)
+            {
+               chance *= split;
+               u /= split;
+               n = node.first;
+            }
+            else
+            {
+               chance *= 1 - split;
+               u = (u - split) / (1 - split);
+               n = node.first + 1;
+            }
+            u = min(u, Real(1) - numeric_limits<float>::epsilon());
+            continue;
+         }
+
+         Real bounds[LIGHT_LEAF_SIZE];
+         Real total = 0;
+         for (unsigned int k = 0; k < node.count; k++)
+            total += bounds[k] = lightBound(_indices[node.first + k], p);
+         Real target = u * total;
+         unsigned int k = 0;
+         while (k + 1 < node.count && target >= bounds[k])
+            target -= bounds[k++];
+         chance *= total > 0 ? bounds[k] / total : Real(1) / node.count;
+         return _indices[node.first + k];
+      }
+   }
+
+   static bool lowerIndex(const LightChoice& a, const LightChoice& b)
+   {
+      return a.light < b.light;
+   }
+
+public:
+   LightTree()
+   {
+   }
+
+   explicit LightTree(const vector<Light>& lights)
+   {
+      build(lights);
+   }
+
+   // puts lights in the tree, replacing whatever it held
+   void build(const vector<Light>& lights)
+   {
+      _lights = lights;
+      _brightness.resize(lights.size());
+      _indices.resize(lights.size());
+      for (unsigned int i = 0; i < lights.size(); i++)
+      {
+         _brightness[i] = max(Real(0), maxChannel(lights[i].color()));
+         _indices[i] = i;
+      }
+      _nodes.clear();
+      _power.clear();
+      if (lights.empty())
+         return;
+      _nodes.reserve(2 * lights.size());
+      _nodes.resize(1);
+      _power.resize(1);
+      _nodes[0].first = 0;
+      _nodes[0].count = lights.size();
+      subdivide(0);
+   }
+
+   const vector<Light>& lights() const
+   {
+      return _lights;
+   }
+
+   size_t size() const
+   {
+      return _lights.size();
+   }
+
+   /*
+    PURPOSE: picks the lights to send shadow rays to from a hit point
+    RECEIVES:
+    p -- the hit point
+    bound -- most a light of brightness 1 right at p could add to a colour channel of
+    the sample, given the surface's material and the weight of the ray that got there
+    key -- random stream to draw from, see RandomStream
+    choices -- set to the lights picked and how much each counts for
+    RETURNS: nothing
+    REMARKS:
+    Starting from the root, the node of the cut with the largest bound is replaced by its
+    children, leaving out those whose bound times the given one is below LIGHT_CUTOFF,
+    until the cut has LIGHT_CUT_SIZE entries or the sampled ones are known to be
+    accurate enough. A node's bound times the given one bounds what any light picked for
+    it adds, shadowed or not (see pickLight), so its standard error is at most half of
+    that; refining stops once those add up to no more than LIGHT_ERROR_BOUND. Whatever
+    noise is left the pixel's adaptive sampling sees as variance and takes more samples
+    for. A scene with no more than LIGHT_CUT_SIZE lights always ends up with all of them
+    shaded exactly, in the order of the scene's lights, so scenes with a few lights come
+    out as they would without the tree.
+    */
+   void choose(const Point& p, Real bound, uint64_t key, vector<LightChoice>& choices) const
+   {
+      choices.clear();
+      if (bound <= 0 || _nodes.empty())
+         return;
+
+      Real cutoff = LIGHT_CUTOFF / bound;
+      Real allowed = 2 * LIGHT_ERROR_BOUND / bound;
+      bool exactOnly = _lights.size() <= LIGHT_CUT_SIZE;
+      CutEntry cut[LIGHT_CUT_SIZE + LIGHT_LEAF_SIZE];
+      unsigned int size = 0;
+      addToCut(0, p, cutoff, cut, size);
+      for (;;)
+      {
+         // the sampled entry with the largest bound, and their variance bound
+         unsigned int worst = size;
+         Real variance = 0;
+         for (unsigned int e = 0; e < size; e++)
+         {
+            if (cut[e].light != NO_LIGHT)
+               continue;
+            variance += cut[e].bound * cut[e].bound;
+            if (worst == size || cut[e].bound > cut[worst].bound)
+               worst = e;
+         }
+         if (worst == size || (!exactOnly && variance <= allowed * allowed))
+            break;
+
+         unsigned int n = cut[worst].node;
+         const BvhNode& node = _nodes[n];
+         unsigned int children = node.count == 0 ? 2 : node.count;
+         if (!exactOnly && size - 1 + children > LIGHT_CUT_SIZE)
+            break;
+         cut[worst] = cut[--size];
+         if (node.count == 0)
+         {
+            addToCut(node.first, p, cutoff, cut, size);
+            addToCut(node.first + 1, p, cutoff, cut, size);
+            continue;
+         }
+         for (unsigned int k = node.first; k < node.first + node.count; k++)
+         {
+            CutEntry e;
+            e.node = n;
+            e.light = _indices[k];
+            e.bound = lightBound(e.light, p);
+            if (e.bound >= cutoff)
+               cut[size++] = e;
+         }
+      }
+
+      RandomStream random(key);
+      for (unsigned int e = 0; e < size; e++)
+      {
+         LightChoice c;
+         c.scale = 1;
+         if (cut[e].light != NO_LIGHT)
+         {
+            c.light = cut[e].light;
+            COUNT(lightsShaded, 1);
+         }
+         else
+         {
+            Real chance;
+            c.light = pickLight(cut[e].node, p, random.next(), chance);
+            if (chance <= 0)
+               continue; // only lights with no colour to pick from
+            c.scale = 1 / chance;
+            COUNT(lightsSampled, 1);
+         }
+         choices.push_back(c);
+      }
+      if (exactOnly)
+         sort(choices.begin(), choices.end(), lowerIndex);
+   }
+};
+
+#endif
@@ -1,6 +1,35 @@
+#ifndef OBJECTS_H
+#define OBJECTS_H
+
+/*---------------------------------------------------------------------------*/
+/* INCLUDES */
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include "Counters.h"
+#include "SceneArena.h"
+#ifdef __MAC__
+#	include <OpenGL/gl.h>
+#else
+#	include <GL/gl.h>
+#endif
+
+using namespace std;
+
+/*---------------------------------------------------------------------------*/
+/* TYPES */
+// scalar the tracer computes in; build with make PRECISION=float for single precision
+#ifdef PRECISION_FLOAT
+typedef float Real;
+#else
+typedef double Real;
+#endif
+
 /*---------------------------------------------------------------------------*/
 /* PROTOTYPES */
 class RayObject;
+class CompiledScene;
 
 /*---------------------------------------------------------------------------*/
 /*  VARIABLES */
@@ -11,6 +40,10 @@ const GLdouble BLACK[3] =
 { 0.0, 0.0, 0.0 }; //RGB for black
 const GLdouble RED[3] =
 { 1.0, 0.0, 0.0 }; //RGB for RED
+const GLdouble GREEN[3] =
+{ 0.0, 1.0, 0.0 }; //RGB for green
+const GLdouble BLUE[3] =
+{ 0.0, 0.0, 1.0 }; //RGB for blue
 const GLdouble ATTENUATION_FACTOR = 100000;
 // used in our lighting equations to model how light attenuates with distance
 
@@ -32,8 +65,13 @@ const GLdouble SQUARE_EDGE_SIZE = BOARD_EDGE_SIZE / NUM_SQUARES; // pixels/per s
 
 //raytracing
 const unsigned int MAX_DEPTH = 5; // maximum depth our ray-tracing tree should go to
-const GLdouble SMALL_NUMBER = .0001; // used rather than check with zero to avoid round-off problems 
-const GLdouble SUPER_SAMPLE_NUMBER = 16; // how many random rays per pixel
+const Real SMALL_NUMBER = max(Real(.0001), Real(64 * BOARD_EDGE_SIZE * numeric_limits<Real>::epsilon()));
+// used rather than check with zero to avoid round-off problems; scaled to the rounding
+// error of coordinates the size of the board, which matters once Real is float
+const GLdouble SUPER_SAMPLE_NUMBER = 16; // how many random rays per pixel at most
+const unsigned int MIN_SAMPLE_NUMBER = 4; // how many random rays per pixel at least
+const GLdouble SAMPLE_ERROR_THRESHOLD = .005; // pixels stop being sampled once the standard error of their colour is below this
+const GLdouble EDGE_CONTRAST_THRESHOLD = .1; // pixels differing this much from a neighbour get SUPER_SAMPLE_NUMBER samples
 
 //window
 GLsizei winWidth = 500, winHeight = 500; // used for size of window
@@ -48,82 +86,103 @@ GLsizei initX = 0, initY = 0; // used for initial position of window
  during ray-tracing. Since they are short and we want them to be inlined
  we define them in the class defintion itself using a standard one-line
  format (not exactly like the coding guidelines)
+ The scalar type is a template parameter; the tracer uses BasicPoint<Real>
+ under the name Point.
  */
-class Point
+template<class T>
+class BasicPoint
 {
 private:
-   GLdouble _x;
-   GLdouble _y;
-   GLdouble _z;
+   T _x;
+   T _y;
+   T _z;
 
 public:
-   Point()
+   BasicPoint()
    {
       _x = 0;
       _y = 0;
       _z = 0;
    }
 
-   Point(GLdouble a, GLdouble b, GLdouble c)
+   BasicPoint(T a, T b, T c)
    {
       _x = a;
       _y = b;
       _z = c;
    }
 
-   Point(const GLdouble pt[])
+   template<class U>
+   BasicPoint(const U pt[])
    {
       _x = pt[0];
       _y = pt[1];
       _z = pt[2];
    }
 
-   Point(const Point& p)
+   BasicPoint(const BasicPoint& p)
    {
       _x = p._x;
       _y = p._y;
       _z = p._z;
    }
-   GLdouble x()
+   T x() const
    {
       return _x;
    }
-   GLdouble y()
+   T y() const
    {
       return _y;
    }
-   GLdouble z()
+   T z() const
    {
       return _z;
    }
 
-   void set(GLdouble a, GLdouble b, GLdouble c)
+   void set(T a, T b, T c)
    {
       _x = a;
       _y = b;
       _z = c;
    }
 
-   bool isZero()
+   bool isZero() const
    {
       return (_x == 0 && _y == 0 && _z == 0);
    }
-   GLdouble length()
+   T length() const
    {
       return sqrt(_x * _x + _y * _y + _z * _z);
    }
    void normalize()
    {
-      GLdouble l = length();
+      T l = length();
       _x /= l;
       _y /= l;
       _z /= l;
    }
 
-   friend Point operator*(GLdouble scalar, const Point &other); //scalar products
-   friend Point operator*(const Point &other, GLdouble scalar);
+   /*
+    PURPOSE: multiplies the supplied point vector by the scalar amount
+    RECEIVES:
+    p - Point vector (x,y,z)
+    scalar -- the scalar `a' to multiply by
+    RETURNS:
+    the point vector
+    (a*x, a*y, a*z)
+    REMARKS: defined in here rather than as templates so that a scalar of the other
+    precision (or an int) still converts
+    */
+   friend BasicPoint operator*(T scalar, const BasicPoint& p)
+   {
+      return BasicPoint(scalar * p._x, scalar * p._y, scalar * p._z);
+   }
+   friend BasicPoint operator*(const BasicPoint& p, T scalar)
+   {
+      return BasicPoint(scalar * p._x, scalar * p._y, scalar * p._z);
+   }
 
-   Point& operator*=(GLdouble scalar)
+   BasicPoint& operator*=(T scalar)
    {
       _x *= scalar;
       _y *= scalar;
@@ -131,7 +190,7 @@ public:
       return *this;
    }
 
-   Point& operator/=(GLdouble scalar)
+   BasicPoint& operator/=(T scalar)
    {
       _x /= scalar;
       _y /= scalar;
@@ -139,32 +198,32 @@ public:
       return *this;
    }
 
-   Point operator*(const Point& other) //cross product
+   BasicPoint operator*(const BasicPoint& other) const //cross product
    {
-      return Point(_y * other._z - other._y * _z, _z * other._x - _x * other._z,
+      return BasicPoint(_y * other._z - other._y * _z, _z * other._x - _x * other._z,
             _x * other._y - _y * other._x);
    }
 
-   GLdouble operator&(const Point& other) //dot Product
+   T operator&(const BasicPoint& other) const //dot Product
    {
       return _x * other._x + _y * other._y + _z * other._z;
    }
 
-   Point operator%(const Point& other) //Hadamard Product
+   BasicPoint operator%(const BasicPoint& other) const //Hadamard Product
    {
-      return Point(_x * other._x, _y * other._y, _z * other._z);
+      return BasicPoint(_x * other._x, _y * other._y, _z * other._z);
    }
-   Point operator+(const Point &other) const
+   BasicPoint operator+(const BasicPoint &other) const
    {
-      return Point(_x + other._x, _y + other._y, _z + other._z);
+      return BasicPoint(_x + other._x, _y + other._y, _z + other._z);
    }
 
-   Point operator-(const Point &other) const
+   BasicPoint operator-(const BasicPoint &other) const
    {
-      return Point(_x - other._x, _y - other._y, _z - other._z);
+      return BasicPoint(_x - other._x, _y - other._y, _z - other._z);
    }
 
-   Point& operator+=(const Point &other)
+   BasicPoint& operator+=(const BasicPoint &other)
    {
       _x += other._x;
       _y += other._y;
@@ -172,7 +231,7 @@ public:
       return *this;
    }
 
-   Point& operator-=(const Point &other)
+   BasicPoint& operator-=(const BasicPoint &other)
    {
       _x -= other._x;
       _y -= other._y;
@@ -180,7 +239,7 @@ public:
       return *this;
    }
 
-   Point& operator=(const Point &other)
+   BasicPoint& operator=(const BasicPoint &other)
    {
       _x = other._x;
       _y = other._y;
@@ -189,7 +248,7 @@ public:
    }
 
    //checks to see if a point equals to another
-   bool operator==(const Point &other) const
+   bool operator==(const BasicPoint &other) const
    {
    		#define EPSILON .00001
       if( abs(_x - other._x) <= EPSILON && abs(_y - other._y) <= EPSILON && abs(_z - other._z) <= EPSILON)
@@ -199,9 +258,23 @@ public:
    }
 };
 
+typedef BasicPoint<Real> Point;
+
+//componentwise minimum and maximum of two points, used to build bounding boxes
+inline Point minPoint(const Point& a, const Point& b)
+{
+   return Point(min(a.x(), b.x()), min(a.y(), b.y()), min(a.z(), b.z()));
+}
+inline Point maxPoint(const Point& a, const Point& b)
+{
+   return Point(max(a.x(), b.x()), max(a.y(), b.y()), max(a.z(), b.z()));
+}
+
 Point whiteColor(WHITE); // some abbreviations for various colors
 Point blackColor(BLACK);
 Point redColor(RED);
+Point greenColor(GREEN);
+Point blueColor(BLUE);
 Point lightColor(WHITE); // color of the light
 
 /*
@@ -223,11 +296,11 @@ public:
       _color = c;
       _position = p;
    }
-   Point color()
+   Point color() const
    {
       return _color;
    }
-   Point position()
+   Point position() const
    {
       return _position;
    }
@@ -241,53 +314,56 @@ public:
  where it is coming from and the the _endPoint is mainly used to
  specify the direction of the line
  */
-class Line
+template<class T>
+class BasicLine
 {
 private:
-   Point _startPt;
-   Point _endPt;
+   BasicPoint<T> _startPt;
+   BasicPoint<T> _endPt;
 
 public:
-   Line()
+   BasicLine()
    {
       _startPt.set(0.0, 0.0, 0.0);
       _endPt.set(0.0, 0.0, 0.0);
    }
-   Line(const Point& p1, const Point& p2)
+   BasicLine(const BasicPoint<T>& p1, const BasicPoint<T>& p2)
    {
       _startPt = p1;
       _endPt = p2;
    }
 
-   void set(const Point& p1, const Point& p2)
+   void set(const BasicPoint<T>& p1, const BasicPoint<T>& p2)
    {
       _startPt = p1;
       _endPt = p2;
    }
 
-   Point startPoint() const
+   BasicPoint<T> startPoint() const
    {
       return _startPt;
    }
-   Point endPoint() const
+   BasicPoint<T> endPoint() const
    {
       return _endPt;
    }
 
-   Point direction() const
+   BasicPoint<T> direction() const
    {
-      Point p = _endPt - _startPt;
+      BasicPoint<T> p = _endPt - _startPt;
       p.normalize();
       return p;
    }
 
-   GLdouble length() const
+   T length() const
    {
-      Point p = _endPt - _startPt;
+      BasicPoint<T> p = _endPt - _startPt;
       return p.length();
    }
 };
 
+typedef BasicLine<Real> Line;
+
 /*
  PURPOSE: storage of info about how a Shape
  will react to various kinds of light in our lighting model
@@ -302,7 +378,7 @@ private:
    Point _diffuse;
    Point _specular;
    Point _transparency;
-   GLdouble _refraction;
+   Real _refraction;
 public:
    Material()
    {
@@ -313,7 +389,7 @@ public:
       _refraction = 1;
    }
    Material(const Point& a, const Point& d, const Point& s, const Point& t,
-         GLdouble r)
+         Real r)
    {
       _ambient = a;
       _diffuse = d;
@@ -329,23 +405,32 @@ public:
       _transparency = m._transparency;
       _refraction = m._refraction;
    }
-   Point ambient()
+   Material& operator=(const Material& m)
+   {
+      _ambient = m._ambient;
+      _diffuse = m._diffuse;
+      _specular = m._specular;
+      _transparency = m._transparency;
+      _refraction = m._refraction;
+      return *this;
+   }
+   Point ambient() const
    {
       return _ambient;
    }
-   Point diffuse()
+   Point diffuse() const
    {
       return _diffuse;
    }
-   Point specular()
+   Point specular() const
    {
       return _specular;
    }
-   Point transparency()
+   Point transparency() const
    {
       return _transparency;
    }
-   GLdouble refraction()
+   Real refraction() const
    {
       return _refraction;
    }
@@ -355,6 +440,8 @@ Material sphereMaterial(blackColor, .1 * whiteColor, whiteColor, blackColor, 1);
 Material tetrahedronMaterial(blackColor, blackColor, .1 * whiteColor,
       whiteColor, 2.0 / 3.0);
 Material cubeMaterial(.1 * redColor, .4 * redColor, redColor, blackColor, 1);
+Material coneMaterial(.1 * greenColor, .4 * greenColor, greenColor, blackColor, 1);
+Material cylinderMaterial(.1 * blueColor, .4 * blueColor, blueColor, blackColor, 1);
 Material whiteSquare(.1 * whiteColor, .5 * whiteColor, whiteColor, blackColor,
       1);
 // some materials used by objects in  the scene
@@ -451,16 +538,235 @@ public:
    }
 };
 
+/*
+ PURPOSE: fills in an Intersection for a ray hitting a surface
+ RECEIVES:
+ inter -- Intersection object to fill in
+ p -- point where the surface was hit
+ u -- normalized direction of the incoming ray
+ n -- unit normal of the surface at p
+ m -- Material of the surface
+ RETURNS: nothing
+ REMARKS: reflected vector calculated using equations from book, transmitted vector
+ using thin lens equations from book
+ */
+inline void setHit(Intersection& inter, const Point& p, const Point& u,
+      const Point& n, const Material& m)
+{
+   Point r = u - (2 * (u & n)) * n;
+   Line reflected(p, p + r);
+
+   Real refractionRatio = m.refraction();
+
+   Point t(0.0, 0.0, 0.0);
+
+   Real cosThetai = u & n;
+   Real modulus = 1
+         - refractionRatio * refractionRatio * (1 - cosThetai * cosThetai);
+
+   if (modulus > 0)
+   {
+      Real cosThetar = sqrt(modulus);
+      t = refractionRatio * u - (cosThetar + refractionRatio * cosThetai) * n;
+   }
+
+   Line transmitted(p, p + t);
+   inter.setValues(true, p, n, m, reflected, transmitted);
+}
+
+/*
+ PURPOSE: works out where a ray hits an axis aligned box
+ RECEIVES:
+ lo, hi -- minimum and maximum corner of the box
+ p0 -- start of the ray
+ u -- normalized direction of the ray
+ RETURNS: distance along the ray to the hit, HUGE_VAL if it misses
+ REMARKS: slab test: the ray is inside the box from the last of the three pairs of
+ planes it enters to the first it leaves. A ray starting inside, such as one
+ transmitted into the box, hits the side it leaves through.
+ */
+inline Real boxDistance(const Point& lo, const Point& hi, const Point& p0, const Point& u)
+{
+   Real l[3] = { lo.x(), lo.y(), lo.z() };
+   Real h[3] = { hi.x(), hi.y(), hi.z() };
+   Real o[3] = { p0.x(), p0.y(), p0.z() };
+   Real d[3] = { u.x(), u.y(), u.z() };
+
+   Real tNear = -HUGE_VAL, tFar = HUGE_VAL;
+   for (int a = 0; a < 3; a++)
+   {
+      if (d[a] == 0)
+      {
+         if (o[a] < l[a] || o[a] > h[a])
+            return HUGE_VAL;
+         continue;
+      }
+      Real t0 = (l[a] - o[a]) / d[a];
+      Real t1 = (h[a] - o[a]) / d[a];
+      tNear = max(tNear, min(t0, t1));
+      tFar = min(tFar, max(t0, t1));
+   }
+   if (tNear > tFar)
+      return HUGE_VAL;
+   if (tNear >= SMALL_NUMBER)
+      return tNear;
+   return tFar >= SMALL_NUMBER ? tFar : HUGE_VAL;
+}
+
+// outward normal of the side of a box, given by its centre and half its size along each
+// axis, which p lies on
+inline Point boxNormal(const Point& centre, const Point& half, const Point& p)
+{
+   Point q = p - centre;
+   Real ax = abs(q.x()) / half.x(), ay = abs(q.y()) / half.y(), az = abs(q.z()) / half.z();
+   if (ax >= ay && ax >= az)
+      return Point(q.x() < 0 ? -1.0 : 1.0, 0.0, 0.0);
+   if (ay >= az)
+      return Point(0.0, q.y() < 0 ? -1.0 : 1.0, 0.0);
+   return Point(0.0, 0.0, q.z() < 0 ? -1.0 : 1.0);
+}
+
+/*
+ PURPOSE: works out where a ray hits a checkerboard lying flat, and on which colour
+ RECEIVES:
+ corner -- corner of the board with the smallest x and z, where the squares start
+ edgeSize -- how wide and deep the board is
+ squareSize -- how wide and deep a square is
+ p0 -- start of the ray
+ u -- normalized direction of the ray
+ black -- set to whether the square hit is black rather than white
+ RETURNS: distance along the ray to the hit, HUGE_VAL if it misses
+ REMARKS: the board lies in the plane y = corner.y, so finding the hit takes one
+ divide; its x and z measured from the corner then both bound the board and pick the
+ square, whose colour is the parity of the sum of its row and column
+ */
+inline Real boardDistance(const Point& corner, Real edgeSize, Real squareSize,
+      const Point& p0, const Point& u, bool& black)
+{
+   if (u.y() == 0)
+      return HUGE_VAL;
+   Real s = (corner.y() - p0.y()) / u.y();
+   if (s < SMALL_NUMBER)
+      return HUGE_VAL;
+   Real x = p0.x() + s * u.x() - corner.x();
+   Real z = p0.z() + s * u.z() - corner.z();
+   if (x < 0 || x > edgeSize || z < 0 || z > edgeSize)
+      return HUGE_VAL;
+   black = ((int(x / squareSize) + int(z / squareSize)) & 1) != 0;
+   return s;
+}
+
+// which part of a capped cone a ray hits, see cappedConeDistance
+enum ConePart
+{
+   CONE_SIDE, CONE_BOTTOM, CONE_TOP
+};
+
+/*
+ PURPOSE: works out where a ray hits an upright capped cone
+ RECEIVES:
+ base -- centre of its bottom
+ height -- how far its top is above its bottom
+ bottomRadius, topRadius -- radius of its bottom and top; equal for a cylinder, a top
+ radius of 0 makes a pointed cone
+ p0 -- start of the ray
+ u -- normalized direction of the ray
+ part -- set to the ConePart hit
+ RETURNS: distance along the ray to the hit, HUGE_VAL if it misses
+ REMARKS:
+ Relative to base the side is the quadric x^2 + z^2 = r(y)^2, r going linearly from
+ bottomRadius at y = 0 to topRadius at y = height, cut off at those two heights; the
+ bottom and top are discs. Both roots of the quadric and both discs are candidates and
+ the nearest one in front of the ray wins. The roots are taken in the form which stays
+ accurate when the ray runs almost along the side.
+ */
+inline Real cappedConeDistance(const Point& base, Real height, Real bottomRadius,
+      Real topRadius, const Point& p0, const Point& u, unsigned int& part)
+{
+   Point q = p0 - base;
+   Real k = (topRadius - bottomRadius) / height; // how much the radius grows going up
+   Real rq = bottomRadius + k * q.y(); // radius at the height the ray starts at
+
+   Real a = u.x() * u.x() + u.z() * u.z() - k * k * u.y() * u.y();
+   Real b = q.x() * u.x() + q.z() * u.z() - k * rq * u.y(); // half the usual b
+   Real c = q.x() * q.x() + q.z() * q.z() - rq * rq;
+
+   Real best = HUGE_VAL;
+   Real discriminant = b * b - a * c;
+   if (discriminant >= 0)
+   {
+      Real root = sqrt(discriminant);
+      Real h = -(b < 0 ? b - root : b + root);
+      Real candidates[2] = { a != 0 ? h / a : Real(HUGE_VAL), h != 0 ? c / h : Real(HUGE_VAL) };
+      for (int n = 0; n < 2; n++)
+      {
+         Real t = candidates[n];
+         Real y = q.y() + t * u.y();
+         if (t >= SMALL_NUMBER && t < best && y >= 0 && y <= height)
+         {
+            best = t;
+            part = CONE_SIDE;
+         }
+      }
+   }
+
+   if (u.y() != 0)
+   {
+      Real caps[2] = { -q.y() / u.y(), (height - q.y()) / u.y() };
+      Real radii[2] = { bottomRadius, topRadius };
+      for (int n = 0; n < 2; n++)
+      {
+         Real t = caps[n];
+         if (t < SMALL_NUMBER || t >= best)
+            continue;
+         Real x = q.x() + t * u.x(), z = q.z() + t * u.z();
+         if (x * x + z * z <= radii[n] * radii[n])
+         {
+            best = t;
+            part = n == 0 ? CONE_BOTTOM : CONE_TOP;
+         }
+      }
+   }
+   return best;
+}
+
+// outward normal at a point p on the given part of a capped cone, see cappedConeDistance
+inline Point cappedConeNormal(const Point& base, Real height, Real bottomRadius,
+      Real topRadius, const Point& p, unsigned int part)
+{
+   if (part == CONE_BOTTOM)
+      return Point(0.0, -1.0, 0.0);
+   if (part == CONE_TOP)
+      return Point(0.0, 1.0, 0.0);
+
+   Point q = p - base;
+   Real k = (topRadius - bottomRadius) / height;
+   Point n(q.x(), -k * (bottomRadius + k * q.y()), q.z()); // half the quadric's gradient
+   if (n.isZero())
+      return Point(0.0, 1.0, 0.0); // the tip of a pointed cone
+   n.normalize();
+   return n;
+}
+
 /*
  PURPOSE: abstract class serving a base for
  all objects to be drawn in our ray-traced scene
- REMARK:
+ REMARK: objects created with new while an ArenaScope is in force go in its SceneArena
+ rather than on the heap. Every object carries in front of it which arena it is in, so
+ deleting one in an arena runs its destructor but leaves the memory to the arena.
  */
 class RayObject
 {
 protected:
    Point _position;
    Material _material;
+
+   // the arena, or 0 for the heap, noted in front of each object
+   static SceneArena *& arenaOf(const void *object)
+   {
+      return *(SceneArena **) ((char *) object - ARENA_ALIGNMENT);
+   }
+
 public:
    RayObject(const Point& p, const Material& m)
    {
@@ -468,6 +774,32 @@ public:
       _material = m;
    }
 
+   virtual ~RayObject()
+   {
+   }
+
+   static void *operator new(size_t size)
+   {
+      SceneArena *arena = SceneArena::current();
+      size += ARENA_ALIGNMENT;
+      char *p = (char *) (arena ? arena->allocate(size) : ::operator new(size));
+      p += ARENA_ALIGNMENT;
+      arenaOf(p) = arena;
+      return p;
+   }
+
+   static void operator delete(void *p)
+   {
+      if (p && !arenaOf(p))
+         ::operator delete((char *) p - ARENA_ALIGNMENT);
+   }
+
+   // true if the object's memory belongs to a SceneArena
+   bool inArena() const
+   {
+      return arenaOf(this) != 0;
+   }
+
    //returns position of rayobject
    Point position()
    {
@@ -477,6 +809,13 @@ public:
    virtual void doIIntersectWith(const Line& l, const Point& positionOffset,
          Intersection& inter) = 0;
    // by overriding intersection in different ways control how rays hit objects in our scene
+
+   virtual void bounds(const Point& positionOffset, Point& lo, Point& hi) = 0;
+   // axis aligned box containing everything this object can be hit at
+
+   virtual void compileInto(const Point& positionOffset, CompiledScene& out) = 0;
+   // adds this object's primitives to the flat arrays the renderer traces against,
+   // see CompiledScene.h
 };
 
 /*
@@ -496,10 +835,10 @@ private:
    Point _v;
    Point _n;
 
-   GLdouble _uv;
-   GLdouble _uu;
-   GLdouble _vv;
-   GLdouble _denominator;
+   Real _uv;
+   Real _uu;
+   Real _vv;
+   Real _denominator;
 
    bool _degenerate;
 
@@ -569,7 +908,7 @@ public:
       Point p0 = ray.startPoint();
       Point p1 = ray.endPoint();
       Point diffP = p1 - p0;
-      GLdouble ndiffP = _n & diffP;
+      Real ndiffP = _n & diffP;
 
       //handle another degenerate case by saying we don't intersect
       if (abs(ndiffP) < SMALL_NUMBER)
@@ -578,7 +917,7 @@ public:
          return;
       }
 
-      GLdouble m = (_n & (v - p0)) / (_n & diffP);
+      Real m = (_n & (v - p0)) / (_n & diffP);
 
       if (m < SMALL_NUMBER) //if m is negative then we don't intersect
       {
@@ -591,45 +930,31 @@ public:
       Point w = p - v;
 
       //Now check if in triangle
-      GLdouble wu = w & _u;
-      GLdouble wv = w & _v;
+      Real wu = w & _u;
+      Real wv = w & _v;
 
-      GLdouble s = (_uv * wv - _vv * wu) / _denominator;
-      GLdouble t = (_uv * wu - _uu * wv) / _denominator;
+      Real s = (_uv * wv - _vv * wu) / _denominator;
+      Real t = (_uv * wu - _uu * wv) / _denominator;
 
       if (s >= 0 && t >= 0 && s + t <= 1) // intersect
       {
          diffP.normalize(); // now u is as in the book
-         Point u = diffP;
-
-         Point r = u - (2 * (u & _n)) * _n;
-         Line reflected(p, p + r);
-
-         //Transmitted vector calculated using thin lens equations from book
-         GLdouble refractionRatio = _material.refraction();
-
-         Point t(0.0, 0.0, 0.0);
-
-         GLdouble cosThetai = u & _n;
-         GLdouble modulus = 1
-               - refractionRatio * refractionRatio
-                     * (1 - cosThetai * cosThetai);
-
-         if (modulus > 0)
-         {
-            GLdouble cosThetar = sqrt(modulus);
-            t = refractionRatio * u
-                  - (cosThetar + refractionRatio * cosThetai) * _n;
-         }
-
-         Line transmitted(p, p + t);
-         inter.setValues(true, p, _n, _material, reflected, transmitted);
+         setHit(inter, p, diffP, _n, _material);
       }
       else // don't intersect
       {
          inter.setIntersect(false);
       }
    }
+
+   void bounds(const Point& positionOffset, Point& lo, Point& hi)
+   {
+      Point position = _position + positionOffset;
+      lo = minPoint(minPoint(_vertex0, _vertex1), _vertex2) + position;
+      hi = maxPoint(maxPoint(_vertex0, _vertex1), _vertex2) + position;
+   }
+
+   void compileInto(const Point& positionOffset, CompiledScene& out);
 };
 
 /*
@@ -641,12 +966,16 @@ public:
  */
 class Shape: public RayObject
 {
+public:
+   // kept in the same arena as the Shape, if it is in one
+   typedef vector<RayObject *, ArenaAllocator<RayObject *> > SubObjects;
+
 protected:
-   GLdouble _radius;
+   Real _radius;
    bool _amSphere;
    bool _canIntersectOnlyOneSubObject;
 
-   vector<RayObject *> _subObjects;
+   SubObjects _subObjects;
 
 public:
    Shape() :
@@ -655,7 +984,7 @@ public:
       _radius = 0;
       _amSphere = false;
    }
-   Shape(Point p, Material m, GLdouble radius, bool a, bool c = false) :
+   Shape(Point p, Material m, Real radius, bool a, bool c = false) :
          RayObject(p, m)
    {
       _radius = radius;
@@ -668,17 +997,19 @@ public:
     PURPOSE: destructs this shape and gets rid of any sub-object on it
     RECEIVES: nothing
     RETURNS: nothing
-    REMARKS:
+    REMARKS: sub-objects in an arena are left to it, so a scene built in one is freed
+    by releasing the arena rather than object by object
     */
    ~Shape()
    {
       for (size_t i = 0; i < _subObjects.size(); i++)
       {
-         delete _subObjects[i];
+         if (!_subObjects[i]->inArena())
+            delete _subObjects[i];
       }
    }
 
-   void setRadius(GLdouble r)
+   void setRadius(Real r)
    {
       _radius = r;
    }
@@ -689,11 +1020,42 @@ public:
    }
 
    //return the vector
-   vector<RayObject*>& subObject()
+   SubObjects& subObject()
    {
 	   return _subObjects;
    }
 
+   /*
+    PURPOSE: computes an axis aligned box around this Shape
+    RECEIVES:
+    positionOffset -- where in the overall scene this Shape lives
+    lo, hi -- filled in with the minimum and maximum corner of the box
+    RETURNS: nothing
+    REMARKS: spheres use their radius, composites the union of their sub-objects
+    */
+   void bounds(const Point& positionOffset, Point& lo, Point& hi)
+   {
+      Point position = _position + positionOffset;
+      if (_amSphere || _subObjects.empty())
+      {
+         Point r(_radius, _radius, _radius);
+         lo = position - r;
+         hi = position + r;
+         return;
+      }
+
+      Point subLo, subHi;
+      _subObjects[0]->bounds(position, lo, hi);
+      for (size_t i = 1; i < _subObjects.size(); i++)
+      {
+         _subObjects[i]->bounds(position, subLo, subHi);
+         lo = minPoint(lo, subLo);
+         hi = maxPoint(hi, subHi);
+      }
+   }
+
+   void compileInto(const Point& positionOffset, CompiledScene& out);
+
 
    /*
     PURPOSE: used to fill in an Intersection object with information about how the supplied ray
@@ -719,14 +1081,20 @@ public:
        */
       if (_radius > 0 || _amSphere)
       {
-         GLdouble uDeltaP = u & deltaP;
-         GLdouble discriminant = uDeltaP * uDeltaP - (deltaP & deltaP)
+         Real uDeltaP = u & deltaP;
+         Real discriminant = uDeltaP * uDeltaP - (deltaP & deltaP)
                + _radius * _radius;
 
-         GLdouble s = uDeltaP - sqrt(discriminant); //other solution is on far side of sphere
+         Real s = uDeltaP - sqrt(discriminant); //other solution is on far side of sphere
 
+         if (_amSphere)
+            COUNT(sphereTests, 1);
+         else
+            COUNT(boundingSphereTests, 1);
          if (discriminant < 0 || abs(s) < SMALL_NUMBER)
          {
+            if (!_amSphere)
+               COUNT(boundingSphereRejections, 1);
             inter.setIntersect(false);
             return;
          }
@@ -743,29 +1111,10 @@ public:
                return;
             }
 
-            //reflected vector calculated using equations from book
+            COUNT(sphereHits, 1);
             Point n(directionP0);
             n.normalize();
-
-            Point r = u - (2 * (u & n)) * n;
-            Line reflected(p, p + r);
-
-            //Transmitted vector calculated using thin lens equations from book
-            Point t(0.0, 0.0, 0.0);
-            GLdouble refractionRatio = _material.refraction();
-            GLdouble cosThetai = u & n;
-            GLdouble modulus = 1
-                  - refractionRatio * refractionRatio
-                        * (1 - cosThetai * cosThetai);
-
-            if (modulus > 0)
-            {
-               GLdouble cosThetar = sqrt(modulus);
-               t = refractionRatio * u
-                     - (cosThetar + refractionRatio * cosThetai) * n;
-            }
-            Line transmitted(p, p + t);
-            inter.setValues(true, p, n, _material, reflected, transmitted);
+            setHit(inter, p, u, n, _material);
          }
       }
 
@@ -774,8 +1123,8 @@ public:
          inter.setIntersect(false);
          Intersection interTmp;
 
-         GLdouble minDistance = -1.0;
-         GLdouble distanceTmp;
+         Real minDistance = -1.0;
+         Real distanceTmp;
          size_t size = _subObjects.size();
          for (size_t i = 0; i < size; i++)
          {
@@ -798,6 +1147,7 @@ public:
    }
 };
 
+SceneArena sceneArena; // where the objects of the global scene are built, see ArenaScope
 Shape scene(BOARD_POSITION, Material(), sqrt((double) 3) * BOARD_HALF_SIZE,
       false); // global shape for whole scene
 
@@ -838,49 +1188,56 @@ public:
  */
 class Tetrahedron: public Shape
 {
+private:
+   Real _edgeSize;
+
 public:
    /*
     PURPOSE: construct a Tetrahedron at the given offset position and edgeSize in our Scene
     RECEIVES:
     p -- position offset into our scene
     edgeSize -- size of an edge of our cube
+    m -- Material it is made of
     RETURNS: a Tetrahedron object
-    REMARKS:  note tetrahedronMaterial is a global in this file.
+    REMARKS:  note tetrahedronMaterial (a global in this file) is the default Material.
     Since the HW description didn't say the tetrahedron was regular, we took the tetrahedron to be the
     one obtained by slicing the cube from a top corner through the diagonal of the bottom face
     */
-   Tetrahedron(Point p, GLdouble edgeSize) :
-         Shape(p, tetrahedronMaterial, sqrt((double) 3) * edgeSize / 2, false)
+   Tetrahedron(Point p, Real edgeSize, const Material& m = tetrahedronMaterial) :
+         Shape(p, m, sqrt((double) 3) * edgeSize / 2, false)
    {
+      _edgeSize = edgeSize;
       Point zero(0.0, 0.0, 0.0);
-      GLdouble halfEdge = edgeSize / 2;
+      Real halfEdge = edgeSize / 2;
 
       //bottom
       addRayObject(
-            new Triangle(zero, tetrahedronMaterial,
+            new Triangle(zero, m,
                   Point(-halfEdge, -halfEdge, -halfEdge),
                   Point(halfEdge, -halfEdge, -halfEdge),
                   Point(-halfEdge, -halfEdge, halfEdge)));
       //back
       addRayObject(
-            new Triangle(zero, tetrahedronMaterial,
+            new Triangle(zero, m,
                   Point(-halfEdge, -halfEdge, -halfEdge),
                   Point(-halfEdge, -halfEdge, halfEdge),
                   Point(-halfEdge, halfEdge, -halfEdge)));
 
       //left
       addRayObject(
-            new Triangle(zero, tetrahedronMaterial,
+            new Triangle(zero, m,
                   Point(-halfEdge, -halfEdge, -halfEdge),
                   Point(-halfEdge, halfEdge, -halfEdge),
                   Point(-halfEdge, -halfEdge, halfEdge)));
       //front
       addRayObject(
-            new Triangle(zero, tetrahedronMaterial,
+            new Triangle(zero, m,
                   Point(-halfEdge, -halfEdge, halfEdge),
                   Point(halfEdge, -halfEdge, -halfEdge),
                   Point(-halfEdge, halfEdge, -halfEdge)));
    }
+
+   void compileInto(const Point& positionOffset, CompiledScene& out);
 };
 
 /*
@@ -896,14 +1253,15 @@ public:
     RECEIVES:
     p -- position offset into our scene
     r -- radius of Sphere
+    m -- Material it is made of
     RETURNS: a Sphere object
-    REMARKS:  sphereMaterial is a global in this file.
+    REMARKS:  sphereMaterial (a global in this file) is the default Material.
     The constructor mainly just calls the base constructor with the appropriate material
     and with the flag for Shape telling the Shape that it is a non-composite
     sphere (the last paramter true to the Shape constructor)
     */
-   Sphere(Point p, GLdouble r) :
-         Shape(p, sphereMaterial, r, true)
+   Sphere(Point p, Real r, const Material& m = sphereMaterial) :
+         Shape(p, m, r, true)
    {
    }
 };
@@ -911,77 +1269,195 @@ public:
 /*
  PURPOSE: encapsulate information about
  cubes to be drawn in our scene (in this case just one)
- REMARK:
+ REMARK: a cube is one axis aligned box, hit with a slab test rather than built from
+ triangles
  */
 class Cube: public Shape
 {
+private:
+   Real _edgeSize;
+
+   // half the cube's size along each axis
+   Point halfSize() const
+   {
+      return Point(_edgeSize / 2, _edgeSize / 2, _edgeSize / 2);
+   }
+
 public:
    /*
     PURPOSE: constructs a Cube at the given offset position and edgeSize in our Scene
     RECEIVES:
     p -- position offset into our scene
     edgeSize -- size of an edge of our cube
+    m -- Material it is made of
     RETURNS: a cube object
-    REMARKS:  note cubeMaterial is a global in this file
+    REMARKS:  note cubeMaterial (a global in this file) is the default Material
     */
-   Cube(Point p, GLdouble edgeSize) :
-         Shape(p, cubeMaterial, sqrt((double) 3) * edgeSize / 2, false)
+   Cube(Point p, Real edgeSize, const Material& m = cubeMaterial) :
+         Shape(p, m, sqrt((double) 3) * edgeSize / 2, false)
    {
-      GLdouble halfEdge = edgeSize / 2;
+      _edgeSize = edgeSize;
+   }
 
-      Point zero(0.0, 0.0, 0.0);
-      //top
-      addRayObject(
-            new Quad(zero, cubeMaterial, Point(-halfEdge, halfEdge, -halfEdge),
-                  Point(halfEdge, halfEdge, -halfEdge),
-                  Point(halfEdge, halfEdge, halfEdge),
-                  Point(-halfEdge, halfEdge, halfEdge)));
+   void doIIntersectWith(const Line& ray, const Point& positionOffset,
+         Intersection& inter)
+   {
+      Point centre = _position + positionOffset;
+      Point p0 = ray.startPoint();
+      Point u = ray.direction();
+      COUNT(boxTests, 1);
+      Real s = boxDistance(centre - halfSize(), centre + halfSize(), p0, u);
+      if (s == HUGE_VAL)
+      {
+         inter.setIntersect(false);
+         return;
+      }
+      COUNT(boxHits, 1);
+      Point p = p0 + s * u;
+      setHit(inter, p, u, boxNormal(centre, halfSize(), p), _material);
+   }
 
-      //bottom
-      addRayObject(
-            new Quad(zero, cubeMaterial, Point(-halfEdge, -halfEdge, -halfEdge),
-                  Point(halfEdge, -halfEdge, -halfEdge),
-                  Point(halfEdge, -halfEdge, halfEdge),
-                  Point(-halfEdge, -halfEdge, halfEdge)));
+   void bounds(const Point& positionOffset, Point& lo, Point& hi)
+   {
+      Point centre = _position + positionOffset;
+      lo = centre - halfSize();
+      hi = centre + halfSize();
+   }
 
-      //left
-      addRayObject(
-            new Quad(zero, cubeMaterial, Point(-halfEdge, -halfEdge, -halfEdge),
-                  Point(-halfEdge, halfEdge, -halfEdge),
-                  Point(-halfEdge, halfEdge, halfEdge),
-                  Point(-halfEdge, -halfEdge, halfEdge)));
-      //right
-      addRayObject(
-            new Quad(zero, cubeMaterial, Point(halfEdge, -halfEdge, -halfEdge),
-                  Point(halfEdge, halfEdge, -halfEdge),
-                  Point(halfEdge, halfEdge, halfEdge),
-                  Point(halfEdge, -halfEdge, halfEdge)));
-      //back
-      addRayObject(
-            new Quad(zero, cubeMaterial, Point(-halfEdge, -halfEdge, -halfEdge),
-                  Point(halfEdge, -halfEdge, -halfEdge),
-                  Point(halfEdge, halfEdge, -halfEdge),
-                  Point(-halfEdge, halfEdge, -halfEdge)));
+   void compileInto(const Point& positionOffset, CompiledScene& out);
+};
 
-      //front
-      addRayObject(
-            new Quad(zero, cubeMaterial, Point(-halfEdge, -halfEdge, halfEdge),
-                  Point(halfEdge, -halfEdge, halfEdge),
-                  Point(halfEdge, halfEdge, halfEdge),
-                  Point(-halfEdge, halfEdge, halfEdge)));
+/*
+ PURPOSE: encapsulates information about upright cones, possibly cut off at the top
+ REMARK: positioned by the centre of the box around it, like a Cube. The side is a
+ quadric and the bottom and top are discs, see cappedConeDistance; cylinders are
+ capped cones whose top is as wide as their bottom.
+ */
+class CappedCone: public Shape
+{
+private:
+   Real _bottomRadius;
+   Real _topRadius;
+   Real _height;
+
+   // centre of the bottom disc
+   Point base(const Point& positionOffset) const
+   {
+      return _position + positionOffset - Point(0.0, _height / 2, 0.0);
+   }
+
+public:
+   /*
+    PURPOSE: constructs a CappedCone at the given offset position in our Scene
+    RECEIVES:
+    p -- position offset into our scene
+    bottomRadius, topRadius -- radius of its bottom and top
+    height -- how tall it is
+    m -- Material it is made of
+    RETURNS: a CappedCone object
+    REMARKS: the bounding sphere radius given to Shape reaches the bottom and top rims
+    */
+   CappedCone(Point p, Real bottomRadius, Real topRadius, Real height, const Material& m) :
+         Shape(p, m, sqrt(max(bottomRadius, topRadius) * max(bottomRadius, topRadius)
+               + height * height / 4), false)
+   {
+      _bottomRadius = bottomRadius;
+      _topRadius = topRadius;
+      _height = height;
+   }
+
+   void doIIntersectWith(const Line& ray, const Point& positionOffset,
+         Intersection& inter)
+   {
+      Point b = base(positionOffset);
+      Point p0 = ray.startPoint();
+      Point u = ray.direction();
+      unsigned int part;
+      COUNT(coneTests, 1);
+      Real s = cappedConeDistance(b, _height, _bottomRadius, _topRadius, p0, u, part);
+      if (s == HUGE_VAL)
+      {
+         inter.setIntersect(false);
+         return;
+      }
+      COUNT(coneHits, 1);
+      Point p = p0 + s * u;
+      setHit(inter, p, u, cappedConeNormal(b, _height, _bottomRadius, _topRadius, p, part),
+            _material);
+   }
+
+   void bounds(const Point& positionOffset, Point& lo, Point& hi)
+   {
+      Real r = max(_bottomRadius, _topRadius);
+      Point b = base(positionOffset);
+      lo = b - Point(r, 0.0, r);
+      hi = b + Point(r, _height, r);
+   }
+
+   void compileInto(const Point& positionOffset, CompiledScene& out);
+};
+
+/*
+ PURPOSE: encapsulates information about cones to be drawn in our scene
+ REMARK: the point is at the top
+ */
+class Cone: public CappedCone
+{
+public:
+   /*
+    PURPOSE: constructs a Cone at the given offset position in our Scene
+    RECEIVES:
+    p -- position offset into our scene, the centre of the box around the cone
+    radius -- radius of its bottom
+    height -- how tall it is
+    m -- Material it is made of
+    RETURNS: a Cone object
+    REMARKS: coneMaterial (a global in this file) is the default Material
+    */
+   Cone(Point p, Real radius, Real height, const Material& m = coneMaterial) :
+         CappedCone(p, radius, 0, height, m)
+   {
+   }
+};
+
+/*
+ PURPOSE: encapsulates information about cylinders to be drawn in our scene
+ REMARK: upright, with both ends closed
+ */
+class Cylinder: public CappedCone
+{
+public:
+   /*
+    PURPOSE: constructs a Cylinder at the given offset position in our Scene
+    RECEIVES:
+    p -- position offset into our scene, the centre of the cylinder
+    radius -- its radius
+    height -- how tall it is
+    m -- Material it is made of
+    RETURNS: a Cylinder object
+    REMARKS: cylinderMaterial (a global in this file) is the default Material
+    */
+   Cylinder(Point p, Real radius, Real height, const Material& m = cylinderMaterial) :
+         CappedCone(p, radius, radius, height, m)
+   {
    }
 };
 
 /*
  PURPOSE: encapsulates information about
  checkerboards to be drawn in our scene (in this case just one)
- REMARK:
+ REMARK: a bounded plane centred on its position, lying flat, hit analytically by
+ boardDistance rather than through triangles
  */
 class CheckerBoard: public Shape
 {
 private:
-   Quad _boundingSquare; /* this Quad is used for a quick test to see if a
-    ray intersects our chessboard */
+   // corner the squares are counted from
+   Point corner(const Point& positionOffset) const
+   {
+      return _position + positionOffset - Point(BOARD_HALF_SIZE, 0, BOARD_HALF_SIZE);
+   }
+
 public:
 
    /*
@@ -993,13 +1469,7 @@ public:
     chessboard.
     */
    CheckerBoard(Point p) :
-         Shape(), _boundingSquare(p, Material(),
-               Point(-BOARD_HALF_SIZE, 0, -BOARD_HALF_SIZE),
-               Point(BOARD_HALF_SIZE, 0, -BOARD_HALF_SIZE),
-               Point(BOARD_HALF_SIZE, 0, BOARD_HALF_SIZE),
-               Point(-BOARD_HALF_SIZE, 0, BOARD_HALF_SIZE)) /*initialize
-    bounding square to be used for quick tests if ray intersects
-    chess board */
+         Shape(p, Material(), sqrt((double) 2) * BOARD_HALF_SIZE, false)
    {
    }
    /*
@@ -1015,24 +1485,29 @@ public:
    void doIIntersectWith(const Line& ray, const Point& positionOffset,
          Intersection& intersection)
    {
-      _boundingSquare.doIIntersectWith(ray, positionOffset, intersection);
-
-      if (intersection.intersects())
+      Point p0 = ray.startPoint();
+      Point u = ray.direction();
+      bool black;
+      COUNT(boardTests, 1);
+      Real s = boardDistance(corner(positionOffset), BOARD_EDGE_SIZE, SQUARE_EDGE_SIZE, p0,
+            u, black);
+      if (s == HUGE_VAL)
       {
-         Point p = intersection.point() - positionOffset
-               + Point(BOARD_HALF_SIZE, 0, BOARD_HALF_SIZE);
-         int squareSum = int(p.x() / SQUARE_EDGE_SIZE)
-               + int(p.z() / SQUARE_EDGE_SIZE);
-
-         if ((squareSum & 1) == 0)
-         {
-            intersection.setMaterial(whiteSquare);
-         }
-         else
-         {
-            intersection.setMaterial(blackSquare);
-         }
+         intersection.setIntersect(false);
+         return;
       }
+      COUNT(boardHits, 1);
+      setHit(intersection, p0 + s * u, u, Point(0.0, 1.0, 0.0),
+            black ? blackSquare : whiteSquare);
    }
+
+   void bounds(const Point& positionOffset, Point& lo, Point& hi)
+   {
+      lo = corner(positionOffset);
+      hi = lo + Point(BOARD_EDGE_SIZE, 0, BOARD_EDGE_SIZE);
+   }
+
+   void compileInto(const Point& positionOffset, CompiledScene& out);
 };
 
+#endif
@@ -0,0 +1,195 @@
+#ifndef PATHRECORDS_H
+#define PATHRECORDS_H
+
+/*---------------------------------------------------------------------------*/
+/* INCLUDES */
+#include <vector>
+#include "Objects.h"
+#include "Bvh.h"
+
+/*---------------------------------------------------------------------------*/
+/*  VARIABLES */
+const int PATH_RECORD_SLOTS = 4; // capsules kept per pixel; more segments get merged in
+const Real PATH_RECORD_FAR = 10 * BOARD_EDGE_SIZE; // where rays that hit nothing are cut off
+
+/*---------------------------------------------------------------------------*/
+/* CLASS DEFINITIONS */
+/*
+ PURPOSE: a capsule around some ray segments of a pixel's paths
+ REMARK: every segment added has both ends within radius of the ends a and b (in one
+ order or the other), so all of it lies within radius of the segment from a to b.
+ code says what kind of segment it is (see rayPathCode); segments of the same kind from
+ different samples usually run close together and are put in the same capsule.
+ A code of 0 marks an unused slot.
+ */
+struct PathCapsule
+{
+   float a[3];
+   float b[3];
+   float radius;
+   unsigned int code;
+};
+
+/*
+ PURPOSE: the capsules around everything the paths of one pixel's samples went through
+ REMARK: primary rays run from the camera to what they hit, secondary rays from the
+ surface they leave to what they hit, shadow rays all the way from the surface to the
+ light whether they got there or not. Rays hitting nothing are taken as far as
+ PATH_RECORD_FAR, so changes further out than that are not noticed.
+ */
+struct PixelPaths
+{
+   PathCapsule capsules[PATH_RECORD_SLOTS];
+
+   PixelPaths()
+   {
+      clear();
+   }
+
+   void clear()
+   {
+      for (int i = 0; i < PATH_RECORD_SLOTS; i++)
+         capsules[i].code = 0;
+   }
+
+   /*
+    PURPOSE: adds a segment
+    RECEIVES:
+    code -- kind of segment, not 0
+    from, to -- its ends
+    RETURNS: nothing
+    REMARKS: goes into the capsule of the same kind, else a free slot, else whichever
+    capsule has to grow least to take it in
+    */
+   void add(unsigned int code, const Point& from, const Point& to)
+   {
+      float p[3] = { (float) from.x(), (float) from.y(), (float) from.z() };
+      float q[3] = { (float) to.x(), (float) to.y(), (float) to.z() };
+
+      int best = -1;
+      float bestRadius2 = HUGE_VALF;
+      for (int i = 0; i < PATH_RECORD_SLOTS; i++)
+      {
+         PathCapsule& c = capsules[i];
+         if (c.code == 0)
+         {
+            for (int k = 0; k < 3; k++)
+            {
+               c.a[k] = p[k];
+               c.b[k] = q[k];
+            }
+            c.radius = 0;
+            c.code = code;
+            return;
+         }
+         float r2 = grownRadius2(c, p, q);
+         if (c.code == code)
+         {
+            if (r2 > c.radius * c.radius)
+               c.radius = sqrt(r2);
+            return;
+         }
+         r2 = max(r2, c.radius * c.radius);
+         if (r2 < bestRadius2)
+         {
+            best = i;
+            bestRadius2 = r2;
+         }
+      }
+      capsules[best].radius = sqrt(bestRadius2);
+   }
+
+   // true if some segment added since the last clear might pass through box
+   bool touches(const Aabb& box) const
+   {
+      for (int i = 0; i < PATH_RECORD_SLOTS && capsules[i].code != 0; i++)
+         if (capsuleTouches(capsules[i], box))
+            return true;
+      return false;
+   }
+
+   // square of how far the ends of the segment from p to q are from those of c, the
+   // nearer way round
+   static float grownRadius2(const PathCapsule& c, const float p[3], const float q[3])
+   {
+      float same = max(distance2(c.a, p), distance2(c.b, q));
+      float swapped = max(distance2(c.a, q), distance2(c.b, p));
+      return min(same, swapped);
+   }
+
+   static float distance2(const float a[3], const float b[3])
+   {
+      float dx = a[0] - b[0], dy = a[1] - b[1], dz = a[2] - b[2];
+      return dx * dx + dy * dy + dz * dz;
+   }
+
+   /*
+    PURPOSE: conservative test of a capsule against a box
+    RECEIVES: c, box -- what to test
+    RETURNS: true if the axis of the capsule passes through the box grown by the
+    capsule's radius on every side
+    REMARKS: the grown box holds every point within radius of the box, so a false
+    return means the capsule misses the box for sure
+    */
+   static bool capsuleTouches(const PathCapsule& c, const Aabb& box)
+   {
+      float t0 = 0, t1 = 1;
+      for (int k = 0; k < 3; k++)
+      {
+         float lo = box.lo[k] - c.radius, hi = box.hi[k] + c.radius;
+         float d = c.b[k] - c.a[k];
+         if (d == 0)
+         {
+            if (c.a[k] < lo || c.a[k] > hi)
+               return false;
+            continue;
+         }
+         float tLo = (lo - c.a[k]) / d, tHi = (hi - c.a[k]) / d;
+         if (tLo > tHi)
+            swap(tLo, tHi);
+         t0 = max(t0, tLo);
+         t1 = min(t1, tHi);
+         if (t0 > t1)
+            return false;
+      }
+      return true;
+   }
+};
+
+/*---------------------------------------------------------------------------*/
+/* FUNCTIONS */
+/*
+ PURPOSE: code telling the kinds of segments of a path apart
+ RECEIVES:
+ path -- which ray of the sample's tree of rays: 1 for the primary ray, twice the code of
+ the ray it came from for reflected rays and one more than that for transmitted ones
+ light -- for shadow rays, which light they go to
+ RETURNS: a code which is never 0
+ REMARKS:
+ */
+inline unsigned int rayPathCode(unsigned int path)
+{
+   return path << 1;
+}
+inline unsigned int shadowPathCode(unsigned int path, unsigned int light)
+{
+   return (path << 1 | 1) + (light << 16);
+}
+
+/*
+ PURPOSE: whether any of a set of boxes might be seen by a pixel
+ RECEIVES:
+ paths -- the pixel's record
+ boxes -- what changed
+ RETURNS: true if one of the boxes touches one of the pixel's capsules
+ REMARKS:
+ */
+inline bool pathsTouch(const PixelPaths& paths, const vector<Aabb>& boxes)
+{
+   for (size_t i = 0; i < boxes.size(); i++)
+      if (paths.touches(boxes[i]))
+         return true;
+   return false;
+}
+
+#endif
@@ -0,0 +1,700 @@
+#ifndef RAYPACKET_H
+#define RAYPACKET_H
+
+/*---------------------------------------------------------------------------*/
+/* INCLUDES */
+#include "CompiledScene.h"
+
+/*
+ Packets of 8 rays traced together with AVX2, one ray per SIMD lane. Only built when
+ the compiler targets AVX2 (make AVX2=1); without it PACKET_TRACING stays undefined
+ and the renderer traces every ray on its own.
+ */
+#ifdef __AVX2__
+#include <immintrin.h>
+#define PACKET_TRACING
+
+/*---------------------------------------------------------------------------*/
+/*  VARIABLES */
+const int PACKET_SIZE = 8; // rays per packet, one per AVX lane
+const int PACKET_WIDTH = 4; // a packet covers a PACKET_WIDTH x PACKET_HEIGHT block of pixels
+const int PACKET_HEIGHT = 2;
+
+/*---------------------------------------------------------------------------*/
+/* CLASS DEFINITIONS */
+/*
+ PURPOSE: 8 rays laid out one array per coordinate so each loads into one AVX register
+ REMARK: directions must be normalized; distance then is how far along its ray a lane's
+ closest hit is, primitive is the id of what it hit and element, b1 and b2 are as in
+ Hit. Lanes whose bit in activeMask is clear are carried along but never hit anything.
+ */
+struct RayPacket
+{
+   alignas(32) float ox[PACKET_SIZE];
+   alignas(32) float oy[PACKET_SIZE];
+   alignas(32) float oz[PACKET_SIZE];
+   alignas(32) float dx[PACKET_SIZE];
+   alignas(32) float dy[PACKET_SIZE];
+   alignas(32) float dz[PACKET_SIZE];
+   alignas(32) float distance[PACKET_SIZE];
+   alignas(32) unsigned int primitive[PACKET_SIZE];
+   alignas(32) unsigned int element[PACKET_SIZE];
+   alignas(32) float b1[PACKET_SIZE];
+   alignas(32) float b2[PACKET_SIZE];
+   unsigned int activeMask;
+
+   // makes all lanes inactive
+   void clear()
+   {
+      for (int i = 0; i < PACKET_SIZE; i++)
+      {
+         ox[i] = oy[i] = oz[i] = 0.0f;
+         dx[i] = dy[i] = dz[i] = 1.0f;
+         distance[i] = HUGE_VALF;
+         primitive[i] = NO_PRIMITIVE;
+         element[i] = 0;
+         b1[i] = b2[i] = 0.0f;
+      }
+      activeMask = 0;
+   }
+
+   // sets lane i to the given ray, clearing any hit it had
+   void setRay(int i, const Line& ray)
+   {
+      Point o = ray.startPoint();
+      Point d = ray.direction();
+      ox[i] = o.x();
+      oy[i] = o.y();
+      oz[i] = o.z();
+      dx[i] = d.x();
+      dy[i] = d.y();
+      dz[i] = d.z();
+      distance[i] = HUGE_VALF;
+      primitive[i] = NO_PRIMITIVE;
+      element[i] = 0;
+      b1[i] = b2[i] = 0.0f;
+      activeMask |= 1u << i;
+   }
+
+   // what lane i hit, to be passed to CompiledScene::shade
+   Hit hit(int i) const
+   {
+      Hit h;
+      if (primitive[i] != NO_PRIMITIVE)
+         h.distance = distance[i];
+      h.primitive = primitive[i];
+      h.element = element[i];
+      h.b1 = b1[i];
+      h.b2 = b2[i];
+      return h;
+   }
+};
+
+/*
+ PURPOSE: the packet's rays held in registers while it goes through the Bvh
+ */
+struct PacketRegisters
+{
+   __m256 ox, oy, oz;
+   __m256 dx, dy, dz;
+   __m256 invDx, invDy, invDz;
+   __m256 closest;
+   __m256i primitive;
+   __m256i element;
+   __m256 b1, b2;
+};
+
+/*---------------------------------------------------------------------------*/
+/* FUNCTIONS */
+// smallest of the 8 lanes
+inline float horizontalMin(__m256 v)
+{
+   __m128 m = _mm_min_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+   m = _mm_min_ps(m, _mm_movehl_ps(m, m));
+   m = _mm_min_ss(m, _mm_shuffle_ps(m, m, 1));
+   return _mm_cvtss_f32(m);
+}
+
+/*
+ PURPOSE: slab test of all rays of a packet against a box
+ RECEIVES:
+ box -- box to test
+ r -- the packet
+ tEnter -- set to the smallest entry distance of the lanes which hit the box
+ RETURNS: bitmask of the lanes whose ray enters the box before their closest hit
+ REMARKS:
+ */
+inline int packetHitsBox(const Aabb& box, const PacketRegisters& r, float& tEnter)
+{
+   __m256 tx0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.lo[0]), r.ox), r.invDx);
+   __m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.hi[0]), r.ox), r.invDx);
+   __m256 ty0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.lo[1]), r.oy), r.invDy);
+   __m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.hi[1]), r.oy), r.invDy);
+   __m256 tz0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.lo[2]), r.oz), r.invDz);
+   __m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.hi[2]), r.oz), r.invDz);
+
+   __m256 tNear = _mm256_max_ps(
+         _mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)),
+         _mm256_max_ps(_mm256_min_ps(tz0, tz1), _mm256_setzero_ps()));
+   __m256 tFar = _mm256_min_ps(
+         _mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)),
+         _mm256_min_ps(_mm256_max_ps(tz0, tz1), r.closest));
+
+   __m256 hit = _mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ);
+   tEnter = horizontalMin(_mm256_blendv_ps(_mm256_set1_ps(HUGE_VALF), tNear, hit));
+   COUNT(bvhNodes, PACKET_SIZE);
+   COUNT(bvhRejections, PACKET_SIZE - __builtin_popcount(_mm256_movemask_ps(hit)));
+   return _mm256_movemask_ps(hit);
+}
+
+/*
+ PURPOSE: masked test of all rays of a packet against one triangle
+ RECEIVES:
+ t -- the scene's triangles
+ i -- index of the triangle to test
+ id -- its primitive id
+ r -- the packet; lanes for which the triangle is closer than their closest hit get it
+ nearest -- hits closer than this don't count, as for triangleBatchDistances
+ RETURNS: nothing
+ REMARKS: the plane and barycentric test of Triangle::doIIntersectWith, done for
+ 8 rays at once in single precision
+ */
+inline void packetIntersectTriangle(const TriangleArrays& t, unsigned int i,
+      unsigned int id, PacketRegisters& r, float nearest = SMALL_NUMBER)
+{
+   __m256 nx = _mm256_set1_ps(t.n[0][i]);
+   __m256 ny = _mm256_set1_ps(t.n[1][i]);
+   __m256 nz = _mm256_set1_ps(t.n[2][i]);
+   __m256 ndiffP = _mm256_fmadd_ps(nx, r.dx,
+         _mm256_fmadd_ps(ny, r.dy, _mm256_mul_ps(nz, r.dz)));
+
+   __m256 toX = _mm256_sub_ps(_mm256_set1_ps(t.v0[0][i]), r.ox);
+   __m256 toY = _mm256_sub_ps(_mm256_set1_ps(t.v0[1][i]), r.oy);
+   __m256 toZ = _mm256_sub_ps(_mm256_set1_ps(t.v0[2][i]), r.oz);
+   __m256 m = _mm256_div_ps(_mm256_fmadd_ps(nx, toX,
+         _mm256_fmadd_ps(ny, toY, _mm256_mul_ps(nz, toZ))), ndiffP);
+
+   __m256 small = _mm256_set1_ps(SMALL_NUMBER);
+   __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+   __m256 valid = _mm256_and_ps(
+         _mm256_cmp_ps(_mm256_and_ps(ndiffP, absMask), small, _CMP_GE_OQ),
+         _mm256_and_ps(_mm256_cmp_ps(m, _mm256_set1_ps(nearest), _CMP_GE_OQ),
+               _mm256_cmp_ps(m, r.closest, _CMP_LT_OQ)));
+   COUNT(triangleTests, PACKET_SIZE);
+   if (_mm256_movemask_ps(valid) == 0)
+      return;
+
+   // w = p - v0 where p = o + m d is the hit with the plane
+   __m256 wx = _mm256_fmsub_ps(m, r.dx, toX);
+   __m256 wy = _mm256_fmsub_ps(m, r.dy, toY);
+   __m256 wz = _mm256_fmsub_ps(m, r.dz, toZ);
+   __m256 wu = _mm256_fmadd_ps(wx, _mm256_set1_ps(t.u[0][i]),
+         _mm256_fmadd_ps(wy, _mm256_set1_ps(t.u[1][i]),
+               _mm256_mul_ps(wz, _mm256_set1_ps(t.u[2][i]))));
+   __m256 wv = _mm256_fmadd_ps(wx, _mm256_set1_ps(t.v[0][i]),
+         _mm256_fmadd_ps(wy, _mm256_set1_ps(t.v[1][i]),
+               _mm256_mul_ps(wz, _mm256_set1_ps(t.v[2][i]))));
+
+   __m256 uu = _mm256_set1_ps(t.uu[i]);
+   __m256 uv = _mm256_set1_ps(t.uv[i]);
+   __m256 vv = _mm256_set1_ps(t.vv[i]);
+   __m256 invDenominator = _mm256_set1_ps(1.0f / t.denominator[i]);
+   __m256 s = _mm256_mul_ps(_mm256_fmsub_ps(uv, wv, _mm256_mul_ps(vv, wu)),
+         invDenominator);
+   __m256 b = _mm256_mul_ps(_mm256_fmsub_ps(uv, wu, _mm256_mul_ps(uu, wv)),
+         invDenominator);
+
+   __m256 zero = _mm256_setzero_ps();
+   valid = _mm256_and_ps(valid, _mm256_and_ps(
+         _mm256_and_ps(_mm256_cmp_ps(s, zero, _CMP_GE_OQ),
+               _mm256_cmp_ps(b, zero, _CMP_GE_OQ)),
+         _mm256_cmp_ps(_mm256_add_ps(s, b), _mm256_set1_ps(1.0f), _CMP_LE_OQ)));
+
+   COUNT(triangleHits, __builtin_popcount(_mm256_movemask_ps(valid)));
+   r.closest = _mm256_blendv_ps(r.closest, m, valid);
+   r.primitive = _mm256_castps_si256(_mm256_blendv_ps(
+         _mm256_castsi256_ps(r.primitive),
+         _mm256_castsi256_ps(_mm256_set1_epi32(id)), valid));
+   r.b1 = _mm256_blendv_ps(r.b1, s, valid);
+   r.b2 = _mm256_blendv_ps(r.b2, b, valid);
+}
+
+/*
+ PURPOSE: masked test of all rays of a packet against one sphere
+ RECEIVES:
+ sp -- the scene's spheres
+ i -- index of the sphere to test
+ id -- its primitive id
+ r -- the packet; lanes for which the sphere is closer than their closest hit get it
+ RETURNS: nothing
+ REMARKS: same test as the sphere case of Shape::doIIntersectWith, 8 rays at once
+ */
+inline void packetIntersectSphere(const SphereArrays& sp, unsigned int i,
+      unsigned int id, PacketRegisters& r)
+{
+   __m256 deltaX = _mm256_sub_ps(_mm256_set1_ps(sp.center[0][i]), r.ox);
+   __m256 deltaY = _mm256_sub_ps(_mm256_set1_ps(sp.center[1][i]), r.oy);
+   __m256 deltaZ = _mm256_sub_ps(_mm256_set1_ps(sp.center[2][i]), r.oz);
+   __m256 radius = _mm256_set1_ps(sp.radius[i]);
+
+   __m256 uDeltaP = _mm256_fmadd_ps(r.dx, deltaX,
+         _mm256_fmadd_ps(r.dy, deltaY, _mm256_mul_ps(r.dz, deltaZ)));
+   __m256 deltaP2 = _mm256_fmadd_ps(deltaX, deltaX,
+         _mm256_fmadd_ps(deltaY, deltaY, _mm256_mul_ps(deltaZ, deltaZ)));
+   __m256 discriminant = _mm256_fmadd_ps(radius, radius,
+         _mm256_fmsub_ps(uDeltaP, uDeltaP, deltaP2));
+
+   __m256 valid = _mm256_cmp_ps(discriminant, _mm256_setzero_ps(), _CMP_GE_OQ);
+   COUNT(sphereTests, PACKET_SIZE);
+   if (_mm256_movemask_ps(valid) == 0)
+      return;
+
+   __m256 s = _mm256_sub_ps(uDeltaP, _mm256_sqrt_ps(
+         _mm256_max_ps(discriminant, _mm256_setzero_ps())));
+   valid = _mm256_and_ps(valid, _mm256_and_ps(
+         _mm256_cmp_ps(s, _mm256_set1_ps(SMALL_NUMBER), _CMP_GE_OQ),
+         _mm256_cmp_ps(s, r.closest, _CMP_LT_OQ)));
+
+   COUNT(sphereHits, __builtin_popcount(_mm256_movemask_ps(valid)));
+   r.closest = _mm256_blendv_ps(r.closest, s, valid);
+   r.primitive = _mm256_castps_si256(_mm256_blendv_ps(
+         _mm256_castsi256_ps(r.primitive),
+         _mm256_castsi256_ps(_mm256_set1_epi32(id)), valid));
+   r.b1 = _mm256_andnot_ps(valid, r.b1);
+   r.b2 = _mm256_andnot_ps(valid, r.b2);
+}
+
+/*
+ PURPOSE: masked test of all rays of a packet against one box
+ RECEIVES:
+ b -- the scene's boxes
+ i -- index of the box to test
+ id -- its primitive id
+ r -- the packet; lanes for which the box is closer than their closest hit get it
+ RETURNS: nothing
+ REMARKS: the slab test of boxDistance, 8 rays at once; as there, rays starting inside
+ the box hit it where they leave
+ */
+inline void packetIntersectBox(const BoxArrays& b, unsigned int i, unsigned int id,
+      PacketRegisters& r)
+{
+   __m256 tx0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(b.lo[0][i]), r.ox), r.invDx);
+   __m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(b.hi[0][i]), r.ox), r.invDx);
+   __m256 ty0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(b.lo[1][i]), r.oy), r.invDy);
+   __m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(b.hi[1][i]), r.oy), r.invDy);
+   __m256 tz0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(b.lo[2][i]), r.oz), r.invDz);
+   __m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(b.hi[2][i]), r.oz), r.invDz);
+
+   __m256 tNear = _mm256_max_ps(
+         _mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)),
+         _mm256_min_ps(tz0, tz1));
+   __m256 tFar = _mm256_min_ps(
+         _mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)),
+         _mm256_max_ps(tz0, tz1));
+
+   __m256 small = _mm256_set1_ps(SMALL_NUMBER);
+   __m256 s = _mm256_blendv_ps(tFar, tNear, _mm256_cmp_ps(tNear, small, _CMP_GE_OQ));
+   __m256 valid = _mm256_and_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ),
+         _mm256_and_ps(_mm256_cmp_ps(s, small, _CMP_GE_OQ),
+               _mm256_cmp_ps(s, r.closest, _CMP_LT_OQ)));
+
+   COUNT(boxTests, PACKET_SIZE);
+   COUNT(boxHits, __builtin_popcount(_mm256_movemask_ps(valid)));
+   r.closest = _mm256_blendv_ps(r.closest, s, valid);
+   r.primitive = _mm256_castps_si256(_mm256_blendv_ps(
+         _mm256_castsi256_ps(r.primitive),
+         _mm256_castsi256_ps(_mm256_set1_epi32(id)), valid));
+   r.b1 = _mm256_andnot_ps(valid, r.b1);
+   r.b2 = _mm256_andnot_ps(valid, r.b2);
+}
+
+/*
+ PURPOSE: masked test of all rays of a packet against one board
+ RECEIVES:
+ b -- the scene's boards
+ i -- index of the board to test
+ r -- the packet
+ s -- set to how far along each ray the board's plane is
+ black -- set to all ones in the lanes hitting a black square
+ RETURNS: mask of the lanes which hit the board closer than their closest hit
+ REMARKS: boardDistance for 8 rays at once, the square found along with the hit
+ */
+inline __m256 packetBoardHits(const BoardArrays& b, unsigned int i, const PacketRegisters& r,
+      __m256& s, __m256& black)
+{
+   __m256 zero = _mm256_setzero_ps();
+   __m256 edge = _mm256_set1_ps(b.edgeSize[i]);
+   __m256 square = _mm256_set1_ps(b.squareSize[i]);
+   s = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(b.height[i]), r.oy), r.invDy);
+   __m256 x = _mm256_sub_ps(_mm256_add_ps(r.ox, _mm256_mul_ps(s, r.dx)),
+         _mm256_set1_ps(b.originX[i]));
+   __m256 z = _mm256_sub_ps(_mm256_add_ps(r.oz, _mm256_mul_ps(s, r.dz)),
+         _mm256_set1_ps(b.originZ[i]));
+
+   __m256 valid = _mm256_and_ps(_mm256_cmp_ps(s, _mm256_set1_ps(SMALL_NUMBER), _CMP_GE_OQ),
+         _mm256_cmp_ps(s, r.closest, _CMP_LT_OQ));
+   valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(x, zero, _CMP_GE_OQ),
+         _mm256_cmp_ps(x, edge, _CMP_LE_OQ)));
+   valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(z, zero, _CMP_GE_OQ),
+         _mm256_cmp_ps(z, edge, _CMP_LE_OQ)));
+
+   __m256i squares = _mm256_add_epi32(_mm256_cvttps_epi32(_mm256_div_ps(x, square)),
+         _mm256_cvttps_epi32(_mm256_div_ps(z, square)));
+   __m256i one = _mm256_set1_epi32(1);
+   black = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(squares, one), one));
+
+   COUNT(boardTests, PACKET_SIZE);
+   COUNT(boardHits, __builtin_popcount(_mm256_movemask_ps(valid)));
+   return valid;
+}
+
+/*
+ PURPOSE: masked test of all rays of a packet against every board of the scene
+ RECEIVES:
+ b -- the scene's boards
+ r -- the packet; lanes for which a board is closer than their closest hit get it
+ RETURNS: nothing
+ REMARKS: element is 1 for the lanes hitting a black square, as in Hit
+ */
+inline void packetIntersectBoards(const BoardArrays& b, PacketRegisters& r)
+{
+   for (unsigned int i = 0; i < b.size(); i++)
+   {
+      __m256 s, black;
+      __m256 valid = packetBoardHits(b, i, r, s, black);
+      r.closest = _mm256_blendv_ps(r.closest, s, valid);
+      r.primitive = _mm256_castps_si256(_mm256_blendv_ps(
+            _mm256_castsi256_ps(r.primitive),
+            _mm256_castsi256_ps(_mm256_set1_epi32(primitiveId(BOARD_PRIMITIVE, i))), valid));
+      r.element = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(r.element),
+            _mm256_and_ps(black, _mm256_castsi256_ps(_mm256_set1_epi32(1))), valid));
+      r.b1 = _mm256_andnot_ps(valid, r.b1);
+      r.b2 = _mm256_andnot_ps(valid, r.b2);
+   }
+}
+
+/*
+ PURPOSE: test of all rays of a packet against one capped cone
+ RECEIVES:
+ scene -- the compiled scene
+ id -- primitive id of the cone
+ r -- the packet; lanes for which the cone is closer than their closest hit get it
+ RETURNS: nothing
+ REMARKS: one lane at a time through CompiledScene::solidDistance. The quadric's
+ roots and caps make for a lot of branching and cones are few, so vectorizing it
+ would gain little.
+ */
+inline void packetIntersectCone(const CompiledScene& scene, unsigned int id,
+      PacketRegisters& r)
+{
+   alignas(32) float ox[PACKET_SIZE], oy[PACKET_SIZE], oz[PACKET_SIZE];
+   alignas(32) float dx[PACKET_SIZE], dy[PACKET_SIZE], dz[PACKET_SIZE];
+   alignas(32) float closest[PACKET_SIZE];
+   alignas(32) unsigned int primitive[PACKET_SIZE], element[PACKET_SIZE];
+   alignas(32) float b1[PACKET_SIZE], b2[PACKET_SIZE];
+   _mm256_store_ps(ox, r.ox);
+   _mm256_store_ps(oy, r.oy);
+   _mm256_store_ps(oz, r.oz);
+   _mm256_store_ps(dx, r.dx);
+   _mm256_store_ps(dy, r.dy);
+   _mm256_store_ps(dz, r.dz);
+   _mm256_store_ps(closest, r.closest);
+   _mm256_store_si256((__m256i *) primitive, r.primitive);
+   _mm256_store_si256((__m256i *) element, r.element);
+   _mm256_store_ps(b1, r.b1);
+   _mm256_store_ps(b2, r.b2);
+
+   for (int l = 0; l < PACKET_SIZE; l++)
+   {
+      if (closest[l] < 0)
+         continue; // inactive or already blocked
+      unsigned int part;
+      Real s = scene.solidDistance(id, Point(ox[l], oy[l], oz[l]),
+            Point(dx[l], dy[l], dz[l]), part);
+      if (s < closest[l])
+      {
+         closest[l] = s;
+         primitive[l] = id;
+         element[l] = part;
+         b1[l] = b2[l] = 0.0f;
+      }
+   }
+
+   r.closest = _mm256_load_ps(closest);
+   r.primitive = _mm256_load_si256((const __m256i *) primitive);
+   r.element = _mm256_load_si256((const __m256i *) element);
+   r.b1 = _mm256_load_ps(b1);
+   r.b2 = _mm256_load_ps(b2);
+}
+
+/*
+ PURPOSE: loads a packet's rays into registers
+ RECEIVES:
+ packet -- rays to load
+ r -- registers to fill in
+ RETURNS: mask with all bits set in the lanes which are active
+ REMARKS: inactive lanes get a closest distance of -1 so no box or primitive test passes
+ for them
+ */
+inline __m256 loadPacket(const RayPacket& packet, PacketRegisters& r)
+{
+   r.ox = _mm256_load_ps(packet.ox);
+   r.oy = _mm256_load_ps(packet.oy);
+   r.oz = _mm256_load_ps(packet.oz);
+   r.dx = _mm256_load_ps(packet.dx);
+   r.dy = _mm256_load_ps(packet.dy);
+   r.dz = _mm256_load_ps(packet.dz);
+   __m256 one = _mm256_set1_ps(1.0f);
+   r.invDx = _mm256_div_ps(one, r.dx);
+   r.invDy = _mm256_div_ps(one, r.dy);
+   r.invDz = _mm256_div_ps(one, r.dz);
+
+   __m256i lanes = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+   __m256 active = _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+         _mm256_and_si256(_mm256_set1_epi32(packet.activeMask), lanes), lanes));
+   r.closest = _mm256_blendv_ps(_mm256_set1_ps(-1.0f),
+         _mm256_load_ps(packet.distance), active);
+   r.primitive = _mm256_load_si256((const __m256i *) packet.primitive);
+   r.element = _mm256_load_si256((const __m256i *) packet.element);
+   r.b1 = _mm256_load_ps(packet.b1);
+   r.b2 = _mm256_load_ps(packet.b2);
+   return active;
+}
+
+/*
+ PURPOSE: masked test of all rays of a packet against one instance
+ RECEIVES:
+ scene -- the compiled scene
+ i -- index of the instance to test
+ id -- its primitive id
+ r -- the packet; lanes for which the instance is closer than their closest hit get it
+ RETURNS: nothing
+ REMARKS: CompiledScene::intersectInstance for 8 rays at once: the packet is moved into
+ the prototype's space and taken through the prototype's Bvh there
+ */
+inline void packetIntersectInstance(const CompiledScene& scene, unsigned int i,
+      unsigned int id, PacketRegisters& r)
+{
+   const InstanceArrays& in = scene.instances();
+   const PrototypeArrays& p = scene.prototypes();
+   float scale = in.scale[i];
+   __m256 invScale = _mm256_set1_ps(1.0f / scale);
+
+   PacketRegisters local = r;
+   local.ox = _mm256_mul_ps(_mm256_sub_ps(r.ox, _mm256_set1_ps(in.position[0][i])), invScale);
+   local.oy = _mm256_mul_ps(_mm256_sub_ps(r.oy, _mm256_set1_ps(in.position[1][i])), invScale);
+   local.oz = _mm256_mul_ps(_mm256_sub_ps(r.oz, _mm256_set1_ps(in.position[2][i])), invScale);
+   local.closest = _mm256_mul_ps(r.closest, invScale);
+   local.primitive = _mm256_set1_epi32(NO_PRIMITIVE);
+
+   unsigned int stack[BVH_STACK_SIZE];
+   unsigned int top = 0;
+   float tEnter;
+   stack[top++] = p.root[in.prototype[i]];
+   while (top > 0)
+   {
+      const BvhNode& node = p.nodes[stack[--top]];
+      if (packetHitsBox(node.box, local, tEnter) == 0)
+         continue;
+      if (node.count == 0)
+      {
+         stack[top++] = node.first + 1;
+         stack[top++] = node.first;
+         continue;
+      }
+      for (unsigned int t = node.first; t < node.first + node.count; t++)
+         packetIntersectTriangle(p.triangles, t, t, local, SMALL_NUMBER / scale);
+   }
+
+   __m256 hit = _mm256_xor_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(local.primitive,
+         _mm256_set1_epi32(NO_PRIMITIVE))), _mm256_castsi256_ps(_mm256_set1_epi32(-1)));
+   r.closest = _mm256_blendv_ps(r.closest, _mm256_mul_ps(local.closest, _mm256_set1_ps(scale)),
+         hit);
+   r.primitive = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(r.primitive),
+         _mm256_castsi256_ps(_mm256_set1_epi32(id)), hit));
+   r.element = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(r.element),
+         _mm256_castsi256_ps(local.primitive), hit));
+   r.b1 = _mm256_blendv_ps(r.b1, local.b1, hit);
+   r.b2 = _mm256_blendv_ps(r.b2, local.b2, hit);
+}
+
+/*
+ PURPOSE: finds the closest hit of every active ray of a packet in the scene
+ RECEIVES:
+ scene -- compiled scene to trace the packet through
+ packet -- rays to trace; distance and primitive get filled in for lanes which hit
+ RETURNS: nothing
+ REMARKS:
+ The packet descends into a node as long as any of its rays does, and of two children
+ the one entered first by some ray is visited first. This pays off for coherent rays
+ like the primary rays of neighbouring pixels, which mostly visit the same nodes
+ anyway; incoherent rays are better traced one at a time. The boards are tested
+ first, as in CompiledScene::closestHit.
+ */
+inline void intersectPacket(const CompiledScene& scene, RayPacket& packet)
+{
+   const SceneArray<BvhNode>& nodes = scene.bvh().nodes();
+   const SceneArray<unsigned int>& primitives = scene.primitives();
+   const TriangleArrays& triangles = scene.triangles();
+   const SphereArrays& spheres = scene.spheres();
+   const BoxArrays& boxes = scene.boxes();
+   if (packet.activeMask == 0)
+      return;
+
+   PacketRegisters r;
+   __m256 active = loadPacket(packet, r);
+   packetIntersectBoards(scene.boards(), r);
+
+   unsigned int stack[BVH_STACK_SIZE];
+   unsigned int top = 0;
+   float tEnter, tLeft, tRight;
+   if (!nodes.empty() && packetHitsBox(nodes[0].box, r, tEnter) != 0)
+      stack[top++] = 0;
+
+   while (top > 0)
+   {
+      const BvhNode& node = nodes[stack[--top]];
+      if (node.count > 0)
+      {
+         for (unsigned int k = node.first; k < node.first + node.count; k++)
+         {
+            unsigned int id = primitives[k];
+            unsigned int i = id & PRIMITIVE_INDEX_MASK;
+            if (primitiveType(id) == TRIANGLE_PRIMITIVE)
+               packetIntersectTriangle(triangles, i, id, r);
+            else if (primitiveType(id) == SPHERE_PRIMITIVE)
+               packetIntersectSphere(spheres, i, id, r);
+            else if (primitiveType(id) == BOX_PRIMITIVE)
+               packetIntersectBox(boxes, i, id, r);
+            else if (primitiveType(id) == CONE_PRIMITIVE)
+               packetIntersectCone(scene, id, r);
+            else
+               packetIntersectInstance(scene, i, id, r);
+         }
+         continue;
+      }
+
+      bool hitLeft = packetHitsBox(nodes[node.first].box, r, tLeft) != 0;
+      bool hitRight = packetHitsBox(nodes[node.first + 1].box, r, tRight) != 0;
+      if (hitLeft && hitRight)
+      {
+         if (tLeft <= tRight)
+         {
+            stack[top++] = node.first + 1;
+            stack[top++] = node.first;
+         }
+         else
+         {
+            stack[top++] = node.first;
+            stack[top++] = node.first + 1;
+         }
+      }
+      else if (hitLeft)
+         stack[top++] = node.first;
+      else if (hitRight)
+         stack[top++] = node.first + 1;
+   }
+
+   _mm256_store_ps(packet.distance, _mm256_blendv_ps(
+         _mm256_load_ps(packet.distance), r.closest, active));
+   _mm256_store_si256((__m256i *) packet.primitive, r.primitive);
+   _mm256_store_si256((__m256i *) packet.element, r.element);
+   _mm256_store_ps(packet.b1, r.b1);
+   _mm256_store_ps(packet.b2, r.b2);
+}
+
+/*
+ PURPOSE: finds out which rays of a packet of shadow rays are blocked
+ RECEIVES:
+ scene -- compiled scene to trace the packet through
+ packet -- rays to test; the distance of each active lane is how far it has to go
+ RETURNS: bitmask of the active lanes which hit something opaque closer than their distance
+ REMARKS:
+ Packet version of CompiledScene::occluded. Only primitives which always cast a shadow
+ are tested; a lane is dropped from the traversal as soon as it hits one, and the
+ traversal ends once all lanes are. The boards come first: a lane landing on an opaque
+ square is blocked before the traversal starts, one on a transparent square goes on.
+ */
+inline unsigned int occludedPacket(const CompiledScene& scene, RayPacket& packet)
+{
+   const SceneArray<BvhNode>& nodes = scene.bvh().nodes();
+   const SceneArray<unsigned int>& primitives = scene.primitives();
+   const SceneArray<unsigned char>& shadowKinds = scene.shadowKinds();
+   const TriangleArrays& triangles = scene.triangles();
+   const SphereArrays& spheres = scene.spheres();
+   const BoxArrays& boxes = scene.boxes();
+   const BoardArrays& boards = scene.boards();
+   if (packet.activeMask == 0)
+      return 0;
+
+   PacketRegisters r;
+   loadPacket(packet, r);
+
+   // lanes on an opaque square are done: mark them hit and give them a distance no test
+   // can pass, like the lanes the traversal blocks
+   __m256 onOpaque = _mm256_setzero_ps();
+   for (unsigned int i = 0; i < boards.size(); i++)
+   {
+      __m256 s, black;
+      __m256 valid = packetBoardHits(boards, i, r, s, black);
+      __m256 whiteOpaque = scene.boardSquareOpaque(i, false) ? valid : _mm256_setzero_ps();
+      __m256 blackOpaque = scene.boardSquareOpaque(i, true) ? valid : _mm256_setzero_ps();
+      onOpaque = _mm256_or_ps(onOpaque, _mm256_blendv_ps(whiteOpaque, blackOpaque, black));
+   }
+   r.closest = _mm256_blendv_ps(r.closest, _mm256_set1_ps(-1.0f), onOpaque);
+   r.primitive = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(r.primitive),
+         _mm256_castsi256_ps(_mm256_set1_epi32(primitiveId(BOARD_PRIMITIVE, 0))), onOpaque));
+   unsigned int blocked = _mm256_movemask_ps(onOpaque) & packet.activeMask;
+   if (nodes.empty() || blocked == packet.activeMask)
+      return blocked;
+
+   unsigned int stack[BVH_STACK_SIZE];
+   unsigned int top = 0;
+   float tEnter;
+   stack[top++] = 0;
+
+   while (top > 0)
+   {
+      const BvhNode& node = nodes[stack[--top]];
+      if (packetHitsBox(node.box, r, tEnter) == 0)
+         continue;
+      if (node.count == 0)
+      {
+         stack[top++] = node.first + 1;
+         stack[top++] = node.first;
+         continue;
+      }
+
+      for (unsigned int k = node.first; k < node.first + node.count; k++)
+      {
+         if (shadowKinds[k] != CASTS_SHADOW)
+            continue;
+         unsigned int id = primitives[k];
+         unsigned int i = id & PRIMITIVE_INDEX_MASK;
+         if (primitiveType(id) == TRIANGLE_PRIMITIVE)
+            packetIntersectTriangle(triangles, i, id, r);
+         else if (primitiveType(id) == SPHERE_PRIMITIVE)
+            packetIntersectSphere(spheres, i, id, r);
+         else if (primitiveType(id) == BOX_PRIMITIVE)
+            packetIntersectBox(boxes, i, id, r);
+         else if (primitiveType(id) == CONE_PRIMITIVE)
+            packetIntersectCone(scene, id, r);
+         else
+            packetIntersectInstance(scene, i, id, r);
+      }
+
+      // lanes which hit something are done: give them a distance no test can pass
+      __m256 hit = _mm256_castsi256_ps(_mm256_cmpeq_epi32(r.primitive,
+            _mm256_set1_epi32(NO_PRIMITIVE)));
+      hit = _mm256_xor_ps(hit, _mm256_castsi256_ps(_mm256_set1_epi32(-1)));
+      r.closest = _mm256_blendv_ps(r.closest, _mm256_set1_ps(-1.0f), hit);
+      blocked = _mm256_movemask_ps(hit) & packet.activeMask;
+      if (blocked == packet.activeMask)
+         break;
+   }
+   return blocked;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,1013 @@
+#ifndef RAYTRACER_H
+#define RAYTRACER_H
+
+/*---------------------------------------------------------------------------*/
+/* INCLUDES */
+#include "Objects.h"
+#include "CompiledScene.h"
+#include "RayPacket.h"
+#include "FrameBuffer.h"
+#include "ThreadPool.h"
+#include "TileRenderer.h"
+#include "Sampler.h"
+#include "PathRecords.h"
+#include "LightTree.h"
+#include "ppm.h"
+#include <climits>
+#include <chrono>
+
+/*---------------------------------------------------------------------------*/
+/* FUNCTIONS */
+/*
+ PURPOSE: where the screen is in the scene, worked out once per frame from the camera
+ REMARK: pixel (i, j) is centered at origin + i * right + j * up
+ */
+struct ScreenSetup
+{
+	Point camera;
+	Point origin;
+	Point right;
+	Point up;
+
+	Point pixel(int i, int j) const
+	{
+		return origin + double(i) * right + double(j) * up;
+	}
+};
+
+/*
+ PURPOSE: how many samples traceRayScreen takes per pixel
+ REMARK:
+ A pixel is sampled until the standard error of its mean colour drops below
+ errorThreshold, but at least minSamples and at most maxSamples times. Pixels whose
+ colour then differs from a neighbour's by more than contrastThreshold in some channel
+ are taken up to edgeSamples: a few samples which all happened to land on the same side
+ of an edge look just as converged as a flat board square.
+ sampler says where within the pixel the samples go, see Sampler.
+ */
+struct SamplingSettings
+{
+	unsigned int minSamples;
+	unsigned int maxSamples;
+	unsigned int edgeSamples;
+	Real errorThreshold;
+	Real contrastThreshold;
+	SamplerType sampler;
+
+	SamplingSettings()
+	{
+		sampler = SOBOL_SAMPLER;
+		minSamples = MIN_SAMPLE_NUMBER;
+		maxSamples = SUPER_SAMPLE_NUMBER;
+		edgeSamples = SUPER_SAMPLE_NUMBER;
+		errorThreshold = SAMPLE_ERROR_THRESHOLD;
+		contrastThreshold = EDGE_CONTRAST_THRESHOLD;
+	}
+};
+
+/*
+ PURPOSE: running mean and variance of the samples of one pixel
+ REMARK: updated with Welford's method, which stays accurate however many samples are
+ added. target is how many samples the pixel takes whatever its variance.
+ */
+struct PixelSamples
+{
+	Point mean;
+	Point m2; // sum of squared differences from the mean, per channel
+	unsigned int count;
+	unsigned int target;
+
+	PixelSamples()
+	{
+		count = 0;
+		target = 0;
+	}
+
+	void add(const Point& color)
+	{
+		count++;
+		Point delta = color - mean;
+		mean += (1.0 / count) * delta;
+		m2 += delta % (color - mean);
+	}
+
+	// standard error of the mean, of whichever channel has the largest one
+	Real standardError() const
+	{
+		if (count < 2)
+			return HUGE_VAL;
+		Point variance = (1.0 / (count * (count - 1.0))) * m2;
+		return sqrt(max(variance.x(), max(variance.y(), variance.z())));
+	}
+
+	bool wantsMore(const SamplingSettings& settings) const
+	{
+		return count < target
+				|| (count < settings.maxSamples && standardError() > settings.errorThreshold);
+	}
+};
+
+/*
+ PURPOSE: a ray waiting in one of the wavefront queues
+ REMARK: weight is how much of the colour found along the ray ends up in its sample: the
+ product of the transparencies and opacities of the surfaces the path went through or
+ bounced off to get here. sample is the slot of the pixel within the tile. path says
+ which ray of the sample's tree of rays it is, see rayPathCode.
+ */
+struct QueuedRay
+{
+	Line ray;
+	Point weight;
+	unsigned int sample;
+	unsigned int path;
+};
+
+/*
+ PURPOSE: a shadow ray waiting in the shadow queue
+ REMARK: color is what the light adds to the sample if nothing blocks it, already weighted
+ */
+struct QueuedShadowRay
+{
+	Line ray;
+	Real maxDistance;
+	Point color;
+	unsigned int sample;
+};
+
+/*
+ PURPOSE: how many rays of each kind were traced
+ REMARK: counted a whole queue at a time, so keeping count costs next to nothing.
+ Secondary rays are the reflected and transmitted ones.
+ */
+struct RayCounts
+{
+	uint64_t primary;
+	uint64_t secondary;
+	uint64_t shadow;
+
+	RayCounts()
+	{
+		primary = secondary = shadow = 0;
+	}
+
+	void add(const RayCounts& c)
+	{
+		primary += c.primary;
+		secondary += c.secondary;
+		shadow += c.shadow;
+	}
+
+	uint64_t total() const
+	{
+		return primary + secondary + shadow;
+	}
+};
+
+/*
+ PURPOSE: the ray queues of one worker
+ REMARK: kept by the worker from tile to tile so their memory is only allocated once.
+ rays holds the bounce being traced and hits what each of its rays hit; shading them fills
+ shadows, and reflected and transmitted with the rays of the next bounce.
+ If paths is set, every ray and shadow ray traced is noted in the PixelPaths of its
+ pixel, which is paths[slotPixels[slot]].
+ */
+struct WavefrontQueues
+{
+	vector<QueuedRay> rays;
+	vector<Hit> hits;
+	vector<QueuedShadowRay> shadows;
+	vector<QueuedRay> reflected;
+	vector<QueuedRay> transmitted;
+
+	vector<Point> sampleColors; // colour of the current sample, by pixel slot
+	vector<uint64_t> sampleKeys; // random stream of the current sample, by pixel slot
+	vector<LightChoice> lights; // the lights chosen for the hit being shaded
+	vector<unsigned int> pending; // slots of pixels which still want samples
+
+	PixelPaths *paths;
+	vector<unsigned int> slotPixels; // index into paths of each pixel slot
+
+	RayCounts counts; // everything traced from these queues
+
+	WavefrontQueues()
+	{
+		paths = 0;
+	}
+};
+
+/*
+ PURPOSE: per-thread state of a worker taking part in traceRayScreen
+ REMARK: padded out to a cache line so workers don't false-share their queue bookkeeping
+ */
+struct RenderWorker
+{
+	WavefrontQueues queues;
+	char pad[64];
+};
+
+/*
+ PURPOSE: finds what every ray of the current bounce hits
+ RECEIVES:
+ scene -- compiled scene to trace in
+ q -- queues; fills in q.hits for q.rays
+ RETURNS:  Nothing
+ REMARKS: when built with AVX2 the queue is traced 8 rays at a time as packets. Queues
+ are filled in pixel order, so even reflected and transmitted rays mostly come in
+ packets of rays leaving neighbouring points in similar directions.
+ */
+inline void findHits(const CompiledScene& scene, WavefrontQueues& q)
+{
+	size_t size = q.rays.size();
+	q.hits.resize(size);
+
+#ifdef PACKET_TRACING
+	{
+		RayPacket packet;
+		for (size_t base = 0; base < size; base += PACKET_SIZE)
+		{
+			int lanes = min(size - base, (size_t) PACKET_SIZE);
+			packet.clear();
+			for (int lane = 0; lane < lanes; lane++)
+				packet.setRay(lane, q.rays[base + lane].ray);
+
+			intersectPacket(scene, packet);
+
+			for (int lane = 0; lane < lanes; lane++)
+				q.hits[base + lane] = packet.hit(lane);
+		}
+		return;
+	}
+#endif
+
+	for (size_t i = 0; i < size; i++)
+		scene.closestHit(q.rays[i].ray, q.hits[i]);
+}
+
+/*
+ PURPOSE: counts the rays of a bounce, the hits they found and the shadow rays they sent
+ RECEIVES:
+ q -- queues, with the current bounce found and shaded
+ bounce -- how many bounces came before this one; 0 for the primary rays
+ RETURNS:  Nothing
+ REMARKS: only called in counting builds, see Counters.h. The rays of the next bounce
+ are counted as reflected or transmitted while they are still queued apart.
+ */
+inline void countBounce(const WavefrontQueues& q, unsigned int bounce)
+{
+	TraceCounters& counters = threadCounters();
+	unsigned int d = min(bounce, COUNTED_DEPTHS - 1);
+	if (bounce == 0)
+		counters.rays[PRIMARY_RAY][d] += q.rays.size();
+	counters.rays[SHADOW_RAY][d] += q.shadows.size();
+	d = min(bounce + 1, COUNTED_DEPTHS - 1);
+	counters.rays[REFLECTED_RAY][d] += q.reflected.size();
+	counters.rays[TRANSMITTED_RAY][d] += q.transmitted.size();
+	for (size_t r = 0; r < q.hits.size(); r++)
+		counters.rayHits += q.hits[r].primitive != NO_PRIMITIVE;
+}
+
+/*
+ PURPOSE: notes the rays of the current bounce in the path records of their pixels
+ RECEIVES: q -- queues, with the hits of q.rays found and q.paths set
+ RETURNS:  Nothing
+ REMARKS: each ray is noted from where it starts to where it hits, or to PATH_RECORD_FAR
+ if it hits nothing
+ */
+inline void recordRays(WavefrontQueues& q)
+{
+	for (size_t r = 0; r < q.rays.size(); r++)
+	{
+		const QueuedRay& ray = q.rays[r];
+		Point start = ray.ray.startPoint();
+		Real distance = min(q.hits[r].distance, PATH_RECORD_FAR);
+		q.paths[q.slotPixels[ray.sample]].add(rayPathCode(ray.path), start,
+				start + distance * ray.ray.direction());
+	}
+}
+
+/*
+ PURPOSE: works out the local lighting at the hits of the current bounce
+ RECEIVES:
+ scene -- compiled scene to trace in
+ lights -- Light's which are lighting the scene, see LightTree
+ q -- queues; the hits of q.rays are shaded, one shadow ray per light chosen is added to
+ q.shadows and, if depth allows, the reflected and transmitted rays to q.reflected and
+ q.transmitted
+ depth -- in terms of tree of sub-rays we calculate, how many more bounces may follow
+ RETURNS:  Nothing
+ REMARKS: the colour a shadow ray carries is the ambient, diffuse and specular light of
+ its light, added to the sample only if the shadow ray gets through. Which lights a hit
+ sends shadow rays to is up to LightTree::choose, given a bound on what a light could
+ add there; the random picks draw from a stream of their own for every ray of every
+ sample. Sub-rays are only sent through transparent surfaces and reflected off
+ non-transparent ones.
+ */
+inline void shadeHits(const CompiledScene& scene, const LightTree& lights,
+		WavefrontQueues& q, unsigned int depth)
+{
+	Intersection intersection;
+	QueuedShadowRay shadow;
+	QueuedRay next;
+	Point lColor;
+
+	size_t size = q.rays.size();
+	for (size_t r = 0; r < size; r++)
+	{
+		if (q.hits[r].primitive == NO_PRIMITIVE)
+			continue;
+
+		const QueuedRay& in = q.rays[r];
+		scene.shade(in.ray, q.hits[r], intersection);
+
+		Point pt = intersection.point();
+		Material material = intersection.material();
+		Line reflectedRay = intersection.reflectedRay();
+		Point normal = intersection.normal();
+		Real specular = abs(in.ray.direction() & reflectedRay.direction());
+
+		Real bound = maxChannel(in.weight) * (maxChannel(material.ambient())
+				+ maxChannel(material.diffuse()) + maxChannel(material.specular()));
+		lights.choose(pt, bound, mixBits(q.sampleKeys[in.sample] ^ in.path), q.lights);
+
+		shadow.sample = in.sample;
+		for (size_t c = 0; c < q.lights.size(); c++)
+		{
+			unsigned int i = q.lights[c].light;
+			const Light& light = lights.lights()[i];
+			shadow.ray.set(pt, light.position());
+			shadow.maxDistance = shadow.ray.length();
+
+			lColor = (q.lights[c].scale * attenuate(shadow.maxDistance)) * light.color();
+			shadow.color = in.weight % ((material.ambient() % lColor)
+					+ abs(normal & shadow.ray.direction()) * (material.diffuse() % lColor)
+					+ specular * (material.specular() % lColor));
+			q.shadows.push_back(shadow);
+			if (q.paths)
+				q.paths[q.slotPixels[in.sample]].add(shadowPathCode(in.path, i), pt,
+						light.position());
+		}
+
+		if (depth > 0)
+		{
+			Point transparency = material.transparency();
+			Point opacity = Point(1.0, 1.0, 1.0) - transparency;
+
+			next.sample = in.sample;
+			if (!transparency.isZero() && transparency.length() > SMALL_NUMBER) //if not transparent then don't send ray
+			{
+				next.ray = intersection.transmittedRay();
+				next.weight = in.weight % transparency;
+				next.path = 2 * in.path + 1;
+				q.transmitted.push_back(next);
+			}
+			if (!opacity.isZero()) // if completely transparent don't send reflect ray
+			{
+				next.ray = reflectedRay;
+				next.weight = in.weight % opacity;
+				next.path = 2 * in.path;
+				q.reflected.push_back(next);
+			}
+		}
+	}
+}
+
+/*
+ PURPOSE: tests the queued shadow rays and adds the light of the unblocked ones to their samples
+ RECEIVES:
+ scene -- compiled scene to trace in
+ q -- queues; q.shadows is emptied into q.sampleColors
+ RETURNS:  Nothing
+ REMARKS: when built with AVX2 the shadow rays are tested 8 at a time as packets
+ */
+inline void traceShadows(const CompiledScene& scene, WavefrontQueues& q)
+{
+	size_t size = q.shadows.size();
+	q.counts.shadow += size;
+
+#ifdef PACKET_TRACING
+	RayPacket packet;
+	for (size_t base = 0; base < size; base += PACKET_SIZE)
+	{
+		int lanes = min(size - base, (size_t) PACKET_SIZE);
+		packet.clear();
+		for (int lane = 0; lane < lanes; lane++)
+		{
+			packet.setRay(lane, q.shadows[base + lane].ray);
+			packet.distance[lane] = q.shadows[base + lane].maxDistance;
+		}
+
+		unsigned int blocked = occludedPacket(scene, packet);
+
+		for (int lane = 0; lane < lanes; lane++)
+		{
+			const QueuedShadowRay& shadow = q.shadows[base + lane];
+			if (blocked & (1u << lane))
+			{
+				COUNT(shadowsBlocked, 1);
+				continue;
+			}
+			q.sampleColors[shadow.sample] += shadow.color;
+		}
+	}
+	q.shadows.clear();
+	return;
+#endif
+
+	for (size_t i = 0; i < size; i++)
+	{
+		const QueuedShadowRay& shadow = q.shadows[i];
+		if (!scene.occluded(shadow.ray, shadow.maxDistance))
+			q.sampleColors[shadow.sample] += shadow.color;
+		else
+			COUNT(shadowsBlocked, 1);
+	}
+	q.shadows.clear();
+}
+
+/*
+ PURPOSE: traces the rays in q.rays and everything they spawn, one bounce at a time
+ RECEIVES:
+ scene -- compiled scene to trace in
+ lights -- Light's which are lighting the scene, see LightTree
+ q -- queues; q.rays holds the primary rays on entry, the colours end up in q.sampleColors
+ RETURNS:  Nothing
+ REMARKS:
+ Breadth-first replacement for recursing down each ray's tree of sub-rays: every bounce
+ runs as a few passes over a whole queue (find hits, shade, test shadow rays), which keeps
+ each kernel busy on a large batch of similar work. The reflected rays of the next bounce
+ are queued ahead of the transmitted ones so each kind is traced as one run. Bounces stop
+ after MAX_DEPTH, as the recursion did, so no queue ever holds more than 2^MAX_DEPTH rays
+ per sample.
+ */
+inline void traceWavefront(const CompiledScene& scene, const LightTree& lights,
+		WavefrontQueues& q)
+{
+	for (unsigned int depth = MAX_DEPTH;; depth--)
+	{
+		if (depth == MAX_DEPTH)
+			q.counts.primary += q.rays.size();
+		else
+			q.counts.secondary += q.rays.size();
+		findHits(scene, q);
+		if (q.paths)
+			recordRays(q);
+		shadeHits(scene, lights, q, depth);
+		COUNTING(countBounce(q, MAX_DEPTH - depth));
+		traceShadows(scene, q);
+
+		q.rays.swap(q.reflected);
+		q.rays.insert(q.rays.end(), q.transmitted.begin(), q.transmitted.end());
+		q.reflected.clear();
+		q.transmitted.clear();
+		if (q.rays.empty() || depth == 0)
+			break;
+	}
+	q.rays.clear();
+}
+
+/*
+ PURPOSE: supersamples the pixels of a tile
+ RECEIVES:
+ scene, lights -- what to trace
+ screen -- where the pixels are
+ tile -- which pixels to do
+ settings -- when to stop sampling a pixel
+ sampler -- where in the pixel to put each sample
+ samples -- sampling state of every pixel of the screen, row by row
+ worker -- queues of the worker doing the tile
+ frame -- where to put the pixels and their sample counts
+ rounds -- at most how many samples to add to each pixel
+ paths -- PixelPaths of every pixel of the screen to note the samples' paths in, or 0
+ RETURNS: how many pixels of the tile still want more samples
+ REMARKS: each round takes the next sample of every pixel of the tile that still wants one
+ and traces all of them together with traceWavefront. Which sample of a pixel it is
+ decides where it goes, so the image doesn't depend on which worker does the tile.
+ Every pixel sampled has its running mean written to the frame, so a tile stopped after
+ a few rounds still shows what it has so far.
+ */
+inline unsigned int traceTile(const CompiledScene& scene, const LightTree& lights,
+		const ScreenSetup& screen, const Tile& tile, const SamplingSettings& settings,
+		const Sampler& sampler, vector<PixelSamples>& samples, RenderWorker& worker,
+		FrameBuffer& frame, unsigned int rounds = UINT_MAX, PixelPaths *paths = 0)
+{
+	WavefrontQueues& q = worker.queues;
+	int width = tile.x1 - tile.x0;
+	unsigned int count = width * (tile.y1 - tile.y0);
+
+	q.paths = paths;
+	if (paths)
+	{
+		q.slotPixels.resize(count);
+		for (unsigned int slot = 0; slot < count; slot++)
+			q.slotPixels[slot] = (tile.y0 + slot / width) * frame.width() + tile.x0 + slot % width;
+	}
+
+	q.sampleKeys.resize(count);
+	q.pending.clear();
+	for (unsigned int slot = 0; slot < count; slot++)
+	{
+		int x = tile.x0 + slot % width, y = tile.y0 + slot / width;
+		if (samples[y * frame.width() + x].wantsMore(settings))
+			q.pending.push_back(slot);
+	}
+	if (q.pending.empty())
+		return 0;
+
+	QueuedRay primary;
+	primary.weight = Point(1.0, 1.0, 1.0);
+	primary.path = 1;
+	float u, v;
+	for (unsigned int round = 0; round < rounds && !q.pending.empty(); round++)
+	{
+		for (size_t p = 0; p < q.pending.size(); p++)
+		{
+			primary.sample = q.pending[p];
+			int x = tile.x0 + primary.sample % width, y = tile.y0 + primary.sample / width;
+			unsigned int index = samples[y * frame.width() + x].count;
+			sampler.sample2D(x, y, index, 0, u, v);
+			q.sampleKeys[primary.sample] = mixBits(pixelKey(0, x, y, 0) ^ index);
+			Point pixelPt = screen.pixel(x, y) + (u - .5) * screen.right + (v - .5) * screen.up;
+			primary.ray.set(screen.camera, pixelPt);
+			q.rays.push_back(primary);
+		}
+
+		q.sampleColors.assign(count, Point(0.0, 0.0, 0.0));
+		COUNT(samples, q.pending.size());
+		traceWavefront(scene, lights, q);
+
+		size_t stillPending = 0;
+		for (size_t p = 0; p < q.pending.size(); p++)
+		{
+			unsigned int slot = q.pending[p];
+			int x = tile.x0 + slot % width, y = tile.y0 + slot / width;
+			PixelSamples& pixel = samples[y * frame.width() + x];
+			pixel.add(q.sampleColors[slot]);
+			frame.setPixel(x, y, pixel.mean.x(), pixel.mean.y(), pixel.mean.z());
+			frame.setSampleCount(x, y, pixel.count);
+			if (pixel.wantsMore(settings))
+				q.pending[stillPending++] = slot;
+		}
+		q.pending.resize(stillPending);
+	}
+	return q.pending.size();
+}
+
+/*
+ PURPOSE: checks whether a pixel lies on an edge in the image
+ RECEIVES:
+ samples -- sampling state of every pixel of the screen, row by row
+ width, height -- size of the screen
+ x, y -- pixel to check
+ threshold -- how much a colour channel has to differ from a neighbour's
+ RETURNS: true if the mean colour of the pixel differs from that of one of its four
+ neighbours by more than threshold in some channel
+ REMARKS:
+ */
+inline bool isEdgePixel(const vector<PixelSamples>& samples, int width, int height,
+		int x, int y, Real threshold)
+{
+	const int DX[4] = { 1, -1, 0, 0 };
+	const int DY[4] = { 0, 0, 1, -1 };
+	const Point& mean = samples[y * width + x].mean;
+	for (int n = 0; n < 4; n++)
+	{
+		int nx = x + DX[n], ny = y + DY[n];
+		if (nx < 0 || ny < 0 || nx >= width || ny >= height)
+			continue;
+		Point difference = samples[ny * width + nx].mean - mean;
+		if (abs(difference.x()) > threshold || abs(difference.y()) > threshold
+				|| abs(difference.z()) > threshold)
+			return true;
+	}
+	return false;
+}
+
+/*
+ PURPOSE: writes out how many samples each pixel of a frame took as an image
+ RECEIVES:
+ frame -- traced frame
+ maxSamples -- sample count shown as white; fewer are shades of grey
+ filename -- PPM file to write
+ RETURNS:  Nothing
+ REMARKS: shows where the tracer spent its time. Throws runtime_error if the file
+ can't be written.
+ */
+inline void writeSampleMap(const FrameBuffer& frame, unsigned int maxSamples,
+		const char *filename)
+{
+	vector<PackedPixel> pixels(frame.width() * frame.height());
+	for (int y = 0; y < frame.height(); y++)
+	{
+		for (int x = 0; x < frame.width(); x++)
+		{
+			unsigned int count = min(frame.sampleCount(x, y), maxSamples);
+			unsigned char grey = (unsigned char) (255 * count / maxSamples);
+			PackedPixel& p = pixels[y * frame.width() + x];
+			p.r = p.g = p.b = grey;
+		}
+	}
+	ppmWrite(filename, frame.width(), frame.height(), pixels);
+}
+
+/*
+ PURPOSE: counts the pixels of a finished frame by how many samples they took
+ RECEIVES: frame -- traced frame
+ RETURNS:  Nothing
+ REMARKS: only called in counting builds, see Counters.h
+ */
+inline void countFramePixels(const FrameBuffer& frame)
+{
+	TraceCounters& counters = threadCounters();
+	for (int y = 0; y < frame.height(); y++)
+		for (int x = 0; x < frame.width(); x++)
+			counters.samplesPerPixel[min(frame.sampleCount(x, y), COUNTED_SAMPLES)]++;
+	counters.pixels += frame.width() * frame.height();
+}
+
+/*
+ PURPOSE: works out where the screen is in the scene
+ RECEIVES:
+ camera -- location of the viewing position
+ lookat -- where one is looking at from this position
+ up -- what direction is up from this position
+ bottomX -- how far to the left from the lookat point is the start of the screen
+ bottomy -- how far down from the lookat point is the start of the screen
+ RETURNS: the ScreenSetup
+ REMARKS:
+ */
+inline ScreenSetup makeScreenSetup(const Point& camera, const Point& lookAt, Point up,
+		int bottomX, int bottomY)
+{
+	Point lookDirection = lookAt - camera;
+	Point right = lookDirection * up;
+
+	right.normalize();
+
+	up = right * lookDirection;
+	up.normalize();
+
+	ScreenSetup screen;
+	screen.camera = camera;
+	screen.origin = lookAt + bottomX * right + bottomY * up;
+	screen.right = right;
+	screen.up = up;
+	return screen;
+}
+
+/*
+ PURPOSE: raises the sample target of the pixels lying on edges in the image
+ RECEIVES:
+ samples -- sampling state of every pixel of the screen, row by row
+ tiles -- the tiles the screen is cut into
+ width, height -- size of the screen
+ settings -- contrast making an edge and how many samples edge pixels take
+ pool -- worker threads to spread the tiles over
+ RETURNS:  Nothing
+ REMARKS: only targets change, no means, so it doesn't matter in which order the tiles
+ get done
+ */
+inline void markEdgePixels(vector<PixelSamples>& samples, const vector<Tile>& tiles,
+		int width, int height, const SamplingSettings& settings, ThreadPool& pool)
+{
+	pool.run(tiles.size(), [&](size_t t, unsigned)
+	{
+		const Tile& tile = tiles[t];
+		for (int y = tile.y0; y < tile.y1; y++)
+			for (int x = tile.x0; x < tile.x1; x++)
+				if (isEdgePixel(samples, width, height, x, y, settings.contrastThreshold))
+					samples[y * width + x].target = settings.edgeSamples;
+	});
+}
+
+/*
+ PURPOSE: Does the ray-tracing scene objects according to the supplied lights, camera dimension and screen dimensions
+ RECEIVES:
+ scene --  compiled scene to be ray-traced, see CompiledScene
+ lightTree -- the Lights used to light the scene
+ camera -- location of the viewing position
+ lookat -- where one is looking at from this position
+ up -- what direction is up from this position
+ bottomX -- how far to the left from the lookat point is the start of the screen
+ bottomy -- how far down from the lookat point is the start of the screen
+ frame -- FrameBuffer to write the pixels to; its size gives the size of the screen
+ pool -- worker threads to spread the tiles of the screen over
+ settings -- how many samples to take per pixel
+ counts -- if given, the rays traced for the frame are added to it
+ RETURNS:  Nothing
+ REMARKS: the screen is cut into tiles which are handed out in Morton order; every worker
+ writes only the pixels of its own tiles so no locking is needed on the frame.
+ No GL calls are made here, getting the frame on screen is up to the caller.
+ Rays are traced breadth-first a bounce at a time, see traceWavefront.
+ Sampling is adaptive and done in two passes over the tiles: the first samples every pixel
+ until its variance says it has converged, the second takes more samples of the pixels
+ found to lie on edges in the image the first pass made. Edges are found in a pass of
+ their own in between, so no pixel's mean changes while its neighbours are looking at it.
+ The lights are in a LightTree, so a hit point only sends shadow rays to the lights
+ which matter there, see shadeHits.
+ */
+inline void traceRayScreen(const CompiledScene& scene, const LightTree& lightTree,
+		Point camera, Point lookAt, Point up, int bottomX, int bottomY, FrameBuffer& frame,
+		ThreadPool& pool, const SamplingSettings& settings = SamplingSettings(),
+		RayCounts *counts = 0)
+{
+	ScreenSetup screen = makeScreenSetup(camera, lookAt, up, bottomX, bottomY);
+	vector<Tile> tiles = makeTiles(frame.width(), frame.height());
+	vector<RenderWorker> workers(pool.size());
+	Sampler sampler(settings.sampler);
+
+	vector<PixelSamples> samples(frame.width() * frame.height());
+	for (size_t i = 0; i < samples.size(); i++)
+		samples[i].target = settings.minSamples;
+
+	pool.run(tiles.size(), [&](size_t t, unsigned w)
+	{
+		traceTile(scene, lightTree, screen, tiles[t], settings, sampler, samples, workers[w],
+				frame);
+	});
+
+	markEdgePixels(samples, tiles, frame.width(), frame.height(), settings, pool);
+
+	pool.run(tiles.size(), [&](size_t t, unsigned w)
+	{
+		traceTile(scene, lightTree, screen, tiles[t], settings, sampler, samples, workers[w],
+				frame);
+	});
+
+	for (size_t w = 0; counts && w < workers.size(); w++)
+		counts->add(workers[w].queues.counts);
+	COUNTING(countFramePixels(frame));
+}
+
+// traceRayScreen with the lights put in a LightTree for the frame
+inline void traceRayScreen(const CompiledScene& scene, const vector<Light>& lights, Point camera,
+		Point lookAt, Point up, int bottomX, int bottomY, FrameBuffer& frame,
+		ThreadPool& pool, const SamplingSettings& settings = SamplingSettings(),
+		RayCounts *counts = 0)
+{
+	traceRayScreen(scene, LightTree(lights), camera, lookAt, up, bottomX, bottomY, frame, pool,
+			settings, counts);
+}
+
+/*---------------------------------------------------------------------------*/
+/* CLASS DEFINITIONS */
+// ProgressiveRenderer finishes the pixels still being refined in one go once fewer than
+// this fraction of all pixels are
+const size_t FEW_PIXELS_FRACTION = 8;
+
+/*
+ PURPOSE: renders a frame a little at a time, for an interactive window
+ REMARK:
+ Each call to refine traces one pass over the tiles in which every pixel that still
+ wants samples gets one more, and leaves the running mean of all its samples so far
+ in the frame. The first pass therefore shows a noisy one sample per pixel image after
+ a fraction of the time a full frame takes, and later passes settle it down to what
+ traceRayScreen would have made: once no pixel wants more, the edges are marked like
+ in traceRayScreen and their pixels refined further, after which the frame has converged
+ and refine has nothing left to do.
+ The accumulated samples belong to one view of one scene: refine starts over by itself
+ when it is given another camera, screen, frame size or set of lights. Call reset to
+ start over for any other reason, e.g. changed SamplingSettings.
+ When the CompiledScene has been recompiled since the last pass, only the pixels which
+ could see the change start over, provided paths are being recorded (see setRecordPaths):
+ every pixel then keeps capsules around all the rays its samples traced (PixelPaths),
+ and a pixel none of whose capsules touches one of the scene's changedBounds would
+ trace exactly the same paths in the new scene. That covers the pixels whose rays hit
+ what was there before as well as those whose rays, primary or not, pass through where
+ something new now stands. A pixel keeps the edge sample target it had, so the result
+ can differ from a fresh render by a few samples along edges that went away.
+ */
+class ProgressiveRenderer
+{
+private:
+	vector<PixelSamples> _samples;
+	vector<PixelPaths> _paths; // empty unless paths are recorded
+	vector<Tile> _tiles;
+	vector<unsigned int> _tileWanting; // pixels of each tile which want more samples
+	vector<RenderWorker> _workers;
+	ScreenSetup _screen;
+	Point _camera, _lookAt, _up;
+	int _bottomX, _bottomY;
+	int _width, _height;
+	LightTree _lights;
+	unsigned int _sceneVersion;
+	unsigned int _passes; // passes traced since the last restart
+	size_t _restartedPixels; // how many pixels the last restart threw away
+	bool _recordPaths;
+	bool _edgesMarked;
+	bool _converged;
+	chrono::steady_clock::time_point _start;
+
+	static bool sameLights(const vector<Light>& a, const vector<Light>& b)
+	{
+		if (a.size() != b.size())
+			return false;
+		for (size_t i = 0; i < a.size(); i++)
+			if (!(a[i].position() == b[i].position()) || !(a[i].color() == b[i].color()))
+				return false;
+		return true;
+	}
+
+	// true if the accumulated samples were taken of some other view
+	bool isOtherView(const vector<Light>& lights, const Point& camera, const Point& lookAt,
+			const Point& up, int bottomX, int bottomY, const FrameBuffer& frame) const
+	{
+		return _samples.empty() || frame.width() != _width || frame.height() != _height
+				|| !(camera == _camera) || !(lookAt == _lookAt) || !(up == _up)
+				|| bottomX != _bottomX || bottomY != _bottomY
+				|| !sameLights(lights, _lights.lights());
+	}
+
+	void restarted()
+	{
+		_passes = 0;
+		_edgesMarked = false;
+		_converged = false;
+		_start = chrono::steady_clock::now();
+	}
+
+	/*
+	 PURPOSE: throws away the samples of the pixels which could see what changed
+	 RECEIVES:
+	 changed -- boxes around what changed
+	 settings -- how many samples pixels start out wanting
+	 pool -- worker threads to spread the tiles over
+	 RETURNS: nothing
+	 REMARKS:
+	 */
+	void restartTouchedPixels(const vector<Aabb>& changed, const SamplingSettings& settings,
+			ThreadPool& pool)
+	{
+		vector<size_t> counts(_tiles.size());
+		pool.run(_tiles.size(), [&](size_t t, unsigned)
+		{
+			const Tile& tile = _tiles[t];
+			for (int y = tile.y0; y < tile.y1; y++)
+			{
+				for (int x = tile.x0; x < tile.x1; x++)
+				{
+					size_t i = y * _width + x;
+					if (!pathsTouch(_paths[i], changed))
+						continue;
+					_samples[i] = PixelSamples();
+					_samples[i].target = settings.minSamples;
+					_paths[i].clear();
+					counts[t]++;
+				}
+			}
+		});
+
+		_restartedPixels = 0;
+		for (size_t t = 0; t < counts.size(); t++)
+		{
+			_restartedPixels += counts[t];
+			_tileWanting[t] += counts[t];
+		}
+		restarted();
+	}
+
+	// counts again which pixels of each tile want more samples, after targets changed
+	void countWanting(const SamplingSettings& settings, ThreadPool& pool)
+	{
+		pool.run(_tiles.size(), [&](size_t t, unsigned)
+		{
+			const Tile& tile = _tiles[t];
+			_tileWanting[t] = 0;
+			for (int y = tile.y0; y < tile.y1; y++)
+				for (int x = tile.x0; x < tile.x1; x++)
+					_tileWanting[t] += _samples[y * _width + x].wantsMore(settings);
+		});
+	}
+
+public:
+	ProgressiveRenderer()
+	{
+		_bottomX = _bottomY = 0;
+		_width = _height = 0;
+		_sceneVersion = 0;
+		_passes = 0;
+		_restartedPixels = 0;
+		_recordPaths = false;
+		_edgesMarked = false;
+		_converged = false;
+	}
+
+	// throws away the accumulated samples; the next refine starts from scratch
+	void reset()
+	{
+		_samples.clear();
+	}
+
+	// whether to keep the PixelPaths which let scene edits restart only some pixels
+	void setRecordPaths(bool record)
+	{
+		if (record != _recordPaths)
+			reset();
+		_recordPaths = record;
+	}
+
+	/*
+	 PURPOSE: adds one more sample to every pixel of the frame that wants one
+	 RECEIVES: as traceRayScreen
+	 RETURNS: false if the frame had already converged and nothing was traced
+	 REMARKS: see the class comment
+	 */
+	bool refine(const CompiledScene& scene, const vector<Light>& lights, const Point& camera,
+			const Point& lookAt, const Point& up, int bottomX, int bottomY, FrameBuffer& frame,
+			ThreadPool& pool, const SamplingSettings& settings = SamplingSettings())
+	{
+		if (isOtherView(lights, camera, lookAt, up, bottomX, bottomY, frame)
+				|| (scene.version() != _sceneVersion
+						&& (!_recordPaths || scene.version() != _sceneVersion + 1)))
+		{
+			_camera = camera;
+			_lookAt = lookAt;
+			_up = up;
+			_bottomX = bottomX;
+			_bottomY = bottomY;
+			_width = frame.width();
+			_height = frame.height();
+			_lights.build(lights);
+			_sceneVersion = scene.version();
+			_screen = makeScreenSetup(camera, lookAt, up, bottomX, bottomY);
+			_tiles = makeTiles(_width, _height);
+			_tileWanting.resize(_tiles.size());
+			for (size_t t = 0; t < _tiles.size(); t++)
+				_tileWanting[t] = (_tiles[t].x1 - _tiles[t].x0) * (_tiles[t].y1 - _tiles[t].y0);
+			_workers.assign(pool.size(), RenderWorker());
+			_samples.assign(_width * _height, PixelSamples());
+			for (size_t i = 0; i < _samples.size(); i++)
+				_samples[i].target = settings.minSamples;
+			_paths.assign(_recordPaths ? _samples.size() : 0, PixelPaths());
+			_restartedPixels = _samples.size();
+			restarted();
+		}
+		else if (scene.version() != _sceneVersion)
+		{
+			_sceneVersion = scene.version();
+			restartTouchedPixels(scene.changedBounds(), settings, pool);
+		}
+		if (_converged)
+			return false;
+
+		// tiles with nothing left to do are skipped, which after an edit is most of them;
+		// once only a few pixels are left there is no point in showing them a sample at a time
+		vector<size_t> active;
+		size_t wantingPixels = 0;
+		for (size_t t = 0; t < _tiles.size(); t++)
+		{
+			if (_tileWanting[t] > 0)
+				active.push_back(t);
+			wantingPixels += _tileWanting[t];
+		}
+		unsigned int rounds = wantingPixels * FEW_PIXELS_FRACTION < _samples.size() ? UINT_MAX : 1;
+
+		Sampler sampler(settings.sampler);
+		PixelPaths *paths = _paths.empty() ? 0 : &_paths[0];
+		pool.run(active.size(), [&](size_t a, unsigned w)
+		{
+			size_t t = active[a];
+			_tileWanting[t] = traceTile(scene, _lights, _screen, _tiles[t], settings, sampler,
+					_samples, _workers[w], frame, rounds, paths);
+		});
+		_passes++;
+
+		size_t stillWanting = 0;
+		for (size_t t = 0; t < _tiles.size(); t++)
+			stillWanting += _tileWanting[t];
+		if (stillWanting == 0 && !_edgesMarked)
+		{
+			markEdgePixels(_samples, _tiles, _width, _height, settings, pool);
+			_edgesMarked = true;
+			countWanting(settings, pool);
+			for (size_t t = 0; t < _tiles.size(); t++)
+				stillWanting += _tileWanting[t];
+		}
+		_converged = stillWanting == 0;
+		COUNTING(if (_converged) countFramePixels(frame));
+		return true;
+	}
+
+	bool converged() const
+	{
+		return _converged;
+	}
+
+	unsigned int passes() const
+	{
+		return _passes;
+	}
+
+	// how many pixels were started over the last time the frame or scene changed
+	size_t restartedPixels() const
+	{
+		return _restartedPixels;
+	}
+
+	// time since the frame was started over
+	double elapsedMillis() const
+	{
+		return chrono::duration<double, milli>(chrono::steady_clock::now() - _start).count();
+	}
+};
+
+#endif
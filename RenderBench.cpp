@@ -0,0 +1,751 @@
+/*---------------------------------------------------------------------------*/
+/* INCLUDES */
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <thread>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "RayTracer.h"
+#include "SceneCache.h"
+#include "DistributedRenderer.h"
+#include "RenderDaemon.h"
+
+/*
+ Headless renderer used to benchmark the CPU tracer. It renders a fixed scene with no
+ window or GL context, reports how long that took and writes the image to a PPM file,
+ so that images from differently built binaries (e.g. make PRECISION=float) can be
+ compared with -compare. With -suite it instead renders a fixed set of scenes and reports
+ rays per second by kind, wall time and peak memory as JSON, optionally checked against
+ the JSON of an earlier run (make bench). With -coordinator it renders a scene file on
+ worker processes instead, which it can start itself with -spawn or which run it with
+ -worker, see DistributedRenderer.h. -daemon keeps it running as a render server,
+ which -request sends scene files to, see RenderDaemon.h.
+ */
+
+/*---------------------------------------------------------------------------*/
+/* GLOBALS */
+vector<Light> lights;
+CompiledScene compiledScene;
+SceneCamera camera;
+
+// the scenes of the benchmark suite, in the order they are rendered
+const char *SUITE_SCENES[] = { "board", "spheres", "glass", "large" };
+const int NUM_SUITE_SCENES = sizeof(SUITE_SCENES) / sizeof(SUITE_SCENES[0]);
+const int LARGE_BOARDS = 4; // the large scene is this many boards wide and deep
+const int LARGE_OBJECTS = 10000;
+const double SUITE_TOLERANCE = .1; // slowdown against the baseline counted as a regression
+
+/*---------------------------------------------------------------------------*/
+/* FUNCTIONS */
+/*
+ PURPOSE: centre of a board square, raised to where the menu puts objects
+ RECEIVES: row, column -- which square, both counted from 0
+ RETURNS: the point
+ REMARKS: same placement as stringToCoord in SdlApp.cpp
+ */
+Point squarePosition(int row, int column)
+{
+	return Point(-BOARD_HALF_SIZE + (column + .5) * SQUARE_EDGE_SIZE,
+			1.5 * SQUARE_EDGE_SIZE, BOARD_HALF_SIZE - (row + .5) * SQUARE_EDGE_SIZE);
+}
+
+/*
+ PURPOSE: builds the benchmark scene
+ RECEIVES: numObjects -- how many extra objects to scatter over the board
+ RETURNS: Nothing
+ REMARKS: the board, one light, a sphere, a cube and a tetrahedron; extra objects
+ cycle through the three kinds and are laid out in shrinking layers above the board
+ */
+void makeBenchScene(int numObjects)
+{
+	scene.addRayObject(new CheckerBoard(Point(0, 0, 0)));
+	scene.addRayObject(new Sphere(squarePosition(2, 2), SQUARE_EDGE_SIZE / 2));
+	scene.addRayObject(new Cube(squarePosition(2, 5), SQUARE_EDGE_SIZE));
+	scene.addRayObject(new Tetrahedron(squarePosition(4, 3), SQUARE_EDGE_SIZE));
+
+	for (int i = 0; i < numObjects; i++)
+	{
+		int square = i % (NUM_SQUARES * NUM_SQUARES), layer = i / (NUM_SQUARES * NUM_SQUARES);
+		Real size = SQUARE_EDGE_SIZE / (2 + layer);
+		Point p = squarePosition(square / NUM_SQUARES, square % NUM_SQUARES)
+				+ Point(0.0, layer * SQUARE_EDGE_SIZE, 0.0);
+		if (i % 3 == 0)
+			scene.addRayObject(new Sphere(p, size / 2));
+		else if (i % 3 == 1)
+			scene.addRayObject(new Cube(p, size));
+		else
+			scene.addRayObject(new Tetrahedron(p, size));
+	}
+
+	lights.push_back(Light(lightColor, Point(BOARD_POSITION)
+			+ Point(0.0, 3.5 * SQUARE_EDGE_SIZE, 0.0) + squarePosition(3, 3)));
+	compiledScene.compile(scene);
+}
+
+/*
+ PURPOSE: builds one of the scenes of the benchmark suite
+ RECEIVES:
+ name -- which scene, one of SUITE_SCENES
+ root -- Shape to add the objects to, centred on the board
+ sceneLights -- where to add the light
+ sceneCamera -- set to the camera of the scene
+ RETURNS: nothing
+ REMARKS:
+ board -- the empty checker board
+ spheres -- a sphere on every square
+ glass -- a refractive tetrahedron on every square, so most rays go all the way to
+ MAX_DEPTH
+ large -- LARGE_BOARDS x LARGE_BOARDS boards with LARGE_OBJECTS spheres, cubes and
+ tetrahedra spread over their squares, seen from further away
+ */
+void makeSuiteScene(const string& name, Shape& root, vector<Light>& sceneLights,
+		SceneCamera& sceneCamera)
+{
+	sceneCamera = SceneCamera();
+	sceneLights.push_back(Light(lightColor, Point(BOARD_POSITION)
+			+ Point(0.0, 3.5 * SQUARE_EDGE_SIZE, 0.0) + squarePosition(3, 3)));
+
+	if (name != "large")
+	{
+		root.addRayObject(new CheckerBoard(Point(0, 0, 0)));
+		for (unsigned int row = 0; name != "board" && row < NUM_SQUARES; row++)
+		{
+			for (unsigned int column = 0; column < NUM_SQUARES; column++)
+			{
+				if (name == "spheres")
+					root.addRayObject(new Sphere(squarePosition(row, column),
+							SQUARE_EDGE_SIZE / 2));
+				else
+					root.addRayObject(new Tetrahedron(squarePosition(row, column),
+							.8 * SQUARE_EDGE_SIZE));
+			}
+		}
+		return;
+	}
+
+	const int squares = LARGE_BOARDS * NUM_SQUARES;
+	for (int bz = 0; bz < LARGE_BOARDS; bz++)
+		for (int bx = 0; bx < LARGE_BOARDS; bx++)
+			root.addRayObject(new CheckerBoard(
+					Point((bx - (LARGE_BOARDS - 1) / 2.0) * BOARD_EDGE_SIZE, 0,
+							(bz - (LARGE_BOARDS - 1) / 2.0) * BOARD_EDGE_SIZE)));
+	for (int i = 0; i < LARGE_OBJECTS; i++)
+	{
+		// spread over the squares in a scrambled order, stacked once every square has one
+		int square = (int) (mixBits(i % (squares * squares)) % (squares * squares));
+		int layer = i / (squares * squares);
+		Point p((square % squares - squares / 2 + .5) * SQUARE_EDGE_SIZE,
+				(1.5 + 2 * layer) * SQUARE_EDGE_SIZE / 2,
+				(square / squares - squares / 2 + .5) * SQUARE_EDGE_SIZE);
+		Real size = SQUARE_EDGE_SIZE / 2;
+		if (i % 3 == 0)
+			root.addRayObject(new Sphere(p, size / 2));
+		else if (i % 3 == 1)
+			root.addRayObject(new Cube(p, size));
+		else
+			root.addRayObject(new Tetrahedron(p, size));
+	}
+
+	// the screen is one unit a pixel where the camera looks, so looking at a point
+	// nearer the camera widens the view enough to take in all the boards
+	Point center(BOARD_POSITION);
+	sceneCamera.position = center + LARGE_BOARDS * (Point(CAMERA_POSITION) - center);
+	sceneCamera.lookAt = sceneCamera.position + .25 * (center - sceneCamera.position);
+	sceneLights.back() = Light(lightColor, center + Point(0.0, 2 * BOARD_EDGE_SIZE, 0.0));
+}
+
+// most memory the process has had resident so far, in kilobytes
+long peakRssKb()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __MAC__
+	return usage.ru_maxrss / 1024; // bytes there, kilobytes on Linux
+#else
+	return usage.ru_maxrss;
+#endif
+}
+
+/*
+ PURPOSE: looks up a number of one scene in the JSON written by runSuite
+ RECEIVES:
+ json -- text of the file
+ scene -- name of the scene
+ key -- name of the number
+ RETURNS: the number, or -1 if it isn't there
+ REMARKS: only has to read what runSuite writes, so it just looks for the key after the
+ scene's name and before the next scene's
+ */
+double jsonSceneValue(const string& json, const string& scene, const string& key)
+{
+	size_t at = json.find("\"name\": \"" + scene + "\"");
+	if (at == string::npos)
+		return -1;
+	size_t end = json.find("\"name\":", at + 1);
+	size_t found = json.find("\"" + key + "\": ", at);
+	if (found == string::npos || found > end)
+		return -1;
+	return atof(json.c_str() + found + key.size() + 4);
+}
+
+/*
+ PURPOSE: renders the scenes of the benchmark suite
+ RECEIVES:
+ size -- width and height of the images
+ runs -- renders per scene; the fastest is reported
+ threads -- number of render threads, 0 for one per core
+ jsonFile -- where to write the results, 0 for nowhere
+ baselineFile -- results of an earlier run to compare with, 0 for none
+ RETURNS: 0, or 1 if some scene traced rays more than SUITE_TOLERANCE slower than in
+ the baseline
+ REMARKS: rays per second count every kind of ray over the fastest run's wall time. Peak
+ RSS is the process's so far, so each scene's includes the ones before it.
+ */
+int runSuite(int size, int runs, int threads, const char *jsonFile,
+		const char *baselineFile)
+{
+	string baseline;
+	if (baselineFile)
+	{
+		ifstream in(baselineFile);
+		if (!in)
+			cerr << "no baseline " << baselineFile << ", nothing to compare with" << endl;
+		baseline.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+	}
+
+	ThreadPool pool(threads);
+	ostringstream json;
+	json << "{\n  \"precision\": \"" << (sizeof(Real) == sizeof(float) ? "float" : "double")
+			<< "\",\n  \"size\": " << size << ",\n  \"threads\": " << pool.size()
+			<< ",\n  \"runs\": " << runs << ",\n  \"scenes\": [";
+
+	bool regressed = false;
+	for (int n = 0; n < NUM_SUITE_SCENES; n++)
+	{
+		string name = SUITE_SCENES[n];
+		SceneArena arena; // the whole scene is freed at once when the arena goes
+		ArenaScope inArena(arena);
+		Shape root(BOARD_POSITION, Material(), 0, false);
+		vector<Light> sceneLights;
+		SceneCamera sceneCamera;
+		makeSuiteScene(name, root, sceneLights, sceneCamera);
+		CompiledScene compiled;
+		compiled.compile(root);
+
+		FrameBuffer frame(size, size);
+		RayCounts counts;
+		double best = HUGE_VAL;
+		for (int run = 0; run < runs; run++)
+		{
+			RayCounts runCounts;
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			traceRayScreen(compiled, sceneLights, sceneCamera.position, sceneCamera.lookAt,
+					sceneCamera.up, -size / 2, -size / 2, frame, pool, SamplingSettings(),
+					&runCounts);
+			best = min(best,
+					chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+			counts = runCounts;
+		}
+
+		double seconds = best / 1000;
+		double raysPerSecond = counts.total() / seconds;
+		json << (n > 0 ? "," : "") << "\n    {\n      \"name\": \"" << name << "\",\n"
+				<< "      \"triangles\": " << compiled.triangleCount() << ",\n"
+				<< "      \"spheres\": " << compiled.sphereCount() << ",\n"
+				<< "      \"boxes\": " << compiled.boxCount() << ",\n"
+				<< "      \"cones\": " << compiled.coneCount() << ",\n"
+				<< "      \"boards\": " << compiled.boardCount() << ",\n"
+				<< "      \"instances\": " << compiled.instanceCount() << ",\n"
+				<< "      \"build_ms\": " << compiled.compileMillis() + compiled.buildMillis()
+				<< ",\n"
+				<< "      \"wall_ms\": " << best << ",\n"
+				<< "      \"primary_rays\": " << counts.primary << ",\n"
+				<< "      \"shadow_rays\": " << counts.shadow << ",\n"
+				<< "      \"secondary_rays\": " << counts.secondary << ",\n"
+				<< "      \"primary_rays_per_sec\": " << counts.primary / seconds << ",\n"
+				<< "      \"shadow_rays_per_sec\": " << counts.shadow / seconds << ",\n"
+				<< "      \"secondary_rays_per_sec\": " << counts.secondary / seconds << ",\n"
+				<< "      \"rays_per_sec\": " << raysPerSecond << ",\n"
+				<< "      \"peak_rss_kb\": " << peakRssKb() << "\n    }";
+
+		cout << name << ": " << best << " ms, " << raysPerSecond / 1e6 << " Mrays/s ("
+				<< counts.primary << " primary, " << counts.shadow << " shadow, "
+				<< counts.secondary << " secondary), peak RSS " << peakRssKb() << " kB";
+		double before = jsonSceneValue(baseline, name, "rays_per_sec");
+		if (before > 0)
+		{
+			double change = raysPerSecond / before - 1;
+			cout << ", " << (change >= 0 ? "+" : "") << 100 * change << "% against baseline";
+			if (change < -SUITE_TOLERANCE)
+			{
+				cout << " REGRESSION";
+				regressed = true;
+			}
+		}
+		cout << endl;
+	}
+	json << "\n  ]\n}\n";
+
+	if (jsonFile)
+	{
+		ofstream out(jsonFile);
+		out << json.str();
+		if (!out)
+		{
+			cerr << "can't write " << jsonFile << endl;
+			return 1;
+		}
+	}
+	return regressed ? 1 : 0;
+}
+
+/*
+ PURPOSE: converts a frame to 8 bit pixels
+ RECEIVES:
+ frame -- what the tracer rendered
+ pixels -- set to the clamped and rounded colours, bottom row first
+ RETURNS: Nothing
+ REMARKS:
+ */
+void framePixels(const FrameBuffer& frame, vector<PackedPixel>& pixels)
+{
+	pixels.resize(frame.width() * frame.height());
+	for (int y = 0; y < frame.height(); y++)
+	{
+		for (int x = 0; x < frame.width(); x++)
+		{
+			const float *p = frame.pixel(x, y);
+			unsigned char c[3];
+			for (int k = 0; k < 3; k++)
+				c[k] = (unsigned char) (min(max(p[k], 0.0f), 1.0f) * 255 + .5f);
+			PackedPixel &out = pixels[y * frame.width() + x];
+			out.r = c[0];
+			out.g = c[1];
+			out.b = c[2];
+		}
+	}
+}
+
+/*
+ PURPOSE: prints how much two images differ
+ RECEIVES: reference, test -- PPM files of the same size
+ RETURNS: 0 if the images could be compared, 1 if not
+ REMARKS: RMSE and largest difference are in 8 bit levels; PSNR is infinite for
+ identical images
+ */
+int compareImages(const char *reference, const char *test)
+{
+	int width, height, testWidth, testHeight;
+	vector<PackedPixel> a, b;
+	ppmRead(reference, width, height, a);
+	ppmRead(test, testWidth, testHeight, b);
+	if (width != testWidth || height != testHeight)
+	{
+		cerr << "images are " << width << "x" << height << " and " << testWidth << "x"
+				<< testHeight << endl;
+		return 1;
+	}
+
+	double squaredError = 0;
+	int maxError = 0;
+	size_t differing = 0;
+	for (size_t i = 0; i < a.size(); i++)
+	{
+		int d[3] = { a[i].r - b[i].r, a[i].g - b[i].g, a[i].b - b[i].b };
+		bool differs = false;
+		for (int k = 0; k < 3; k++)
+		{
+			squaredError += d[k] * d[k];
+			maxError = max(maxError, abs(d[k]));
+			differs = differs || d[k] != 0;
+		}
+		differing += differs;
+	}
+	double rmse = sqrt(squaredError / (3.0 * a.size()));
+	cout << "rmse " << rmse << " max " << maxError << " psnr "
+			<< (rmse > 0 ? 20 * log10(255 / rmse) : HUGE_VAL) << " dB differing "
+			<< 100.0 * differing / a.size() << "%" << endl;
+	return 0;
+}
+
+/*
+ PURPOSE: works for a coordinator until it is done with the worker
+ RECEIVES:
+ address -- where the coordinator listens
+ threads -- number of render threads, 0 for one per core
+ cacheDir -- where to cache compiled scenes, 0 for nowhere
+ RETURNS: 0 when the coordinator let the worker go, 1 if something went wrong
+ REMARKS:
+ */
+int runWorker(const char *address, int threads, const char *cacheDir)
+{
+	try
+	{
+		TileWorker worker(threads, cacheDir);
+		worker.serve(address);
+	}
+	catch (const exception& e)
+	{
+		cerr << "worker " << getpid() << ": " << e.what() << endl;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ PURPOSE: renders a scene file on worker processes
+ RECEIVES:
+ sceneFile -- the scene
+ address -- where to listen for the workers
+ spawn -- how many workers to start here, each in a process of its own
+ threads -- number of render threads of each worker started here, 0 to share the cores
+ between them
+ cacheDir -- where the workers started here cache compiled scenes, 0 for nowhere
+ size -- width and height of the image
+ runs -- how many times to render; the fastest run is reported
+ outFile -- where to write the image
+ RETURNS: 0 on success
+ REMARKS: the workers are started before the coordinator listens and keep trying to
+ connect until it does. Workers started elsewhere can join at any time.
+ */
+int renderDistributed(const char *sceneFile, const char *address, int spawn, int threads,
+		const char *cacheDir, int size, int runs, const char *outFile)
+{
+	if (spawn > 0 && threads == 0)
+		threads = max(1, (int) thread::hardware_concurrency() / spawn);
+	cout.flush(); // or the workers would print it again
+	vector<pid_t> workers;
+	for (int i = 0; i < spawn; i++)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+			_exit(runWorker(address, threads, cacheDir));
+		if (pid > 0)
+			workers.push_back(pid);
+		else
+			cerr << "couldn't start a worker: " << strerror(errno) << endl;
+	}
+
+	int status = 0;
+	try
+	{
+		vector<char> text;
+		readSceneText(sceneFile, text);
+		TileCoordinator coordinator(address, text.empty() ? "" : &text[0], text.size());
+		FrameBuffer frame(size, size);
+		double best = HUGE_VAL;
+		for (int run = 0; run < runs; run++)
+		{
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			coordinator.render(frame, -size / 2, -size / 2);
+			best = min(best,
+					chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+		}
+
+		vector<PackedPixel> pixels;
+		framePixels(frame, pixels);
+		ppmWrite(outFile, size, size, pixels);
+		const DistributedStats& stats = coordinator.stats();
+		cout << (sizeof(Real) == sizeof(float) ? "float" : "double") << " " << size << "x"
+				<< size << " on " << stats.workers << " workers, " << stats.jobs << " jobs, "
+				<< stats.reissued << " handed out again, " << stats.lost
+				<< " workers lost, pixels packed to "
+				<< 100.0 * stats.packedBytes / max(stats.pixelBytes, (uint64_t) 1) << "%: "
+				<< best << " ms (best of " << runs << ") -> " << outFile << endl;
+	}
+	catch (const exception& e)
+	{
+		cerr << e.what() << endl;
+		status = 1;
+	}
+
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		int exitStatus;
+		if (waitpid(workers[i], &exitStatus, 0) == workers[i]
+				&& !(WIFEXITED(exitStatus) && WEXITSTATUS(exitStatus) == 0))
+			status = 1;
+	}
+	return status;
+}
+
+/*
+ PURPOSE: has a render daemon render a scene file
+ RECEIVES:
+ sceneFile -- the scene
+ address -- where the daemon listens
+ camera -- where to look from, or 0 for the scene file's camera
+ size -- width and height of the image
+ runs -- how many times to ask for it; the fastest round trip is reported
+ outFile -- where to write the image
+ RETURNS: 0 on success
+ REMARKS: every request goes over the one connection. The first to name a scene the
+ daemon hasn't loaded pays for loading it; the rest show what a warm daemon takes.
+ */
+int requestRender(const char *sceneFile, const char *address, const SceneCamera *camera,
+		int size, int runs, const char *outFile)
+{
+	const char *SOURCES[] = { "warm", "mapped from cache", "compiled" };
+	try
+	{
+		vector<char> text;
+		readSceneText(sceneFile, text);
+		RenderClient client(address);
+		FrameBuffer frame(size, size);
+		double best = HUGE_VAL;
+		for (int run = 0; run < runs; run++)
+		{
+			DaemonReply reply;
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			client.render(text.empty() ? "" : &text[0], text.size(), camera, SamplingSettings(),
+					frame, reply);
+			double millis
+					= chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+			best = min(best, millis);
+			cout << "request " << run + 1 << ": scene " << SOURCES[reply.source] << " in "
+					<< reply.sceneMillis << " ms, rendered in " << reply.renderMillis << " ms, "
+					<< millis << " ms round trip" << endl;
+		}
+
+		vector<PackedPixel> pixels;
+		framePixels(frame, pixels);
+		ppmWrite(outFile, size, size, pixels);
+		cout << (sizeof(Real) == sizeof(float) ? "float" : "double") << " " << size << "x"
+				<< size << " from daemon: " << best << " ms (best of " << runs << ") -> "
+				<< outFile << endl;
+	}
+	catch (const exception& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ PURPOSE: renders the benchmark scene, or compares two images
+ RECEIVES: command line arguments
+ -o file -- where to write the image (default bench.ppm)
+ -scene file -- render this scene file rather than the built in scene
+ -cache dir -- map the compiled scene file from a cache in dir, or compile it and save
+ it there if it isn't cached yet
+ -size n -- width and height of the image in pixels
+ -objects n -- extra objects to add to the scene
+ -runs n -- how many times to render; the fastest run is reported
+ -cpu n -- number of render threads
+ -counters file -- write what the tracer did in the last run to file, as JSON if its
+ name ends in .json and as CSV otherwise; needs a build with make COUNTERS=1
+ -compare reference test -- report the difference between two PPM files instead
+ -suite -- render the benchmark suite instead, see runSuite; -json file writes its
+ results to file and -baseline file compares them with those of an earlier run
+ -coordinator address -- render the scene file on worker processes instead, handing
+ them jobs on address (host:port or the path of a Unix domain socket); -spawn n starts
+ n workers here
+ -worker address -- trace jobs for the coordinator at address until it is done, with
+ -cpu threads and caching compiled scenes in -cache dir
+ -daemon address -- serve render requests on address until killed, with -cpu threads
+ and caching compiled scenes in -cache dir as well as in memory
+ -request address -- have the daemon at address render the scene file instead, -runs
+ times over one connection
+ -camera px py pz lx ly lz ux uy uz -- with -request, look from here rather than from
+ the scene file's camera, as the camera item of a scene file does
+ RETURNS: 0 on success
+ REMARKS:
+ */
+int main(int argc, char **argv)
+{
+	const char *outFile = "bench.ppm", *sceneFile = 0, *cacheDir = 0;
+	const char *jsonFile = 0, *baselineFile = 0, *countersFile = 0;
+	const char *coordinatorAddress = 0, *workerAddress = 0;
+	const char *daemonAddress = 0, *requestAddress = 0;
+	SceneCamera requestCamera;
+	bool suite = false, hasCamera = false;
+	int size = 500, numObjects = 0, runs = 3, threads = 0, spawn = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-compare") == 0 && i + 2 < argc)
+			return compareImages(argv[i + 1], argv[i + 2]);
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+			outFile = argv[++i];
+		else if (strcmp(argv[i], "-scene") == 0 && i + 1 < argc)
+			sceneFile = argv[++i];
+		else if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc)
+			cacheDir = argv[++i];
+		else if (strcmp(argv[i], "-size") == 0 && i + 1 < argc)
+			size = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-objects") == 0 && i + 1 < argc)
+			numObjects = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-runs") == 0 && i + 1 < argc)
+			runs = max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "-cpu") == 0 && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-counters") == 0 && i + 1 < argc)
+			countersFile = argv[++i];
+		else if (strcmp(argv[i], "-suite") == 0)
+			suite = true;
+		else if (strcmp(argv[i], "-json") == 0 && i + 1 < argc)
+			jsonFile = argv[++i];
+		else if (strcmp(argv[i], "-baseline") == 0 && i + 1 < argc)
+			baselineFile = argv[++i];
+		else if (strcmp(argv[i], "-coordinator") == 0 && i + 1 < argc)
+			coordinatorAddress = argv[++i];
+		else if (strcmp(argv[i], "-spawn") == 0 && i + 1 < argc)
+			spawn = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-worker") == 0 && i + 1 < argc)
+			workerAddress = argv[++i];
+		else if (strcmp(argv[i], "-daemon") == 0 && i + 1 < argc)
+			daemonAddress = argv[++i];
+		else if (strcmp(argv[i], "-request") == 0 && i + 1 < argc)
+			requestAddress = argv[++i];
+		else if (strcmp(argv[i], "-camera") == 0 && i + 9 < argc)
+		{
+			Real v[9];
+			for (int k = 0; k < 9; k++)
+				v[k] = atof(argv[++i]);
+			requestCamera.position = Point(v[0], v[1], v[2]);
+			requestCamera.lookAt = Point(v[3], v[4], v[5]);
+			requestCamera.up = Point(v[6], v[7], v[8]);
+			hasCamera = true;
+		}
+		else
+		{
+			cerr << "usage: " << argv[0]
+					<< " [-o file] [-scene file [-cache dir]] [-size n] [-objects n]"
+					<< " [-runs n] [-cpu n] [-counters file]" << endl
+					<< "       " << argv[0]
+					<< " -suite [-json file] [-baseline file] [-size n] [-runs n] [-cpu n]"
+					<< endl << "       " << argv[0]
+					<< " -scene file -coordinator address [-spawn n] [-cache dir] [-size n]"
+					<< " [-runs n] [-cpu n]" << endl
+					<< "       " << argv[0] << " -worker address [-cache dir] [-cpu n]" << endl
+					<< "       " << argv[0] << " -daemon address [-cache dir] [-cpu n]" << endl
+					<< "       " << argv[0]
+					<< " -scene file -request address [-camera px py pz lx ly lz ux uy uz]"
+					<< " [-size n] [-runs n]" << endl
+					<< "       " << argv[0] << " -compare reference.ppm test.ppm" << endl;
+			return 1;
+		}
+	}
+
+	if (suite)
+		return runSuite(size, runs, threads, jsonFile, baselineFile);
+	if (workerAddress)
+		return runWorker(workerAddress, threads, cacheDir);
+	if (daemonAddress)
+	{
+		try
+		{
+			RenderDaemon daemon(threads, cacheDir);
+			cout << "serving renders on " << daemonAddress << " with " << daemon.threads()
+					<< " threads" << endl;
+			daemon.serve(daemonAddress);
+		}
+		catch (const exception& e)
+		{
+			cerr << e.what() << endl;
+		}
+		return 1;
+	}
+	if (requestAddress)
+	{
+		if (!sceneFile)
+		{
+			cerr << "-request needs a -scene file to send the daemon" << endl;
+			return 1;
+		}
+		return requestRender(sceneFile, requestAddress, hasCamera ? &requestCamera : 0, size,
+				runs, outFile);
+	}
+	if (coordinatorAddress)
+	{
+		if (!sceneFile)
+		{
+			cerr << "-coordinator needs a -scene file to send the workers" << endl;
+			return 1;
+		}
+		return renderDistributed(sceneFile, coordinatorAddress, spawn, threads, cacheDir, size,
+				runs, outFile);
+	}
+
+	ArenaScope inArena(sceneArena);
+	if (sceneFile)
+	{
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		try
+		{
+			uint64_t hash = 0;
+			string cacheFile;
+			if (cacheDir)
+			{
+				hash = hashSceneFile(sceneFile);
+				cacheFile = SceneCache::path(cacheDir, hash);
+			}
+			if (cacheDir
+					&& SceneCache::load(cacheFile.c_str(), hash, compiledScene, lights, camera))
+				cout << sceneFile << ": mapped from " << cacheFile;
+			else
+			{
+				SceneFileStats stats;
+				loadSceneFile(sceneFile, scene, lights, camera, stats);
+				compiledScene.compile(scene);
+				cout << sceneFile << ": " << stats.objects << " objects, " << stats.lights
+						<< " lights loaded in " << stats.millis << " ms, compiled in "
+						<< compiledScene.compileMillis() << " ms, BVH built in "
+						<< compiledScene.buildMillis() << " ms";
+				if (cacheDir && !SceneCache::save(cacheFile.c_str(), hash, compiledScene, lights,
+						camera))
+					cerr << "couldn't write scene cache " << cacheFile << endl;
+			}
+		}
+		catch (const exception& e)
+		{
+			cerr << e.what() << endl;
+			return 1;
+		}
+		cout << "; ready after "
+				<< chrono::duration<double, milli>(chrono::steady_clock::now() - start).count()
+				<< " ms" << endl;
+	}
+	else
+		makeBenchScene(numObjects);
+	FrameBuffer frame(size, size);
+	ThreadPool pool(threads);
+	double best = HUGE_VAL;
+	for (int run = 0; run < runs; run++)
+	{
+		collectTraceCounters(); // so only the last run is counted
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		traceRayScreen(compiledScene, lights, camera.position, camera.lookAt, camera.up,
+				-size / 2, -size / 2, frame, pool);
+		best = min(best, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+	}
+
+	vector<PackedPixel> pixels;
+	framePixels(frame, pixels);
+	ppmWrite(outFile, size, size, pixels);
+	cout << (sizeof(Real) == sizeof(float) ? "float" : "double") << " " << size << "x" << size
+			<< " " << compiledScene.triangleCount() << " triangles " << compiledScene.sphereCount()
+			<< " spheres " << compiledScene.boxCount() << " boxes " << compiledScene.coneCount()
+			<< " cones " << compiledScene.boardCount() << " boards "
+			<< compiledScene.instanceCount() << " instances: " << best << " ms (best of "
+			<< runs << ") -> " << outFile << endl;
+
+	if (countersFile)
+	{
+#ifdef TRACE_COUNTERS
+		if (!collectTraceCounters().write(countersFile))
+		{
+			cerr << "couldn't write " << countersFile << endl;
+			return 1;
+		}
+		cout << "counters -> " << countersFile << endl;
+#else
+		cerr << "not counting; build with make COUNTERS=1 to use -counters" << endl;
+#endif
+	}
+	return 0;
+}
@@ -0,0 +1,384 @@
+#ifndef RENDERDAEMON_H
+#define RENDERDAEMON_H
+
+/*---------------------------------------------------------------------------*/
+/* INCLUDES */
+#include <vector>
+#include <map>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <stdexcept>
+#include "DistributedRenderer.h"
+
+/*
+ A render server which stays up between renders, so that rendering another view of a
+ scene it has seen costs only the tracing: no process to start, no scene to parse,
+ compile or build a BVH and LightTree for, no threads to create. A RenderDaemon
+ listens on a socket (a Unix domain one, or host:port, see openSocket) and answers
+ every RENDER request on a connection with an IMAGE or, if the request can't be
+ rendered, a FAILED saying why; a connection can carry any number of requests, one
+ after the other. Scenes are kept, ready to trace, by the hash of their text
+ (hashSceneText), the last DAEMON_SCENES of them in memory and, given a cache
+ directory, all of them in SceneCache files, so a scene the daemon was restarted since
+ is only mapped in rather than compiled again.
+ Every connection has a thread of its own, up to MAX_DAEMON_CLIENTS of them, which
+ reads its requests and finds or loads their scenes, so requests for different scenes
+ load them at the same time; the tracing is done on one ThreadPool shared by all of
+ them, a frame at a time, each frame having every core to itself.
+ Messages are those of DistributedRenderer.h:
+ RENDER -- width, height, whether a camera follows (uint32_t) and if so its position,
+ look-at point and up direction as nine doubles, the SamplingSettings as in FRAME,
+ then the text of the scene file. Without a camera the scene file's is used.
+ IMAGE (daemon) -- width, height, where the scene came from (DaemonSceneSource),
+ milliseconds taken to find or load it and to render, primary, secondary and shadow
+ rays traced, then the pixels of the whole frame packed with packTile
+ FAILED (daemon) -- what went wrong with the request; the connection stays open unless
+ the request was longer than MAX_DAEMON_REQUEST_BYTES or the daemon had too many clients
+ */
+
+/*---------------------------------------------------------------------------*/
+/*  VARIABLES */
+const size_t DAEMON_SCENES = 8; // scenes kept loaded in memory, the least recently used
+// going first
+const int MAX_DAEMON_FRAME_SIZE = 4096; // widest and highest frame a request may ask for
+const uint32_t MAX_DAEMON_SCENE_BYTES = 64u << 20; // longest scene text a request may carry
+const uint32_t MAX_DAEMON_REQUEST_BYTES = MAX_DAEMON_SCENE_BYTES + 1024; // the scene plus
+// everything before it
+const unsigned int MAX_DAEMON_CLIENTS = 32; // connections served at once; more are turned
+// away with a FAILED
+
+// where the scene of a request came from
+enum DaemonSceneSource
+{
+   SCENE_WARM, // loaded already for an earlier request
+   SCENE_MAPPED, // mapped in from a SceneCache file
+   SCENE_COMPILED // parsed and compiled
+};
+
+/*---------------------------------------------------------------------------*/
+/* CLASS DEFINITIONS */
+// what a RenderDaemon says about a frame it rendered
+struct DaemonReply
+{
+   DaemonSceneSource source;
+   double sceneMillis;
+   double renderMillis;
+   RayCounts counts;
+
+   DaemonReply()
+   {
+      source = SCENE_COMPILED;
+      sceneMillis = renderMillis = 0;
+   }
+};
+
+/*
+ PURPOSE: renders frames for clients, keeping the scenes it loads for later requests
+ REMARK: runs until the process ends. Two requests for a scene which isn't loaded yet
+ arriving together may both load it; the first to finish is kept.
+ */
+class RenderDaemon
+{
+private:
+   struct WarmScene
+   {
+      std::shared_ptr<LoadedScene> scene;
+      uint64_t lastUsed; // request count when it was last used
+   };
+
+   ThreadPool _pool;
+   std::mutex _poolLock; // ThreadPool::run is for one thread at a time
+   const char *_cacheDir;
+   std::map<uint64_t, WarmScene> _scenes;
+   std::mutex _scenesLock;
+   uint64_t _requests;
+   unsigned int _clients; // connections being served
+   std::mutex _clientsLock;
+
+   RenderDaemon(const RenderDaemon&);
+   RenderDaemon& operator=(const RenderDaemon&);
+
+   /*
+    PURPOSE: finds the scene of a request, loading it if it isn't loaded
+    RECEIVES:
+    text, size -- text of the scene file
+    source -- set to where the scene came from
+    RETURNS: the scene
+    REMARKS: throws runtime_error if the text has an error in it
+    */
+   std::shared_ptr<LoadedScene> findScene(const char *text, size_t size,
+         DaemonSceneSource& source)
+   {
+      uint64_t hash = hashSceneText(text, size);
+      {
+         std::lock_guard<std::mutex> hold(_scenesLock);
+         std::map<uint64_t, WarmScene>::iterator found = _scenes.find(hash);
+         if (found != _scenes.end())
+         {
+            found->second.lastUsed = ++_requests;
+            source = SCENE_WARM;
+            return found->second.scene;
+         }
+      }
+
+      std::shared_ptr<LoadedScene> scene(new LoadedScene);
+      scene->load(text, size, hash, _cacheDir);
+      source = scene->mapped ? SCENE_MAPPED : SCENE_COMPILED;
+
+      std::lock_guard<std::mutex> hold(_scenesLock);
+      WarmScene& warm = _scenes[hash];
+      if (!warm.scene)
+         warm.scene = scene;
+      warm.lastUsed = ++_requests;
+      if (_scenes.size() > DAEMON_SCENES)
+      {
+         // a scene dropped while requests are rendering it lives until they are done
+         std::map<uint64_t, WarmScene>::iterator oldest = _scenes.begin();
+         for (std::map<uint64_t, WarmScene>::iterator i = _scenes.begin(); i != _scenes.end();
+               ++i)
+            if (i->second.lastUsed < oldest->second.lastUsed)
+               oldest = i;
+         _scenes.erase(oldest);
+      }
+      return warm.scene;
+   }
+
+   // renders the frame a RENDER message asks for and builds the IMAGE answering it
+   void render(const vector<char>& payload, MessageWriter& image)
+   {
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      MessageReader in(payload);
+      int width = in.get<int32_t>(), height = in.get<int32_t>();
+      bool hasCamera = in.get<uint32_t>() != 0;
+      double view[9];
+      for (int k = 0; hasCamera && k < 9; k++)
+         view[k] = in.get<double>();
+      SamplingSettings settings = getSettings(in);
+      size_t size;
+      const char *text = in.rest(size);
+      if (width <= 0 || height <= 0 || width > MAX_DAEMON_FRAME_SIZE
+            || height > MAX_DAEMON_FRAME_SIZE)
+         throw runtime_error("frame size out of range");
+
+      DaemonReply reply;
+      std::shared_ptr<LoadedScene> scene = findScene(text, size, reply.source);
+      SceneCamera camera = scene->camera;
+      if (hasCamera)
+      {
+         camera.position = Point(view[0], view[1], view[2]);
+         camera.lookAt = Point(view[3], view[4], view[5]);
+         camera.up = Point(view[6], view[7], view[8]);
+      }
+      reply.sceneMillis = millisSince(start);
+
+      FrameBuffer frame(width, height);
+      {
+         std::lock_guard<std::mutex> hold(_poolLock);
+         chrono::steady_clock::time_point traced = chrono::steady_clock::now();
+         traceRayScreen(scene->compiled, scene->lightTree, camera.position, camera.lookAt,
+               camera.up, -width / 2, -height / 2, frame, _pool, settings, &reply.counts);
+         reply.renderMillis = millisSince(traced);
+      }
+
+      image.put((int32_t) width);
+      image.put((int32_t) height);
+      image.put((uint32_t) reply.source);
+      image.put(reply.sceneMillis);
+      image.put(reply.renderMillis);
+      image.put(reply.counts.primary);
+      image.put(reply.counts.secondary);
+      image.put(reply.counts.shadow);
+      Tile all = { 0, 0, width, height, 0 };
+      vector<char> packed;
+      packTile(frame, all, packed);
+      image.putBytes(packed.empty() ? 0 : &packed[0], packed.size());
+   }
+
+   // answers the requests of one client until it goes away
+   void serveClient(int fd)
+   {
+      uint32_t type;
+      vector<char> payload;
+      try
+      {
+         while (receiveMessage(fd, type, payload, MAX_DAEMON_REQUEST_BYTES))
+         {
+            if (type != RENDER_MESSAGE)
+            {
+               sendFailure(fd, "not a render request");
+               break;
+            }
+            try
+            {
+               MessageWriter image(IMAGE_MESSAGE);
+               render(payload, image);
+               if (!sendMessage(fd, image))
+                  break;
+            }
+            catch (const exception& e)
+            {
+               sendFailure(fd, e.what());
+            }
+         }
+      }
+      catch (const exception& e)
+      {
+         // the client went away in the middle of a request or sent one too long to take
+         sendFailure(fd, e.what());
+      }
+      close(fd);
+      std::lock_guard<std::mutex> hold(_clientsLock);
+      _clients--;
+   }
+
+public:
+   /*
+    PURPOSE: sets up a daemon
+    RECEIVES:
+    threads -- number of render threads, 0 for one per core
+    cacheDir -- directory to keep compiled scenes in, see SceneCache, or 0 for none
+    RETURNS: nothing
+    REMARKS:
+    */
+   explicit RenderDaemon(unsigned int threads = 0, const char *cacheDir = 0) :
+         _pool(threads)
+   {
+      _cacheDir = cacheDir;
+      _requests = 0;
+      _clients = 0;
+   }
+
+   unsigned int threads() const
+   {
+      return _pool.size();
+   }
+
+   /*
+    PURPOSE: answers requests on an address
+    RECEIVES: address -- where to listen, see openSocket
+    RETURNS: only if the listening socket fails
+    REMARKS: throws runtime_error if the address can't be listened on
+    */
+   void serve(const char *address)
+   {
+      int listener = openSocket(address, true);
+      if (listener < 0)
+         throw runtime_error(string("can't listen on ") + address + ": " + strerror(errno));
+      for (;;)
+      {
+         int fd = accept(listener, 0, 0);
+         if (fd < 0 && errno == EINTR)
+            continue;
+         if (fd < 0)
+            break;
+#ifdef __MAC__
+         int on = 1;
+         setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+         {
+            std::lock_guard<std::mutex> hold(_clientsLock);
+            if (_clients >= MAX_DAEMON_CLIENTS)
+            {
+               sendFailure(fd, "too many clients");
+               close(fd);
+               continue;
+            }
+            _clients++;
+         }
+         thread(&RenderDaemon::serveClient, this, fd).detach();
+      }
+      int error = errno;
+      close(listener);
+      throw runtime_error(string("can't accept on ") + address + ": " + strerror(error));
+   }
+};
+
+/*
+ PURPOSE: asks a RenderDaemon for frames
+ REMARK: one request at a time; throws runtime_error if the daemon can't be reached or
+ can't render a request
+ */
+class RenderClient
+{
+private:
+   int _fd;
+
+   RenderClient(const RenderClient&);
+   RenderClient& operator=(const RenderClient&);
+
+public:
+   explicit RenderClient(const char *address)
+   {
+      _fd = openSocket(address, false);
+      if (_fd < 0)
+         throw runtime_error(string("can't connect to ") + address + ": " + strerror(errno));
+   }
+
+   ~RenderClient()
+   {
+      close(_fd);
+   }
+
+   /*
+    PURPOSE: has the daemon render a frame
+    RECEIVES:
+    text, size -- text of the scene file
+    camera -- where to look from, or 0 for the scene file's camera
+    settings -- how many samples to take per pixel
+    frame -- FrameBuffer to write the pixels to; its size gives the size of the screen
+    reply -- set to what the daemon says about the frame
+    RETURNS: nothing
+    REMARKS: the pixels are those traceRayScreen would make
+    */
+   void render(const char *text, size_t size, const SceneCamera *camera,
+         const SamplingSettings& settings, FrameBuffer& frame, DaemonReply& reply)
+   {
+      if (size > MAX_DAEMON_SCENE_BYTES)
+         throw runtime_error("scene too long for a render daemon");
+      MessageWriter request(RENDER_MESSAGE);
+      request.put((int32_t) frame.width());
+      request.put((int32_t) frame.height());
+      request.put((uint32_t) (camera != 0));
+      if (camera)
+      {
+         const Point *view[3] = { &camera->position, &camera->lookAt, &camera->up };
+         for (int k = 0; k < 3; k++)
+         {
+            request.put((double) view[k]->x());
+            request.put((double) view[k]->y());
+            request.put((double) view[k]->z());
+         }
+      }
+      putSettings(request, settings);
+      request.putBytes(text, size);
+
+      uint32_t type;
+      vector<char> payload;
+      if (!sendMessage(_fd, request) || !receiveMessage(_fd, type, payload))
+         throw runtime_error("render daemon went away");
+      if (type == FAILED_MESSAGE)
+         throw runtime_error("render daemon: " + string(payload.begin(), payload.end()));
+      if (type != IMAGE_MESSAGE)
+         throw runtime_error("unexpected message from render daemon");
+
+      MessageReader in(payload);
+      int width = in.get<int32_t>(), height = in.get<int32_t>();
+      if (width != frame.width() || height != frame.height())
+         throw runtime_error("render daemon sent a frame of another size");
+      reply.source = (DaemonSceneSource) in.get<uint32_t>();
+      reply.sceneMillis = in.get<double>();
+      reply.renderMillis = in.get<double>();
+      reply.counts.primary = in.get<uint64_t>();
+      reply.counts.secondary = in.get<uint64_t>();
+      reply.counts.shadow = in.get<uint64_t>();
+      size_t packedSize;
+      const char *packed = in.rest(packedSize);
+      Tile all = { 0, 0, width, height, 0 };
+      unpackTile(packed, packedSize, all, frame);
+   }
+};
+
+#endif
@@ -0,0 +1,316 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+/*---------------------------------------------------------------------------*/
+/* INCLUDES */
+#include <vector>
+#include <cmath>
+#include <stdint.h>
+
+/*---------------------------------------------------------------------------*/
+/*  VARIABLES */
+// which sequence a Sampler draws its points from
+enum SamplerType
+{
+   RANDOM_SAMPLER, HALTON_SAMPLER, SOBOL_SAMPLER, BLUE_NOISE_SAMPLER
+};
+
+const int BLUE_NOISE_SIZE = 64; // edge length in pixels of the tiled blue noise mask
+const double BLUE_NOISE_SIGMA = 1.5; // spread of the energy function used to build it
+
+const unsigned int NUM_HALTON_PRIMES = 16;
+const unsigned int HALTON_PRIMES[NUM_HALTON_PRIMES] =
+{ 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53 };
+
+/*---------------------------------------------------------------------------*/
+/* FUNCTIONS */
+/*
+ PURPOSE: scrambles a 64 bit value
+ RECEIVES: x -- value to scramble
+ RETURNS: the scrambled value
+ REMARKS: the splitmix64 finalizer; every bit of the input affects every bit of the output
+ */
+inline uint64_t mixBits(uint64_t x)
+{
+   x ^= x >> 30;
+   x *= 0xbf58476d1ce4e5b9ULL;
+   x ^= x >> 27;
+   x *= 0x94d049bb133111ebULL;
+   x ^= x >> 31;
+   return x;
+}
+
+/*
+ PURPOSE: counter-based random numbers
+ RECEIVES:
+ key -- which stream to draw from
+ counter -- position in the stream
+ RETURNS: 32 random bits
+ REMARKS: there is no state to share or update, so any thread can draw any number from
+ any stream in any order and always gets the same answer
+ */
+inline uint32_t hashRandom(uint64_t key, uint32_t counter)
+{
+   return (uint32_t) (mixBits(key ^ mixBits(counter + 0x9e3779b97f4a7c15ULL)) >> 32);
+}
+
+// key of the stream belonging to one dimension of one pixel
+inline uint64_t pixelKey(uint32_t seed, unsigned int x, unsigned int y,
+      unsigned int dimension)
+{
+   return mixBits(((uint64_t) seed << 32) ^ ((uint64_t) y << 20) ^ x)
+         ^ mixBits(dimension + 1);
+}
+
+// maps 32 random bits to [0, 1)
+inline float toUnitFloat(uint32_t bits)
+{
+   return (bits >> 8) * (1.0f / 16777216.0f);
+}
+
+inline uint32_t reverseBits(uint32_t x)
+{
+   x = (x << 16) | (x >> 16);
+   x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+   x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+   x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+   x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+   return x;
+}
+
+/*
+ PURPOSE: random nested uniform (Owen) scramble of the bits of x
+ RECEIVES:
+ x -- bits to scramble, most significant bit first
+ seed -- which of the scrambles to apply
+ RETURNS: the scrambled bits
+ REMARKS: Burley's hash based version of the Laine-Karras permutation: each bit is
+ flipped depending only on the bits above it, so a (0, 2)-sequence stays one
+ */
+inline uint32_t owenScramble(uint32_t x, uint32_t seed)
+{
+   x = reverseBits(x);
+   x += seed;
+   x ^= x * 0x6c50b47cu;
+   x ^= x * 0xb82f1e52u;
+   x ^= x * 0xc7afe638u;
+   x ^= x * 0x8d22f6e6u;
+   return reverseBits(x);
+}
+
+/*
+ PURPOSE: the first two dimensions of the Sobol sequence
+ RECEIVES:
+ index -- which point of the sequence
+ s0, s1 -- set to its coordinates as 32 bit fixed point fractions
+ RETURNS: nothing
+ REMARKS: dimension 0 is the van der Corput sequence, dimension 1 uses the direction
+ numbers of the primitive polynomial x + 1
+ */
+inline void sobol2D(uint32_t index, uint32_t& s0, uint32_t& s1)
+{
+   s0 = reverseBits(index);
+   s1 = 0;
+   for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+      if (index & 1)
+         s1 ^= v;
+}
+
+// the radical inverse of index in the given base, i.e. its digits mirrored about the point
+inline double radicalInverse(uint32_t index, unsigned int base)
+{
+   double inverseBase = 1.0 / base, f = inverseBase, result = 0.0;
+   for (; index != 0; index /= base, f *= inverseBase)
+      result += (index % base) * f;
+   return result;
+}
+
+/*---------------------------------------------------------------------------*/
+/* CLASS DEFINITIONS */
+/*
+ PURPOSE: a stream of random numbers for one thread or one sample
+ REMARK: counter-based, so creating one is free and two streams with different keys
+ never interfere; key it on whatever the numbers belong to (e.g. pixelKey) to make them
+ reproducible.
+ */
+class RandomStream
+{
+private:
+   uint64_t _key;
+   uint32_t _counter;
+
+public:
+   // start -- how far into the stream to begin, to split one stream between users
+   RandomStream(uint64_t key = 0, uint32_t start = 0)
+   {
+      _key = key;
+      _counter = start;
+   }
+
+   uint32_t nextBits()
+   {
+      return hashRandom(_key, _counter++);
+   }
+
+   // next number in [0, 1)
+   float next()
+   {
+      return toUnitFloat(nextBits());
+   }
+};
+
+/*
+ PURPOSE: tileable 64x64 blue noise threshold mask
+ REMARK:
+ Built once with the void-and-cluster method: starting from an empty mask, the pixel in
+ the largest void (lowest energy, where energy is a toroidal Gaussian sum over the
+ pixels already set) is set next and gets the next rank. Ranks of neighbouring pixels
+ are therefore as different as possible, so per-pixel offsets taken from the mask leave
+ high frequency, easily filtered, noise rather than clumps.
+ */
+class BlueNoiseMask
+{
+private:
+   std::vector<float> _values; // rank of each pixel scaled to [0, 1)
+
+public:
+   BlueNoiseMask()
+   {
+      const int N = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+      const int RADIUS = (int) std::ceil(3 * BLUE_NOISE_SIGMA);
+      std::vector<double> energy(N, 0.0);
+      std::vector<bool> set(N, false);
+      _values.resize(N);
+
+      for (int rank = 0; rank < N; rank++)
+      {
+         int best = -1;
+         for (int i = 0; i < N; i++)
+            if (!set[i] && (best < 0 || energy[i] < energy[best]))
+               best = i;
+
+         set[best] = true;
+         _values[best] = (rank + 0.5f) / N;
+
+         int bx = best % BLUE_NOISE_SIZE, by = best / BLUE_NOISE_SIZE;
+         for (int dy = -RADIUS; dy <= RADIUS; dy++)
+         {
+            for (int dx = -RADIUS; dx <= RADIUS; dx++)
+            {
+               int x = (bx + dx + BLUE_NOISE_SIZE) % BLUE_NOISE_SIZE;
+               int y = (by + dy + BLUE_NOISE_SIZE) % BLUE_NOISE_SIZE;
+               energy[y * BLUE_NOISE_SIZE + x] += std::exp(
+                     -(dx * dx + dy * dy) / (2 * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+            }
+         }
+      }
+   }
+
+   // value of the mask at pixel (x, y), tiled over the whole plane
+   float at(unsigned int x, unsigned int y) const
+   {
+      return _values[(y % BLUE_NOISE_SIZE) * BLUE_NOISE_SIZE + x % BLUE_NOISE_SIZE];
+   }
+
+   // the one mask shared by everybody, built the first time it is asked for
+   static const BlueNoiseMask& instance()
+   {
+      static const BlueNoiseMask mask;
+      return mask;
+   }
+};
+
+/*
+ PURPOSE: where in [0, 1)^2 to take each sample of each pixel
+ REMARK:
+ Samples are keyed on pixel, sample index and dimension rather than drawn from a
+ generator, so the same sample of the same pixel always lands on the same spot, however
+ many threads render and in whatever order they get to the pixels. Dimension 0 is the
+ jitter within the pixel; later dimensions are free for anything else a sample has to
+ pick, such as a point on an area light or a glossy reflection direction.
+ Sobol points are Owen scrambled per pixel and dimension, Halton points rotated by a
+ random offset per pixel and dimension (Cranley-Patterson). The blue noise sampler walks
+ the R2 sequence from an offset taken from a BlueNoiseMask, so that neighbouring pixels
+ make complementary errors. The random sampler is plain counter-based hashing.
+ */
+class Sampler
+{
+private:
+   SamplerType _type;
+   uint32_t _seed;
+
+public:
+   Sampler(SamplerType type = SOBOL_SAMPLER, uint32_t seed = 0)
+   {
+      _type = type;
+      _seed = seed;
+      if (type == BLUE_NOISE_SAMPLER)
+         BlueNoiseMask::instance();
+   }
+
+   SamplerType type() const
+   {
+      return _type;
+   }
+
+   /*
+    PURPOSE: gives a 2D sample point
+    RECEIVES:
+    x, y -- pixel the sample is for
+    index -- which sample of the pixel
+    dimension -- which pair of dimensions of the sample
+    u, v -- set to the point, both in [0, 1)
+    RETURNS: nothing
+    REMARKS:
+    */
+   void sample2D(unsigned int x, unsigned int y, uint32_t index, unsigned int dimension,
+         float& u, float& v) const
+   {
+      uint64_t key = pixelKey(_seed, x, y, dimension);
+      switch (_type)
+      {
+      case SOBOL_SAMPLER:
+      {
+         uint32_t s0, s1;
+         sobol2D(owenScramble(index, hashRandom(key, 0)), s0, s1);
+         u = toUnitFloat(owenScramble(s0, hashRandom(key, 1)));
+         v = toUnitFloat(owenScramble(s1, hashRandom(key, 2)));
+         break;
+      }
+      case HALTON_SAMPLER:
+      {
+         unsigned int d = (2 * dimension) % NUM_HALTON_PRIMES;
+         u = wrap(radicalInverse(index, HALTON_PRIMES[d]) + toUnitFloat(hashRandom(key, 0)));
+         v = wrap(radicalInverse(index, HALTON_PRIMES[d + 1])
+               + toUnitFloat(hashRandom(key, 1)));
+         break;
+      }
+      case BLUE_NOISE_SAMPLER:
+      {
+         // R2: the 2D generalisation of the golden ratio sequence
+         const double A1 = 0.7548776662466927, A2 = 0.5698402909980532;
+         const BlueNoiseMask& mask = BlueNoiseMask::instance();
+         unsigned int shift = dimension * 17; // other dimensions read other parts of the mask
+         u = wrap(index * A1 + mask.at(x + shift, y));
+         v = wrap(index * A2 + mask.at(x + BLUE_NOISE_SIZE / 2 + shift, y + BLUE_NOISE_SIZE / 2));
+         break;
+      }
+      default:
+      {
+         RandomStream random(key, 2 * index);
+         u = random.next();
+         v = random.next();
+         break;
+      }
+      }
+   }
+
+   // fractional part of a, as a float strictly below 1
+   static float wrap(double a)
+   {
+      float f = (float) (a - std::floor(a));
+      return f < 1.0f ? f : 0.0f;
+   }
+};
+
+#endif
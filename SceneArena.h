@@ -0,0 +1,194 @@
+#ifndef SCENEARENA_H
+#define SCENEARENA_H
+
+/*---------------------------------------------------------------------------*/
+/* INCLUDES */
+#include <vector>
+#include <new>
+#include <cstddef>
+#include <cstdlib>
+
+/*---------------------------------------------------------------------------*/
+/*  VARIABLES */
+const size_t ARENA_BLOCK_SIZE = 64 * 1024; // bytes asked of malloc at a time; small enough
+// that malloc keeps released blocks for the next scene rather than unmapping them
+const size_t ARENA_ALIGNMENT = alignof(std::max_align_t);
+
+/*---------------------------------------------------------------------------*/
+/* CLASS DEFINITIONS */
+/*
+ PURPOSE: memory for the objects of one scene, handed out from large blocks
+ REMARK:
+ Allocating just moves a pointer along the current block, so objects built one after
+ the other, such as a Cube, its Quads and their Triangles, end up next to each other.
+ Nothing is given back until the whole arena is released, which frees its blocks
+ without looking at the objects in them; whatever lives in an arena must therefore not
+ need its destructor run, see ArenaAllocator. Not thread safe; scenes are built on one
+ thread.
+ */
+class SceneArena
+{
+private:
+   std::vector<char *> _blocks;
+   char *_next; // where the next allocation goes in the last block
+   size_t _left; // bytes left after _next
+   size_t _used;
+
+   SceneArena(const SceneArena&);
+   SceneArena& operator=(const SceneArena&);
+
+   static SceneArena *& currentSlot()
+   {
+      thread_local SceneArena *current = 0;
+      return current;
+   }
+
+public:
+   SceneArena()
+   {
+      _next = 0;
+      _left = 0;
+      _used = 0;
+   }
+
+   ~SceneArena()
+   {
+      release();
+   }
+
+   /*
+    PURPOSE: hands out memory
+    RECEIVES: bytes -- how much
+    RETURNS: memory aligned for any type, which stays valid until release
+    REMARKS: anything larger than a quarter block gets a block of its own, so the
+    space left in the current one isn't wasted on it
+    */
+   void *allocate(size_t bytes)
+   {
+      bytes = (bytes + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+      _used += bytes;
+      if (bytes > ARENA_BLOCK_SIZE / 4)
+      {
+         char *block = (char *) malloc(bytes);
+         if (!block)
+            throw std::bad_alloc();
+         _blocks.push_back(block); // _next stays in the current block
+         return block;
+      }
+      if (bytes > _left)
+      {
+         _next = (char *) malloc(ARENA_BLOCK_SIZE);
+         if (!_next)
+            throw std::bad_alloc();
+         _blocks.push_back(_next);
+         _left = ARENA_BLOCK_SIZE;
+      }
+      void *p = _next;
+      _next += bytes;
+      _left -= bytes;
+      return p;
+   }
+
+   // frees everything allocated so far in one go; no destructors are run
+   void release()
+   {
+      for (size_t i = 0; i < _blocks.size(); i++)
+         free(_blocks[i]);
+      _blocks.clear();
+      _next = 0;
+      _left = 0;
+      _used = 0;
+   }
+
+   // bytes handed out since the last release
+   size_t used() const
+   {
+      return _used;
+   }
+
+   // the arena new scene objects go in on this thread, or 0 for the heap; see ArenaScope
+   static SceneArena *current()
+   {
+      return currentSlot();
+   }
+
+   friend class ArenaScope;
+};
+
+/*
+ PURPOSE: puts the scene objects created on this thread in an arena for as long as it lives
+ REMARK: scopes nest; when one ends the arena in use before it is current again
+ */
+class ArenaScope
+{
+private:
+   SceneArena *_previous;
+
+   ArenaScope(const ArenaScope&);
+   ArenaScope& operator=(const ArenaScope&);
+
+public:
+   ArenaScope(SceneArena& arena)
+   {
+      _previous = SceneArena::currentSlot();
+      SceneArena::currentSlot() = &arena;
+   }
+
+   ~ArenaScope()
+   {
+      SceneArena::currentSlot() = _previous;
+   }
+};
+
+/*
+ PURPOSE: allocator for the containers of scene objects
+ REMARK: takes its memory from the arena current when it was made, or from the heap if
+ there was none. Memory from an arena is never given back one piece at a time, so a
+ container in an arena needs no destructor.
+ */
+template<class T>
+class ArenaAllocator
+{
+public:
+   typedef T value_type;
+
+   SceneArena *arena;
+
+   ArenaAllocator() :
+         arena(SceneArena::current())
+   {
+   }
+
+   template<class U>
+   ArenaAllocator(const ArenaAllocator<U>& a) :
+         arena(a.arena)
+   {
+   }
+
+   T *allocate(size_t n)
+   {
+      if (arena)
+         return (T *) arena->allocate(n * sizeof(T));
+      return (T *) ::operator new(n * sizeof(T));
+   }
+
+   void deallocate(T *p, size_t)
+   {
+      if (!arena)
+         ::operator delete(p);
+   }
+};
+
+template<class T, class U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+   return a.arena == b.arena;
+}
+
+template<class T, class U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+   return a.arena != b.arena;
+}
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef SCENEARRAY_H
+#define SCENEARRAY_H
+
+/*---------------------------------------------------------------------------*/
+/* INCLUDES */
+#include <vector>
+#include <cstddef>
+
+/*---------------------------------------------------------------------------*/
+/* CLASS DEFINITIONS */
+/*
+ PURPOSE: array of plain values which either holds its elements itself or looks at
+ elements kept somewhere else, such as a memory mapped scene cache (see SceneCache.h)
+ REMARK:
+ Reading always goes through the one pointer, so whoever traces rays neither knows nor
+ pays for where the elements live. Changing a viewed array first copies the viewed
+ elements into an array of its own, except for clear, which just lets go of them. A
+ view does not keep what it looks at alive; whoever sets it up has to.
+ */
+template<class T>
+class SceneArray
+{
+private:
+   std::vector<T> _owned;
+   const T *_data; // first element, in _owned or wherever the view looks
+   size_t _size;
+   bool _viewing;
+
+   // points _data at _owned again after _owned changed
+   void update()
+   {
+      _data = _owned.empty() ? 0 : &_owned[0];
+      _size = _owned.size();
+   }
+
+   // copies viewed elements so they can be changed
+   void own()
+   {
+      if (_viewing)
+      {
+         _owned.assign(_data, _data + _size);
+         _viewing = false;
+         update();
+      }
+   }
+
+public:
+   SceneArray()
+   {
+      _data = 0;
+      _size = 0;
+      _viewing = false;
+   }
+
+   SceneArray(const SceneArray& a) :
+         _owned(a._owned)
+   {
+      _viewing = a._viewing;
+      if (_viewing)
+      {
+         _data = a._data;
+         _size = a._size;
+      }
+      else
+         update();
+   }
+
+   SceneArray& operator=(const SceneArray& a)
+   {
+      if (this != &a)
+      {
+         _owned = a._owned;
+         _viewing = a._viewing;
+         if (_viewing)
+         {
+            _data = a._data;
+            _size = a._size;
+         }
+         else
+            update();
+      }
+      return *this;
+   }
+
+   size_t size() const
+   {
+      return _size;
+   }
+   bool empty() const
+   {
+      return _size == 0;
+   }
+   const T *data() const
+   {
+      return _data;
+   }
+   // true if the elements are somebody else's
+   bool isView() const
+   {
+      return _viewing;
+   }
+
+   const T& operator[](size_t i) const
+   {
+      return _data[i];
+   }
+   T& operator[](size_t i)
+   {
+      own();
+      return _owned[i];
+   }
+
+   void push_back(const T& value)
+   {
+      own();
+      _owned.push_back(value);
+      update();
+   }
+   void resize(size_t size, const T& value = T())
+   {
+      own();
+      _owned.resize(size, value);
+      update();
+   }
+   void reserve(size_t size)
+   {
+      own();
+      _owned.reserve(size);
+      update();
+   }
+   void clear()
+   {
+      _owned.clear();
+      _viewing = false;
+      update();
+   }
+
+   // takes over the elements of v, leaving v with the ones this had
+   void swap(std::vector<T>& v)
+   {
+      own();
+      _owned.swap(v);
+      update();
+   }
+
+   // lets go of the elements and looks at size elements from data on instead
+   void view(const T *data, size_t size)
+   {
+      std::vector<T>().swap(_owned);
+      _data = size > 0 ? data : 0;
+      _size = size;
+      _viewing = true;
+   }
+};
+
+#endif
@@ -0,0 +1,455 @@
+#ifndef SCENECACHE_H
+#define SCENECACHE_H
+
+/*---------------------------------------------------------------------------*/
+/* INCLUDES */
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cassert>
+#include <memory>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "CompiledScene.h"
+#include "SceneFile.h"
+
+/*---------------------------------------------------------------------------*/
+/*  VARIABLES */
+const uint32_t SCENE_CACHE_VERSION = 4; // bump whenever the layout of anything cached changes
+const char SCENE_CACHE_MAGIC[8] = "RTSCENE";
+const uint64_t SCENE_CACHE_ALIGNMENT = 64; // sections start on cache line boundaries
+
+// one section per SceneArray of the CompiledScene (see SceneCache::visitArrays), then
+// the material table, the lights and the camera
+const unsigned int SCENE_CACHE_ARRAYS = 74;
+const unsigned int SCENE_CACHE_SECTIONS = SCENE_CACHE_ARRAYS + 3;
+
+/*---------------------------------------------------------------------------*/
+/* CLASS DEFINITIONS */
+// where in the file one array lives; count is in elements
+struct SceneCacheSection
+{
+   uint64_t offset;
+   uint64_t count;
+};
+
+/*
+ PURPOSE: start of a scene cache file
+ REMARK: a cache is only good for the build which wrote it, since the arrays are the
+ CompiledScene's in-memory layout: the same Real, the same batch padding and the same
+ byte order
+ */
+struct SceneCacheHeader
+{
+   char magic[8];
+   uint32_t version;
+   uint32_t realSize; // sizeof(Real)
+   uint32_t batchWidth; // TRIANGLE_BATCH_WIDTH
+   uint32_t padding; // keeps sourceHash 8 byte aligned
+   uint64_t sourceHash; // of the scene file the cache was made from
+   SceneCacheSection sections[SCENE_CACHE_SECTIONS];
+};
+
+// how Materials, Lights and the camera are kept in the file; there are few of them, so
+// they are copied out rather than used in place
+struct CachedMaterial
+{
+   Real ambient[3];
+   Real diffuse[3];
+   Real specular[3];
+   Real transparency[3];
+   Real refraction;
+};
+
+struct CachedLight
+{
+   Real color[3];
+   Real position[3];
+};
+
+struct CachedCamera
+{
+   Real position[3];
+   Real lookAt[3];
+   Real up[3];
+};
+
+/*
+ PURPOSE: saves a compiled scene to a file which can later be mapped into memory and
+ traced straight away
+ REMARK:
+ The file is a SceneCacheHeader followed by every array of the CompiledScene, the Bvh
+ included, exactly as they are laid out in memory, each starting on a
+ SCENE_CACHE_ALIGNMENT boundary. Loading maps the file read only and points the
+ scene's SceneArrays into the mapping, so nothing is parsed, built or even read up
+ front: the pages come in as the first rays touch them. Only the few materials, lights
+ and the camera are copied. Caches are named after a hash of the scene file they were
+ made from and of the build, so an edited file or another build simply misses.
+ */
+class SceneCache
+{
+private:
+   // sizes the sections while saving
+   struct Layout
+   {
+      SceneCacheSection *sections;
+      vector<const void *> data;
+      vector<uint64_t> bytes;
+      uint64_t end;
+
+      template<class T>
+      void operator()(const SceneArray<T>& a)
+      {
+         add(a.data(), a.size(), sizeof(T));
+      }
+
+      void add(const void *p, uint64_t count, uint64_t elementSize)
+      {
+         assert(data.size() < SCENE_CACHE_SECTIONS); // see SCENE_CACHE_ARRAYS
+         SceneCacheSection& s = sections[data.size()];
+         s.offset = (end + SCENE_CACHE_ALIGNMENT - 1) / SCENE_CACHE_ALIGNMENT
+               * SCENE_CACHE_ALIGNMENT;
+         s.count = count;
+         end = s.offset + count * elementSize;
+         data.push_back(p);
+         bytes.push_back(count * elementSize);
+      }
+   };
+
+   // checks the sections of a mapped file fit in it, then points the arrays at them
+   struct Mapper
+   {
+      const char *base;
+      uint64_t size;
+      const SceneCacheSection *sections;
+      unsigned int next;
+      bool apply;
+      bool ok;
+
+      template<class T>
+      void operator()(SceneArray<T>& a)
+      {
+         assert(next < SCENE_CACHE_ARRAYS);
+         const SceneCacheSection& s = sections[next++];
+         if (!apply)
+            ok = ok && fits(s, sizeof(T));
+         else
+            a.view((const T *) (base + s.offset), s.count);
+      }
+
+      bool fits(const SceneCacheSection& s, uint64_t elementSize) const
+      {
+         return s.offset % SCENE_CACHE_ALIGNMENT == 0 && s.offset <= size
+               && s.count <= (size - s.offset) / elementSize;
+      }
+   };
+
+   // unmaps the file once the last scene looking into it lets go
+   struct Unmapper
+   {
+      size_t size;
+
+      void operator()(const void *p) const
+      {
+         munmap(const_cast<void *>(p), size);
+      }
+   };
+
+   // calls visit on the arrays of a set of triangles, 18 of them
+   template<class Triangles, class Visitor>
+   static void visitTriangles(Triangles& triangles, Visitor& visit)
+   {
+      for (int a = 0; a < 3; a++)
+      {
+         visit(triangles.v0[a]);
+         visit(triangles.u[a]);
+         visit(triangles.v[a]);
+         visit(triangles.n[a]);
+      }
+      visit(triangles.uu);
+      visit(triangles.uv);
+      visit(triangles.vv);
+      visit(triangles.denominator);
+      visit(triangles.minDeterminant);
+      visit(triangles.material);
+   }
+
+   /*
+    PURPOSE: calls visit on every array of a scene, always in the same order
+    RECEIVES:
+    scene -- CompiledScene, const when saving
+    visit -- called with each SceneArray in turn
+    RETURNS: nothing
+    REMARKS: this order is the order of the sections in the file; there are
+    SCENE_CACHE_ARRAYS of them, which save and load assert
+    */
+   template<class Scene, class Visitor>
+   static void visitArrays(Scene& scene, Visitor& visit)
+   {
+      visitTriangles(scene._triangles, visit);
+
+      for (int a = 0; a < 3; a++)
+         visit(scene._spheres.center[a]);
+      visit(scene._spheres.radius);
+      visit(scene._spheres.material);
+
+      for (int a = 0; a < 3; a++)
+      {
+         visit(scene._boxes.lo[a]);
+         visit(scene._boxes.hi[a]);
+      }
+      visit(scene._boxes.material);
+
+      for (int a = 0; a < 3; a++)
+         visit(scene._cones.base[a]);
+      visit(scene._cones.height);
+      visit(scene._cones.bottomRadius);
+      visit(scene._cones.topRadius);
+      visit(scene._cones.material);
+
+      visit(scene._boards.originX);
+      visit(scene._boards.originZ);
+      visit(scene._boards.height);
+      visit(scene._boards.edgeSize);
+      visit(scene._boards.squareSize);
+      visit(scene._boards.whiteMaterial);
+      visit(scene._boards.blackMaterial);
+
+      for (int a = 0; a < 3; a++)
+         visit(scene._instances.position[a]);
+      visit(scene._instances.scale);
+      visit(scene._instances.prototype);
+      visit(scene._instances.material);
+
+      visitTriangles(scene._prototypes.triangles, visit);
+      visit(scene._prototypes.nodes);
+      visit(scene._prototypes.root);
+
+      visit(scene._primitives);
+      visit(scene._shadowKinds);
+      visit(scene._bvh._nodes);
+      visit(scene._bvh._indices);
+   }
+
+   static void copyPoint(const Point& p, Real out[3])
+   {
+      out[0] = p.x();
+      out[1] = p.y();
+      out[2] = p.z();
+   }
+
+   static Point toPoint(const Real p[3])
+   {
+      return Point(p[0], p[1], p[2]);
+   }
+
+public:
+   /*
+    PURPOSE: where the cache of a scene file lives
+    RECEIVES:
+    directory -- directory caches are kept in
+    sourceHash -- hash of the scene file, see hashSceneText
+    RETURNS: the path of the cache file
+    REMARKS: the name also depends on the layout version, Real and the batch width, so
+    differently built programs keep their caches side by side
+    */
+   static string path(const char *directory, uint64_t sourceHash)
+   {
+      uint64_t build = (uint64_t) SCENE_CACHE_VERSION << 16 | sizeof(Real) << 8
+            | TRIANGLE_BATCH_WIDTH;
+      char name[32];
+      snprintf(name, sizeof(name), "%016llx.cache",
+            (unsigned long long) mixBits(sourceHash ^ mixBits(build)));
+      return string(directory) + "/" + name;
+   }
+
+   /*
+    PURPOSE: writes a compiled scene to a cache file
+    RECEIVES:
+    filename -- file to write; its directory is made if it isn't there
+    sourceHash -- hash of the scene file the scene was loaded from
+    scene, lights, camera -- what to save
+    RETURNS: true if the file was written
+    REMARKS: the file is written under a temporary name of its own (mkstemp) and
+    renamed when complete, so a program starting at the same time never maps half a
+    cache and processes or threads saving the same scene at once don't write into each
+    other's files; the last rename wins
+    */
+   static bool save(const char *filename, uint64_t sourceHash, const CompiledScene& scene,
+         const vector<Light>& lights, const SceneCamera& camera)
+   {
+      string directory(filename);
+      size_t slash = directory.rfind('/');
+      if (slash != string::npos && slash > 0)
+         mkdir(directory.substr(0, slash).c_str(), 0777);
+
+      SceneCacheHeader header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic));
+      header.version = SCENE_CACHE_VERSION;
+      header.realSize = sizeof(Real);
+      header.batchWidth = TRIANGLE_BATCH_WIDTH;
+      header.sourceHash = sourceHash;
+
+      vector<CachedMaterial> materials(scene._materials.size());
+      for (size_t i = 0; i < materials.size(); i++)
+      {
+         const Material& m = scene._materials[i];
+         copyPoint(m.ambient(), materials[i].ambient);
+         copyPoint(m.diffuse(), materials[i].diffuse);
+         copyPoint(m.specular(), materials[i].specular);
+         copyPoint(m.transparency(), materials[i].transparency);
+         materials[i].refraction = m.refraction();
+      }
+      vector<CachedLight> cachedLights(lights.size());
+      for (size_t i = 0; i < lights.size(); i++)
+      {
+         copyPoint(lights[i].color(), cachedLights[i].color);
+         copyPoint(lights[i].position(), cachedLights[i].position);
+      }
+      CachedCamera cachedCamera;
+      copyPoint(camera.position, cachedCamera.position);
+      copyPoint(camera.lookAt, cachedCamera.lookAt);
+      copyPoint(camera.up, cachedCamera.up);
+
+      Layout layout;
+      layout.sections = header.sections;
+      layout.end = sizeof(header);
+      visitArrays(scene, layout);
+      assert(layout.data.size() == SCENE_CACHE_ARRAYS);
+      layout.add(materials.empty() ? 0 : &materials[0], materials.size(),
+            sizeof(CachedMaterial));
+      layout.add(cachedLights.empty() ? 0 : &cachedLights[0], cachedLights.size(),
+            sizeof(CachedLight));
+      layout.add(&cachedCamera, 1, sizeof(CachedCamera));
+
+      string temporary = string(filename) + ".XXXXXX";
+      int fd = mkstemp(&temporary[0]);
+      if (fd < 0)
+         return false;
+      fchmod(fd, 0644); // mkstemp makes it readable by its owner only
+      FILE *file = fdopen(fd, "wb");
+      if (!file)
+      {
+         close(fd);
+         remove(temporary.c_str());
+         return false;
+      }
+      bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+      uint64_t at = sizeof(header);
+      const char zeros[SCENE_CACHE_ALIGNMENT] = { 0 };
+      for (unsigned int i = 0; i < SCENE_CACHE_SECTIONS && ok; i++)
+      {
+         uint64_t padding = header.sections[i].offset - at;
+         ok = fwrite(zeros, 1, padding, file) == padding
+               && fwrite(layout.data[i], 1, layout.bytes[i], file) == layout.bytes[i];
+         at = header.sections[i].offset + layout.bytes[i];
+      }
+      ok = fclose(file) == 0 && ok;
+      if (ok)
+         ok = rename(temporary.c_str(), filename) == 0;
+      if (!ok)
+         remove(temporary.c_str());
+      return ok;
+   }
+
+   /*
+    PURPOSE: maps a cache file and points a scene's arrays into it
+    RECEIVES:
+    filename -- cache file, as named by path
+    sourceHash -- hash of the scene file the cache has to have been made from
+    scene -- set to the cached scene
+    lights -- set to the cached lights
+    camera -- set to the cached camera
+    RETURNS: true if the cache was there and good; if not nothing is changed
+    REMARKS: the mapping stays until the scene is next compiled or loaded. Whatever
+    changed since the last compile, every pixel counts as changed (see changedBounds).
+    */
+   static bool load(const char *filename, uint64_t sourceHash, CompiledScene& scene,
+         vector<Light>& lights, SceneCamera& camera)
+   {
+      int fd = open(filename, O_RDONLY);
+      if (fd < 0)
+         return false;
+      struct stat info;
+      if (fstat(fd, &info) != 0 || (uint64_t) info.st_size < sizeof(SceneCacheHeader))
+      {
+         close(fd);
+         return false;
+      }
+      size_t size = info.st_size;
+      void *base = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (base == MAP_FAILED)
+         return false;
+      std::shared_ptr<const void> mapping(base, Unmapper { size });
+
+      const SceneCacheHeader& header = *(const SceneCacheHeader *) base;
+      if (memcmp(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic)) != 0
+            || header.version != SCENE_CACHE_VERSION || header.realSize != sizeof(Real)
+            || header.batchWidth != TRIANGLE_BATCH_WIDTH || header.sourceHash != sourceHash)
+         return false;
+
+      Mapper mapper;
+      mapper.base = (const char *) base;
+      mapper.size = size;
+      mapper.sections = header.sections;
+      mapper.next = 0;
+      mapper.apply = false;
+      mapper.ok = true;
+      visitArrays(scene, mapper);
+      assert(mapper.next == SCENE_CACHE_ARRAYS);
+      const SceneCacheSection *extras = header.sections + SCENE_CACHE_ARRAYS;
+      if (!mapper.ok || !mapper.fits(extras[0], sizeof(CachedMaterial))
+            || !mapper.fits(extras[1], sizeof(CachedLight))
+            || !mapper.fits(extras[2], sizeof(CachedCamera)) || extras[2].count != 1)
+         return false;
+
+      // start fetching the pages now so fewer of the first rays wait for the disk
+      madvise(base, size, MADV_WILLNEED);
+
+      mapper.next = 0;
+      mapper.apply = true;
+      visitArrays(scene, mapper);
+
+      const CachedMaterial *materials = (const CachedMaterial *) (mapper.base
+            + extras[0].offset);
+      scene._materials.clear();
+      for (uint64_t i = 0; i < extras[0].count; i++)
+         scene._materials.push_back(Material(toPoint(materials[i].ambient),
+               toPoint(materials[i].diffuse), toPoint(materials[i].specular),
+               toPoint(materials[i].transparency), materials[i].refraction));
+
+      const CachedLight *cachedLights = (const CachedLight *) (mapper.base
+            + extras[1].offset);
+      lights.clear();
+      for (uint64_t i = 0; i < extras[1].count; i++)
+         lights.push_back(Light(toPoint(cachedLights[i].color),
+               toPoint(cachedLights[i].position)));
+
+      const CachedCamera& cachedCamera = *(const CachedCamera *) (mapper.base
+            + extras[2].offset);
+      camera.position = toPoint(cachedCamera.position);
+      camera.lookAt = toPoint(cachedCamera.lookAt);
+      camera.up = toPoint(cachedCamera.up);
+
+      scene._version++;
+      scene._compileMillis = 0;
+      scene._bvh._buildMillis = 0;
+      scene._signatures.clear();
+      scene._prototypeNames.clear(); // the next compile starts the prototypes afresh anyway
+      scene._changedBounds.clear();
+      const SceneArray<BvhNode>& nodes = scene._bvh._nodes; // const, so nothing is copied
+      if (!nodes.empty())
+         scene._changedBounds.push_back(nodes[0].box);
+      scene._mapping = mapping;
+      return true;
+   }
+};
+
+#endif
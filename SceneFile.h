@@ -0,0 +1,438 @@
+#ifndef SCENEFILE_H
+#define SCENEFILE_H
+
+/*---------------------------------------------------------------------------*/
+/* INCLUDES */
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <chrono>
+#include <stdexcept>
+#include "Objects.h"
+#include "Sampler.h"
+
+/*
+ Scene files describe a scene as text, one item per line. Everything after a # is a
+ comment; words are separated by spaces or tabs. Coordinates are scene coordinates,
+ the same ones the camera and lights use. Items are:
+
+ camera px py pz  lx ly lz  ux uy uz -- position, look-at point and up direction
+ material name  ar ag ab  dr dg db  sr sg sb  tr tg tb  refraction
+    -- ambient, diffuse, specular and transparency colours and refractive index
+ light x y z [r g b] -- a light, white unless a colour is given
+ board x y z -- a checker board centred on the given point
+ sphere x y z radius [material]
+ cube x y z edge [material]
+ tetrahedron x y z edge [material]
+ cone x y z radius height [material] -- upright, pointed at the top
+ cylinder x y z radius height [material] -- upright
+
+ Objects are centred on the point given. Materials must be defined before they are
+ used, and sizes must be positive. The materials of the interactive scene are predefined
+ as sphere, cube, tetrahedron, cone, cylinder, white and black, and are what objects
+ are made of when no material is named.
+ */
+
+/*---------------------------------------------------------------------------*/
+/* CLASS DEFINITIONS */
+/*
+ PURPOSE: where a scene file puts the camera
+ REMARK: starts out as the camera of the interactive scene
+ */
+struct SceneCamera
+{
+   Point position;
+   Point lookAt;
+   Point up;
+
+   SceneCamera() :
+         position(CAMERA_POSITION), lookAt(LOOK_AT_VECTOR), up(UP_VECTOR)
+   {
+   }
+};
+
+/*
+ PURPOSE: what loading a scene file found and how long it took
+ REMARK:
+ */
+struct SceneFileStats
+{
+   size_t bytes;
+   size_t lines;
+   size_t objects;
+   size_t lights;
+   size_t materials;
+   double millis;
+   uint64_t hash; // of the text, see hashSceneText
+
+   SceneFileStats()
+   {
+      bytes = lines = objects = lights = materials = 0;
+      millis = 0;
+      hash = 0;
+   }
+};
+
+/*
+ PURPOSE: reads the items of a scene file held in memory
+ REMARK:
+ Single pass over the text with a cursor: words and numbers are picked out where they
+ lie rather than copied into strings, and numbers are converted by hand, so parsing
+ allocates nothing beyond the objects it builds and a string per material name.
+ Errors throw runtime_error naming the file and line.
+ */
+class SceneParser
+{
+private:
+   struct NamedMaterial
+   {
+      string name;
+      Material material;
+   };
+
+   const char *_cursor;
+   const char *_end;
+   const char *_filename;
+   size_t _line;
+   vector<NamedMaterial> _materials; // few enough that looking them up linearly does
+
+   void skipBlanks()
+   {
+      while (_cursor < _end && (*_cursor == ' ' || *_cursor == '\t' || *_cursor == '\r'))
+         _cursor++;
+      if (_cursor < _end && *_cursor == '#')
+         while (_cursor < _end && *_cursor != '\n')
+            _cursor++;
+   }
+
+   bool atLineEnd()
+   {
+      skipBlanks();
+      return _cursor == _end || *_cursor == '\n';
+   }
+
+   // the next word, which is not copied; length is set to its length
+   const char *word(size_t& length)
+   {
+      skipBlanks();
+      const char *start = _cursor;
+      while (_cursor < _end && *_cursor != ' ' && *_cursor != '\t' && *_cursor != '\r'
+            && *_cursor != '\n' && *_cursor != '#')
+         _cursor++;
+      length = _cursor - start;
+      return start;
+   }
+
+   static bool isWord(const char *w, size_t length, const char *keyword)
+   {
+      return strlen(keyword) == length && memcmp(w, keyword, length) == 0;
+   }
+
+   Real number()
+   {
+      skipBlanks();
+      const char *p = _cursor;
+      bool negative = false;
+      if (p < _end && (*p == '-' || *p == '+'))
+         negative = *p++ == '-';
+
+      double value = 0;
+      bool digits = false;
+      for (; p < _end && *p >= '0' && *p <= '9'; p++, digits = true)
+         value = 10 * value + (*p - '0');
+      if (p < _end && *p == '.')
+      {
+         double scale = .1;
+         for (p++; p < _end && *p >= '0' && *p <= '9'; p++, scale *= .1, digits = true)
+            value += (*p - '0') * scale;
+      }
+      if (!digits)
+         fail("number expected");
+      if (p < _end && (*p == 'e' || *p == 'E'))
+      {
+         p++;
+         bool negativeExponent = false;
+         if (p < _end && (*p == '-' || *p == '+'))
+            negativeExponent = *p++ == '-';
+         int exponent = 0;
+         for (; p < _end && *p >= '0' && *p <= '9'; p++)
+            if (exponent < 10000) // far past the range of a double already
+               exponent = 10 * exponent + (*p - '0');
+         value *= pow(10.0, negativeExponent ? -exponent : exponent);
+      }
+      // a value too large for a Real would turn into infinity, and sizes and positions
+      // of it into infinite bounds
+      if (!isfinite(value) || value > numeric_limits<Real>::max())
+         fail("number out of range");
+      _cursor = p;
+      return negative ? -value : value;
+   }
+
+   Point point()
+   {
+      Real x = number();
+      Real y = number();
+      Real z = number();
+      return Point(x, y, z);
+   }
+
+   // a number which has to be above zero, like a size; what names it in the error
+   Real positiveNumber(const char *what)
+   {
+      Real value = number();
+      if (!(value > 0))
+         fail(string(what) + " must be positive");
+      return value;
+   }
+
+   // the material named by an optional last word, or fallback if there is none
+   const Material& optionalMaterial(const Material& fallback)
+   {
+      if (atLineEnd())
+         return fallback;
+      size_t length;
+      const char *name = word(length);
+      for (size_t i = 0; i < _materials.size(); i++)
+         if (_materials[i].name.size() == length
+               && memcmp(_materials[i].name.data(), name, length) == 0)
+            return _materials[i].material;
+      fail("unknown material " + string(name, length));
+      return fallback;
+   }
+
+   void defineMaterial(const string& name, const Material& m)
+   {
+      for (size_t i = 0; i < _materials.size(); i++)
+      {
+         if (_materials[i].name == name)
+         {
+            _materials[i] = NamedMaterial{name, m};
+            return;
+         }
+      }
+      _materials.push_back(NamedMaterial{name, m});
+   }
+
+   void fail(const string& message)
+   {
+      char where[32];
+      snprintf(where, sizeof(where), ":%lu: ", (unsigned long) _line);
+      throw runtime_error(_filename + string(where) + message);
+   }
+
+public:
+   SceneParser(const char *text, size_t size, const char *filename)
+   {
+      _cursor = text;
+      _end = text + size;
+      _filename = filename;
+      _line = 0;
+      defineMaterial("sphere", sphereMaterial);
+      defineMaterial("cube", cubeMaterial);
+      defineMaterial("tetrahedron", tetrahedronMaterial);
+      defineMaterial("cone", coneMaterial);
+      defineMaterial("cylinder", cylinderMaterial);
+      defineMaterial("white", whiteSquare);
+      defineMaterial("black", blackSquare);
+   }
+
+   /*
+    PURPOSE: reads every item of the text
+    RECEIVES:
+    root -- Shape to add the objects to
+    lights -- where to add the lights
+    camera -- set if there is a camera item
+    stats -- counts of what was read are added to it
+    RETURNS: nothing
+    REMARKS: objects are positioned relative to root, so they end up where the file says
+    in scene coordinates wherever root is
+    */
+   void parse(Shape& root, vector<Light>& lights, SceneCamera& camera,
+         SceneFileStats& stats)
+   {
+      Point origin = root.position();
+      size_t length;
+      while (_cursor < _end)
+      {
+         _line++;
+         const char *w = word(length);
+         if (length == 0)
+            ;
+         else if (isWord(w, length, "sphere"))
+         {
+            Point p = point() - origin;
+            Real radius = positiveNumber("radius");
+            root.addRayObject(new Sphere(p, radius, optionalMaterial(sphereMaterial)));
+            stats.objects++;
+         }
+         else if (isWord(w, length, "cube"))
+         {
+            Point p = point() - origin;
+            Real edge = positiveNumber("edge");
+            root.addRayObject(new Cube(p, edge, optionalMaterial(cubeMaterial)));
+            stats.objects++;
+         }
+         else if (isWord(w, length, "tetrahedron"))
+         {
+            Point p = point() - origin;
+            Real edge = positiveNumber("edge");
+            root.addRayObject(new Tetrahedron(p, edge, optionalMaterial(tetrahedronMaterial)));
+            stats.objects++;
+         }
+         else if (isWord(w, length, "cone"))
+         {
+            Point p = point() - origin;
+            Real radius = positiveNumber("radius");
+            Real height = positiveNumber("height");
+            root.addRayObject(new Cone(p, radius, height, optionalMaterial(coneMaterial)));
+            stats.objects++;
+         }
+         else if (isWord(w, length, "cylinder"))
+         {
+            Point p = point() - origin;
+            Real radius = positiveNumber("radius");
+            Real height = positiveNumber("height");
+            root.addRayObject(new Cylinder(p, radius, height,
+                  optionalMaterial(cylinderMaterial)));
+            stats.objects++;
+         }
+         else if (isWord(w, length, "light"))
+         {
+            Point p = point();
+            Point color = lightColor;
+            if (!atLineEnd())
+               color = point();
+            lights.push_back(Light(color, p));
+            stats.lights++;
+         }
+         else if (isWord(w, length, "material"))
+         {
+            const char *name = word(length);
+            if (length == 0)
+               fail("material name expected");
+            string materialName(name, length);
+            Point ambient = point();
+            Point diffuse = point();
+            Point specular = point();
+            Point transparency = point();
+            Real refraction = number();
+            defineMaterial(materialName,
+                  Material(ambient, diffuse, specular, transparency, refraction));
+            stats.materials++;
+         }
+         else if (isWord(w, length, "board"))
+         {
+            root.addRayObject(new CheckerBoard(point() - origin));
+            stats.objects++;
+         }
+         else if (isWord(w, length, "camera"))
+         {
+            camera.position = point();
+            camera.lookAt = point();
+            camera.up = point();
+         }
+         else
+            fail("unknown item " + string(w, length));
+
+         if (!atLineEnd())
+            fail("unexpected " + string(word(length), length));
+         if (_cursor < _end)
+            _cursor++; // past the newline
+      }
+      stats.lines += _line;
+   }
+};
+
+/*---------------------------------------------------------------------------*/
+/* FUNCTIONS */
+/*
+ PURPOSE: reads a whole scene file into memory
+ RECEIVES:
+ filename -- file to read
+ text -- set to its contents
+ RETURNS: nothing
+ REMARKS: throws runtime_error if the file can't be read
+ */
+inline void readSceneText(const char *filename, vector<char>& text)
+{
+   FILE *file = fopen(filename, "rb");
+   if (!file)
+      throw runtime_error(string("can't open scene file ") + filename);
+   long size = -1;
+   if (fseek(file, 0, SEEK_END) == 0)
+      size = ftell(file);
+   if (size < 0 || fseek(file, 0, SEEK_SET) != 0)
+   {
+      fclose(file);
+      throw runtime_error(string("can't read scene file ") + filename
+            + ": it has to be a file, not a pipe");
+   }
+   text.resize(size);
+   size_t got = text.empty() ? 0 : fread(&text[0], 1, text.size(), file);
+   fclose(file);
+   if (got != text.size())
+      throw runtime_error(string("can't read scene file ") + filename);
+}
+
+/*
+ PURPOSE: hashes the text of a scene file
+ RECEIVES: text, size -- the text
+ RETURNS: a 64 bit hash of it
+ REMARKS: eight bytes at a time, so hashing costs next to nothing beside reading the
+ file. Used to tell whether a scene cache was made from the same file.
+ */
+inline uint64_t hashSceneText(const char *text, size_t size)
+{
+   uint64_t h = mixBits(size);
+   size_t i = 0;
+   for (; i + 8 <= size; i += 8)
+   {
+      uint64_t word;
+      memcpy(&word, text + i, 8);
+      h = mixBits(h ^ word);
+   }
+   uint64_t rest = 0;
+   memcpy(&rest, text + i, size - i);
+   return mixBits(h ^ rest);
+}
+
+// hash of a scene file's text, as loadSceneFile puts in SceneFileStats
+inline uint64_t hashSceneFile(const char *filename)
+{
+   vector<char> text;
+   readSceneText(filename, text);
+   return hashSceneText(text.empty() ? "" : &text[0], text.size());
+}
+
+/*
+ PURPOSE: loads a scene file
+ RECEIVES:
+ filename -- file to read
+ root -- Shape to add the objects to
+ lights -- where to add the lights
+ camera -- set if the file has a camera
+ stats -- filled in with what was loaded and how long reading and building it took
+ RETURNS: nothing
+ REMARKS: the file is read into memory in one go and then parsed in place, see
+ SceneParser. Throws runtime_error if the file can't be read or has an error in it.
+ */
+inline void loadSceneFile(const char *filename, Shape& root, vector<Light>& lights,
+      SceneCamera& camera, SceneFileStats& stats)
+{
+   chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+   vector<char> text;
+   readSceneText(filename, text);
+
+   stats = SceneFileStats();
+   stats.bytes = text.size();
+   stats.hash = hashSceneText(text.empty() ? "" : &text[0], text.size());
+   SceneParser parser(text.empty() ? "" : &text[0], text.size(), filename);
+   parser.parse(root, lights, camera, stats);
+   stats.millis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+#endif
@@ -1,16 +1,28 @@
 /*---------------------------------------------------------------------------*/
 /* INCLUDES */
 #include "SdlApp.h"
-#include "Objects.h"
+#include "RayTracer.h"
+#include "SceneCache.h"
 
 /*---------------------------------------------------------------------------*/
 /* GLOBALS */
 
 
 vector<Light> lights;
+CompiledScene compiledScene; // scene flattened for the renderer, recompiled whenever scene changes
 int redoMenu = 0; //This allows user to redo menu 
 vector<Point> currentPosition; //This is the current positions in the scene
 static ShaderState *g_shader;// our global shader states
+static ThreadPool *g_renderPool; // worker threads used by the ray tracer
+static bool g_useCpuTracer = false; // trace the scene on the CPU instead of in the fragment shader
+static FrameBuffer g_frame; // where the CPU tracer puts its pixels
+static ProgressiveRenderer g_progressive; // samples accumulated into g_frame so far
+static SamplingSettings g_sampling; // how many samples per pixel the CPU tracer takes
+static const char *g_sampleMapFile = 0; // where to write each frame's sample counts, if anywhere
+static const char *g_sceneFile = 0; // scene to load instead of the empty board, if any
+static SceneCamera g_camera; // where the CPU tracer looks from
+static const char *g_cacheDir = 0; // where compiled scene files are cached, if anywhere
+static const char *g_countersFile = 0; // where to write each frame's trace counters, if anywhere
 
 //static const int G_NUM_SHADERS = 1;
 //changed array sizes from 3 to 2, revert if things break.
@@ -18,6 +30,15 @@ static ShaderState *g_shader;// our global shader states
 static const char * const G_SHADER_FILES[2] = 
 	{"./shaders/basic-gl3.vshader", "./shaders/square-test-gl3.fshader"};
 
+// shows the CPU tracer's FrameBuffer as a textured full-screen quad
+static const char * const G_PRESENT_SHADER_FILES[2] =
+	{"./shaders/basic-gl3.vshader", "./shaders/present-gl3.fshader"};
+static ShaderState *g_presentShader;
+static GLint g_presentTexUnit; // handle to uTexUnit0 of the present shader
+static GlTexture *g_frameTexture;
+static GlBufferObject *g_framePbo; // pixel buffer object the frame is streamed through
+static int g_frameTextureWidth = 0, g_frameTextureHeight = 0;
+
 
 // --------- Geometry
 static GLfloat g_eyePosition[3] = { 0.0, 0.0, 1.0};
@@ -34,6 +55,7 @@ static int g_windowWidth = 512;
 static int g_windowHeight = 512;
 
 static Geometry *g_plane;
+static Geometry *g_screenQuad;
 
 
 /*
@@ -161,214 +183,49 @@ static void drawStuff()
     g_plane->draw(*g_shader);
 }
 
-/*---------------------------------------------------------------------------*/
-/* FUNCTIONS */
-/*
- PURPOSE: multiplies the supplied point vector by the scalar amount
- RECEIVES:
- p - Point vector (x,y,z)
- scalar -- the scalar `a' to multiply by
- RETURNS:
- the point vector
- (a*x, a*y, a*z)
- REMARKS:
- */
-Point operator*(GLdouble scalar, const Point& p)
-{
-	return Point(scalar * p._x, scalar * p._y, scalar * p._z);
-}
-
 /*
- PURPOSE: multiplies the supplied point vector by the scalar amount
- RECEIVES:
- p - Point vector (x,y,z)
- scalar -- the scalar `a' to multiply by
- RETURNS:
- the point vector
- (a*x, a*y, a*z)
- REMARKS:
- */
-Point operator*(const Point& p, GLdouble scalar)
-{
-	return Point(scalar * p._x, scalar * p._y, scalar * p._z);
-}
-
-/*
- PURPOSE: generate a random vector of length 1
- RECEIVES: Nothing
+ PURPOSE: copies a FrameBuffer into the frame texture and draws it over the whole window
+ RECEIVES: frame -- the pixels to show
  RETURNS: Nothing
- REMARKS:
+ REMARKS: the pixels are written into a freshly orphaned pixel buffer object and the
+ texture is filled from that, so the copy into GL memory is a single memcpy and the
+ driver can do the texture transfer without stalling on the previous frame's upload
  */
-Point randomlyPoint()
+static void presentFrame(const FrameBuffer& frame)
 {
-	//generate random point within unit sphere
-	Point vec(0.0, 0.0, 0.0);
-
-	while (vec.isZero())
+	glBindTexture(GL_TEXTURE_2D, *g_frameTexture);
+	if (frame.width() != g_frameTextureWidth || frame.height() != g_frameTextureHeight)
 	{
-		vec = Point(double(rand()) / (RAND_MAX + 1.0) - .5,
-				double(rand()) / (RAND_MAX + 1.0) - .5,
-				double(rand()) / (RAND_MAX + 1.0) - .5);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, frame.width(), frame.height(), 0,
+				GL_RGB, GL_FLOAT, 0);
+		g_frameTextureWidth = frame.width();
+		g_frameTextureHeight = frame.height();
 	}
-	vec.normalize(); //push out to unit sphere
-
-	return vec;
-}
-
-/*
- PURPOSE: calculates how much light intensities will decay with distance
- RECEIVES: distance -- to use
- RETURNS: decimal value between 0 and 1 by which an intensity at the given distance
- would be reduced
- REMARKS:
- */
-inline GLdouble attenuate(GLdouble distance)
-{
-	return ATTENUATION_FACTOR / (ATTENUATION_FACTOR + distance * distance);
-}
-
-/*
- PURPOSE: Does ray tracing of a single ray in a scene according to the supplied lights to the perscribed
- depth
- RECEIVES:
- scene -- Shape to do ray-tracing one
- lights -- Light's which are lighting the scene
- ray -- to be used for ray-tracing consists of two points (starting point to do ray-tracing from plus
- another point which together give the direction of the initial ray.)
- color -- used to store the color returned by doing the ray tracing
- depth -- in terms of tree of sub-rays we calculate
- RETURNS:  Nothing
- REMARKS:
- */
-void traceRay(Shape& scene, vector<Light> lights, const Line& ray, Point& color,
-		unsigned int depth)
-{
-	Intersection intersection;
-	scene.doIIntersectWith(ray, Point(0.0, 0.0, 0.0), intersection);
 
-	if (!intersection.intersects())
-		return;
-
-	Point pt = intersection.point();
-	Material material = intersection.material();
-	Line reflectedRay = intersection.reflectedRay();
-	Line transmittedRay = intersection.transmittedRay();
-	Line shadowRay;
-	Point lColor;
-
-	size_t size = lights.size();
-	for (size_t i = 0; i < size; i++)
-	{
-		shadowRay.set(pt, lights[i].position());
-		Intersection shadowIntersection;
-
-		scene.doIIntersectWith(shadowRay, Point(0.0, 0.0, 0.0), shadowIntersection);
-
-		if (!shadowIntersection.intersects()
-				|| !shadowIntersection.material().transparency().isZero())
-		{
-			lColor = attenuate(shadowRay.length()) * lights[i].color();
-			color += (material.ambient() % lColor)
-					+ abs(intersection.normal() & shadowRay.direction())
-							* (material.diffuse() % lColor)
-					+ abs(ray.direction() & reflectedRay.direction())
-							* (material.specular() % lColor);
-		}
-	}
-
-	if (depth > 0)
-	{
-		Point transmittedColor(0.0, 0.0, 0.0);
-		Point reflectedColor(0.0, 0.0, 0.0);
-
-		Point transparency = material.transparency();
-		Point opacity = Point(1.0, 1.0, 1.0) - transparency;
-
-		if (!transparency.isZero() && transparency.length() > SMALL_NUMBER) //if not transparent then don't send ray
-		{
-			traceRay(scene, lights, transmittedRay, transmittedColor, depth - 1);
-			color += (transparency % transmittedColor);
-		}
-		if (!opacity.isZero()) // if completely transparent don't send reflect ray
-		{
-			traceRay(scene, lights, reflectedRay, reflectedColor, depth - 1);
-			color += (opacity % reflectedColor);
-		}
-	}
-}
-
-/*
- PURPOSE: Does the ray-tracing scene objects according to the supplied lights, camera dimension and screen dimensions
- RECEIVES:
- scene --  Shape to be ray-traced (Shapes use the Composite pattern so are made of sub-shapes
- light -- a vector of Light's used to light the scene
- camera -- location of the viewing position
- lookat -- where one is looking at from this position
- up -- what direction is up from this position
- bottomX -- how far to the left from the lookat point is the start of the screen
- bottomy -- how far down from the lookat point is the start of the screen
- width -- width of the screen
- height -- height of the screen
- RETURNS:  Nothing
- REMARKS:
- */
-void traceRayScreen(Shape& scene, vector<Light>& lights, Point camera,
-		Point lookAt, Point up, int bottomX, int bottomY, int width, int height)
-{
-	Point lookDirection = lookAt - camera;
-	Point right = lookDirection * up;
-
-	right.normalize();
-	Point rightOffset = width * right;
-
-	up = right * lookDirection;
-	up.normalize();
-
-	Point screenPt = lookAt + bottomX * right + bottomY * up;
-
-	Line ray;
-	Point color(0.0, 0.0, 0.0);
-	Point avgColor(0.0, 0.0, 0.0);
-
-	Point weightedColor(0.0, 0.0, 0.0);
-	Point oldWeightedColor(0.0, 0.0, 0.0);
-	GLdouble k;
-
-	glBegin(GL_POINTS);
-	for (int j = 0; j < height; j++)
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, *g_framePbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, frame.byteSize(), 0, GL_STREAM_DRAW);
+	void *dst = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+	if (dst)
 	{
-		for (int i = 0; i < width; i++)
-		{
-			for (k = 0.0; k < SUPER_SAMPLE_NUMBER; k++)
-			{
-				ray.set(camera, screenPt + .5 * randomlyPoint());
-
-				color.set(0.0, 0.0, 0.0);
-
-				traceRay(scene, lights, ray, color, MAX_DEPTH);
-
-				oldWeightedColor = (k + 1.0) * avgColor;
-
-				avgColor += color;
-
-				weightedColor = k * avgColor;
-				if ((weightedColor - oldWeightedColor).length()
-						< SMALL_NUMBER * k * (k + 1))
-					break;
-			}
-
-			avgColor /= k;
-			glColor3d(avgColor.x(), avgColor.y(), avgColor.z());
-
-			glVertex2i(i, j);
-			screenPt += right;
-		}
-		screenPt -= rightOffset;
-		screenPt += up;
+		memcpy(dst, frame.data(), frame.byteSize());
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, frame.width(), frame.height(),
+				GL_RGB, GL_FLOAT, 0);
 	}
-	glEnd();
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	// quad already spans clip space, just push it off the far plane
+	glUseProgram(g_presentShader->program);
+	sendProjectionMatrix(*g_presentShader, Matrix4());
+	sendGeometry(*g_presentShader, Matrix4::makeTranslation(Cvec3(0.0, 0.0, -1.0)));
+	glActiveTexture(GL_TEXTURE0);
+	safe_glUniform1i(g_presentTexUnit, 0);
+	g_screenQuad->draw(*g_presentShader);
+	checkGlErrors();
 }
 
+/*---------------------------------------------------------------------------*/
+/* FUNCTIONS */
 /*
  PURPOSE: Converts a string of two characters of the form:
  letter row + number color (for example, b4) into coordinates for a piece of
@@ -403,10 +260,13 @@ Point stringToCoord(string str)
  */
 void showObjectsMenu()
 {
+	// objects replaced here stay in the arena until the scene goes
+	ArenaScope inArena(sceneArena);
+
 	//make objects
 	string tmp;
 	int found = 0; //used to break out of loop
-	vector<RayObject *>::iterator it;
+	Shape::SubObjects::iterator it;
 	vector<Light>::iterator it2;
 	while (tmp != "done")
 	{
@@ -542,7 +402,7 @@ void showObjectsMenu()
 		else if (tmp == "cone")
 		{
 		 redoMenu = 1;
-			cout << "enter the position of the cube:\n";
+			cout << "enter the position of the cone:\n";
 			cin >> tmp;
 
 		 for (it = scene.subObject().begin(); it != scene.subObject().end();)
@@ -564,14 +424,14 @@ void showObjectsMenu()
 		 }
 		 found = 0;
 
-			Cube *cube = new Cube(stringToCoord(tmp), SQUARE_EDGE_SIZE);
-			scene.addRayObject(cube);
+			Cone *cone = new Cone(stringToCoord(tmp), SQUARE_EDGE_SIZE / 2, SQUARE_EDGE_SIZE);
+			scene.addRayObject(cone);
 		 
 		}
 		else if (tmp == "cylinder")
 		{
 		 redoMenu = 1;
-			cout << "enter the position of the cube:\n";
+			cout << "enter the position of the cylinder:\n";
 			cin >> tmp;
 
 		 for (it = scene.subObject().begin(); it != scene.subObject().end();)
@@ -593,16 +453,11 @@ void showObjectsMenu()
 		 }
 		 found = 0;
 
-			Cube *cube = new Cube(stringToCoord(tmp), SQUARE_EDGE_SIZE);
-			scene.addRayObject(cube);
+			Cylinder *cylinder = new Cylinder(stringToCoord(tmp), SQUARE_EDGE_SIZE / 2, SQUARE_EDGE_SIZE);
+			scene.addRayObject(cylinder);
 		 
 		}
 	}
-
-	glViewport(0, 0, winWidth, winHeight);
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	gluOrtho2D(0, winWidth, 0, winHeight);
 }
 
 /* PURPOSE: clear framebuffer color & depth.
@@ -619,30 +474,114 @@ void SdlApp::clearCanvas()
  PURPOSE: Used to craw the complete ray-traced chessboard
  RECEIVES: Nothing
  RETURNS:  Nothing
- REMARKS:
+ REMARKS: the CPU tracer adds one pass of samples per call rather than tracing the whole
+ frame, so run's loop shows the picture sharpening; see ProgressiveRenderer
  */
 void SdlApp::draw()
 {
-	/*
-	traceRayScreen(scene, lights, Point(CAMERA_POSITION), Point(LOOK_AT_VECTOR),
-			Point(UP_VECTOR), -winWidth / 2, -winHeight / 2, winWidth, winHeight);
-	*/
-	glUseProgram(g_shader->program);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	drawStuff();
+	if (g_useCpuTracer)
+	{
+		// one more pass per frame, until the picture stops changing
+		if (g_progressive.refine(compiledScene, lights, g_camera.position,
+				g_camera.lookAt, g_camera.up, -g_frame.width() / 2,
+				-g_frame.height() / 2, g_frame, *g_renderPool, g_sampling)
+				&& g_progressive.converged())
+		{
+			cout << "Frame converged after " << g_progressive.passes() << " passes in "
+					<< g_progressive.elapsedMillis() << " ms, "
+					<< g_progressive.restartedPixels() << " pixels traced anew" << endl;
+			if (g_sampleMapFile)
+				writeSampleMap(g_frame, g_sampling.edgeSamples, g_sampleMapFile);
+			if (g_countersFile && !collectTraceCounters().write(g_countersFile))
+				cerr << "couldn't write " << g_countersFile << endl;
+		}
+		presentFrame(g_frame);
+	}
+	else
+	{
+		glUseProgram(g_shader->program);
+		drawStuff();
+	}
     
 	SDL_GL_SwapWindow(display);
 	checkGlErrors();
 	
 }
 
+/*
+ PURPOSE: recompiles compiledScene after scene has been changed
+ RECEIVES: Nothing
+ RETURNS: Nothing
+ REMARKS: reports what the scene compiled to and how long that and the BVH took
+ */
+void compileScene()
+{
+	compiledScene.compile(scene);
+	cout << "Scene: " << compiledScene.triangleCount() << " triangles, "
+			<< compiledScene.sphereCount() << " spheres, "
+			<< compiledScene.boxCount() << " boxes, "
+			<< compiledScene.coneCount() << " cones, "
+			<< compiledScene.boardCount() << " boards, "
+			<< compiledScene.instanceCount() << " instances of "
+			<< compiledScene.prototypeCount() << " prototypes, "
+			<< compiledScene.materialCount() << " materials compiled in "
+			<< compiledScene.compileMillis() << " ms" << endl;
+	cout << "BVH: " << compiledScene.nodeCount() << " nodes built in "
+			<< compiledScene.buildMillis() << " ms" << endl;
+}
+
 void makeObjects()
 {
+	ArenaScope inArena(sceneArena);
+	if (g_sceneFile)
+	{
+		SceneFileStats stats;
+		try
+		{
+			loadSceneFile(g_sceneFile, scene, lights, g_camera, stats);
+		}
+		catch (const exception& e)
+		{
+			cerr << e.what() << endl;
+			exit(1);
+		}
+		cout << "Scene file: " << stats.objects << " objects, " << stats.lights
+				<< " lights, " << stats.materials << " materials, " << stats.bytes
+				<< " bytes loaded in " << stats.millis << " ms" << endl;
+
+		// the objects are still needed to draw the scene, but the compiled scene and its
+		// BVH can come straight from the cache
+		if (g_cacheDir)
+		{
+			string cacheFile = SceneCache::path(g_cacheDir, stats.hash);
+			vector<Light> cachedLights;
+			SceneCamera cachedCamera;
+			if (SceneCache::load(cacheFile.c_str(), stats.hash, compiledScene, cachedLights,
+					cachedCamera))
+			{
+				cout << "Scene: " << compiledScene.triangleCount() << " triangles, "
+						<< compiledScene.nodeCount() << " BVH nodes mapped from " << cacheFile
+						<< endl;
+				return;
+			}
+			compileScene();
+			if (!SceneCache::save(cacheFile.c_str(), stats.hash, compiledScene, lights,
+					g_camera))
+				cerr << "Couldn't write scene cache " << cacheFile << endl;
+			return;
+		}
+		compileScene();
+		return;
+	}
+
 	//make board
 	scene.addRayObject(new CheckerBoard(Point(0, 0, 0)));
 
 	//make objects
 	//showObjectsMenu();
+
+	compileScene();
 }
 
 static void initPlane()
@@ -656,6 +595,24 @@ static void initPlane()
 
     makePlane(1.1, vtx.begin(), idx.begin());
     g_plane =  new Geometry(&vtx[0], &idx[0], vbLen, ibLen);
+
+    // plane of size 2 covers all of clip space, used to present the CPU traced frame
+    makePlane(2.0, vtx.begin(), idx.begin());
+    g_screenQuad = new Geometry(&vtx[0], &idx[0], vbLen, ibLen);
+}
+
+static void initFrame()
+{
+    g_frame.resize(winWidth, winHeight);
+    g_progressive.setRecordPaths(true);
+    g_frameTexture = new GlTexture();
+    g_framePbo = new GlBufferObject();
+
+    glBindTexture(GL_TEXTURE_2D, *g_frameTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 }
 
 static void initGLState()
@@ -700,13 +657,19 @@ SdlApp::SdlApp()
 
 	makeShaders();
 	initPlane();
+	initFrame();
 	makeObjects();
+	g_renderPool = new ThreadPool();
 	//makeTextures();
 }
 
 void SdlApp::makeShaders() {
 	g_shader = new ShaderState(G_SHADER_FILES[0],
 		                         G_SHADER_FILES[1]);
+	g_presentShader = new ShaderState(G_PRESENT_SHADER_FILES[0],
+		                                G_PRESENT_SHADER_FILES[1]);
+	g_presentTexUnit = safe_glGetUniformLocation(g_presentShader->program,
+		                                           "uTexUnit0");
 	/*
 	for (int i = 0; i < G_NUM_SHADERS; ++i) {
 		
@@ -721,6 +684,12 @@ void SdlApp::handleEvent(SDL_Event *event) {
 	if (event->type ==  SDL_QUIT) {
 		running = false;
 	}
+	else if (event->type == SDL_KEYDOWN && event->key.keysym.sym == SDLK_m) {
+		// edit the scene on the console; the CPU tracer then only redoes the pixels
+		// which could see what changed
+		showObjectsMenu();
+		compileScene();
+	}
 }
 
 /* PURPOSE: Executes the SDL application. Loops until event to quit.
@@ -742,7 +711,67 @@ int SdlApp::run()
 	return 0;
 }
 
+// prints the command line options; returns the exit status for a bad command line
+static int usage(const char *program)
+{
+	cerr << "usage: " << program << " [-cpu] [-error e] [-contrast c] [-samplemap file]"
+			<< " [-sampler random|halton|sobol|bluenoise] [-scene file] [-cache dir]"
+			<< " [-counters file]" << endl;
+	return 1;
+}
+
 int main(int argc, char **argv)
 {
+	// -cpu: show the CPU ray tracer's output rather than the shader one
+	// -error e: standard error at which the CPU tracer stops sampling a pixel
+	// -contrast c: colour difference to a neighbour which makes a pixel an edge
+	// -samplemap file: write the number of samples of each pixel to a PPM
+	// -sampler random|halton|sobol|bluenoise: where the CPU tracer puts samples in a pixel
+	// -scene file: load the scene from a scene file, see SceneFile.h
+	// -cache dir: keep compiled scene files in dir, see SceneCache.h
+	// -counters file: write what the CPU tracer did for each frame, see Counters.h
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (arg == "-cpu")
+			g_useCpuTracer = true;
+		else if (arg == "-error" && i + 1 < argc)
+			g_sampling.errorThreshold = atof(argv[++i]);
+		else if (arg == "-contrast" && i + 1 < argc)
+			g_sampling.contrastThreshold = atof(argv[++i]);
+		else if (arg == "-samplemap" && i + 1 < argc)
+			g_sampleMapFile = argv[++i];
+		else if (arg == "-scene" && i + 1 < argc)
+			g_sceneFile = argv[++i];
+		else if (arg == "-cache" && i + 1 < argc)
+			g_cacheDir = argv[++i];
+		else if (arg == "-counters" && i + 1 < argc)
+		{
+			g_countersFile = argv[++i];
+#ifndef TRACE_COUNTERS
+			cerr << "not counting; build with make COUNTERS=1 to use -counters" << endl;
+#endif
+		}
+		else if (arg == "-sampler" && i + 1 < argc)
+		{
+			string name = argv[++i];
+			if (name == "random")
+				g_sampling.sampler = RANDOM_SAMPLER;
+			else if (name == "halton")
+				g_sampling.sampler = HALTON_SAMPLER;
+			else if (name == "bluenoise")
+				g_sampling.sampler = BLUE_NOISE_SAMPLER;
+			else if (name == "sobol")
+				g_sampling.sampler = SOBOL_SAMPLER;
+			else
+			{
+				cerr << "unknown sampler " << name << endl;
+				return usage(argv[0]);
+			}
+		}
+		else
+			return usage(argv[0]);
+	}
+
 	return SdlApp().run();
 }
@@ -6,6 +6,7 @@
 #include <cmath>
 #include <memory>
 #include <stdexcept>
+#include <cstring>
 #if __GNUG__
 #	include <tr1/memory>
 #endif
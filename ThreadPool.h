@@ -0,0 +1,233 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <exception>
+
+/*
+ PURPOSE: a fixed set of worker threads used to run batches of independent tasks
+ (for us, screen tiles to be ray-traced)
+ REMARK:
+ Every worker owns a deque of task indices. A worker takes work from the back of its
+ own deque and, once that is empty, steals from the front of the other workers' deques,
+ so a worker that drew cheap tiles helps out one that drew expensive ones.
+ The thread calling run() acts as worker 0, so a pool of size 1 spawns no threads
+ at all and run() degenerates into a plain loop on the calling thread.
+ */
+class ThreadPool
+{
+public:
+   typedef std::function<void(size_t task, unsigned worker)> Task;
+
+private:
+   struct WorkQueue
+   {
+      std::mutex lock;
+      std::deque<size_t> tasks;
+   };
+
+   std::vector<std::thread> _threads;
+   std::vector<WorkQueue> _queues;
+
+   std::mutex _lock;
+   std::condition_variable _wake; // signalled when a new batch is posted
+   std::condition_variable _done; // signalled when a worker finishes draining
+   const Task *_task;
+   unsigned _generation;
+   unsigned _active;
+   size_t _remaining;
+   std::exception_ptr _error; // first exception a task of the batch threw
+   bool _stopping;
+
+   ThreadPool(const ThreadPool&);
+   ThreadPool& operator=(const ThreadPool&);
+
+   bool popLocal(unsigned worker, size_t& task)
+   {
+      WorkQueue& q = _queues[worker];
+      std::lock_guard<std::mutex> guard(q.lock);
+      if (q.tasks.empty())
+         return false;
+      task = q.tasks.back();
+      q.tasks.pop_back();
+      return true;
+   }
+
+   bool steal(unsigned worker, size_t& task)
+   {
+      size_t n = _queues.size();
+      for (size_t k = 1; k < n; k++)
+      {
+         WorkQueue& q = _queues[(worker + k) % n];
+         std::lock_guard<std::mutex> guard(q.lock);
+         if (!q.tasks.empty())
+         {
+            task = q.tasks.front();
+            q.tasks.pop_front();
+            return true;
+         }
+      }
+      return false;
+   }
+
+   /*
+    PURPOSE: run tasks until neither our own deque nor anybody else's has any left
+    RECEIVES: worker -- index of the worker doing the draining
+    RETURNS: nothing
+    REMARKS: _task is published before any index is pushed, and pushes/pops go through
+    the queue mutexes, so once we hold an index the matching _task is visible. A task
+    which throws still counts as finished; the first exception is kept for run() to
+    rethrow once the batch is done.
+    */
+   void drain(unsigned worker)
+   {
+      size_t task;
+      size_t finished = 0;
+      std::exception_ptr error;
+      while (popLocal(worker, task) || steal(worker, task))
+      {
+         try
+         {
+            (*_task)(task, worker);
+         }
+         catch (...)
+         {
+            if (!error)
+               error = std::current_exception();
+         }
+         finished++;
+      }
+      if (finished > 0)
+      {
+         std::lock_guard<std::mutex> guard(_lock);
+         _remaining -= finished;
+         if (error && !_error)
+            _error = error;
+      }
+   }
+
+   void workerLoop(unsigned worker)
+   {
+      unsigned seen = 0;
+      std::unique_lock<std::mutex> guard(_lock);
+      while (true)
+      {
+         _wake.wait(guard, [&] { return _stopping || _generation != seen; });
+         if (_stopping)
+            return;
+         seen = _generation;
+         _active++;
+         guard.unlock();
+
+         drain(worker);
+
+         guard.lock();
+         _active--;
+         _done.notify_all();
+      }
+   }
+
+public:
+   /*
+    PURPOSE: constructs a pool with the given number of workers
+    RECEIVES: numThreads -- number of workers including the caller of run();
+    0 means one per hardware thread
+    RETURNS: a ThreadPool
+    REMARKS:
+    */
+   explicit ThreadPool(unsigned numThreads = 0) :
+         _queues(numThreads > 0 ? numThreads :
+               std::max(1u, std::thread::hardware_concurrency()))
+   {
+      _task = 0;
+      _generation = 0;
+      _active = 0;
+      _remaining = 0;
+      _stopping = false;
+
+      for (unsigned w = 1; w < _queues.size(); w++)
+         _threads.push_back(std::thread(&ThreadPool::workerLoop, this, w));
+   }
+
+   ~ThreadPool()
+   {
+      {
+         std::lock_guard<std::mutex> guard(_lock);
+         _stopping = true;
+      }
+      _wake.notify_all();
+      for (size_t i = 0; i < _threads.size(); i++)
+         _threads[i].join();
+   }
+
+   unsigned size() const
+   {
+      return _queues.size();
+   }
+
+   /*
+    PURPOSE: runs task(i, worker) for every i in [0, numTasks) and waits for all of them
+    RECEIVES:
+    numTasks -- how many tasks are in this batch
+    task -- function to call; gets the task index and the index of the worker running it
+    RETURNS: nothing
+    REMARKS: tasks are dealt out to the workers in contiguous runs, so if the caller has
+    sorted them for locality (e.g. tiles in Morton order) each worker starts on a compact
+    region of the work. Not reentrant: only one thread may call run() at a time. If
+    tasks throw, the rest of the batch still runs and the first exception is rethrown
+    here afterwards.
+    */
+   void run(size_t numTasks, const Task& task)
+   {
+      if (numTasks == 0)
+         return;
+
+      size_t n = _queues.size();
+      if (n == 1)
+      {
+         for (size_t i = 0; i < numTasks; i++)
+            task(i, 0);
+         return;
+      }
+
+      {
+         std::lock_guard<std::mutex> guard(_lock);
+         _task = &task;
+         _remaining = numTasks;
+      }
+      for (size_t w = 0; w < n; w++)
+      {
+         size_t begin = numTasks * w / n;
+         size_t end = numTasks * (w + 1) / n;
+         std::lock_guard<std::mutex> guard(_queues[w].lock);
+         // pushed in reverse so that popping from the back walks the run in order
+         for (size_t i = end; i > begin; i--)
+            _queues[w].tasks.push_back(i - 1);
+      }
+      {
+         std::lock_guard<std::mutex> guard(_lock);
+         _generation++;
+      }
+      _wake.notify_all();
+
+      drain(0);
+
+      std::unique_lock<std::mutex> guard(_lock);
+      _done.wait(guard, [&] { return _remaining == 0 && _active == 0; });
+      _task = 0;
+      if (_error)
+      {
+         std::exception_ptr error = _error;
+         _error = std::exception_ptr();
+         std::rethrow_exception(error);
+      }
+   }
+};
+
+#endif
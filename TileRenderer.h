@@ -0,0 +1,75 @@
+#ifndef TILERENDERER_H
+#define TILERENDERER_H
+
+#include <vector>
+#include <algorithm>
+
+const int TILE_SIZE = 16; // edge length in pixels of the tiles the screen is cut into
+
+/*
+ PURPOSE: a rectangular block of pixels [x0, x1) x [y0, y1) handed to one worker as a unit
+ REMARK: code is the Morton (Z-order) index of the tile, used to sort tiles so that
+ consecutive tiles are spatial neighbours and touch the same parts of the scene
+ */
+struct Tile
+{
+   int x0, y0;
+   int x1, y1;
+   unsigned int code;
+};
+
+/*
+ PURPOSE: spreads the low 16 bits of v out so there is a zero bit between each of them
+ RECEIVES: v -- value to spread
+ RETURNS: the spread value
+ REMARKS: standard bit-twiddling step for building Morton codes
+ */
+inline unsigned int spreadBits(unsigned int v)
+{
+   v &= 0x0000ffff;
+   v = (v | (v << 8)) & 0x00ff00ff;
+   v = (v | (v << 4)) & 0x0f0f0f0f;
+   v = (v | (v << 2)) & 0x33333333;
+   v = (v | (v << 1)) & 0x55555555;
+   return v;
+}
+
+inline unsigned int mortonCode(unsigned int x, unsigned int y)
+{
+   return spreadBits(x) | (spreadBits(y) << 1);
+}
+
+inline bool tileCodeLess(const Tile& a, const Tile& b)
+{
+   return a.code < b.code;
+}
+
+/*
+ PURPOSE: cuts a width x height screen into tiles of at most tileSize x tileSize pixels
+ RECEIVES:
+ width, height -- dimensions of the screen in pixels
+ tileSize -- edge length of a tile
+ RETURNS: the tiles sorted in Morton order
+ REMARKS: tiles on the right and top border are clipped to the screen
+ */
+inline std::vector<Tile> makeTiles(int width, int height, int tileSize = TILE_SIZE)
+{
+   std::vector<Tile> tiles;
+   for (int ty = 0; ty * tileSize < height; ty++)
+   {
+      for (int tx = 0; tx * tileSize < width; tx++)
+      {
+         Tile tile;
+         tile.x0 = tx * tileSize;
+         tile.y0 = ty * tileSize;
+         tile.x1 = std::min(tile.x0 + tileSize, width);
+         tile.y1 = std::min(tile.y0 + tileSize, height);
+         tile.code = mortonCode(tx, ty);
+         tiles.push_back(tile);
+      }
+   }
+   std::sort(tiles.begin(), tiles.end(), tileCodeLess);
+   return tiles;
+}
+
+#endif
@@ -148,3 +148,17 @@ void readAndCompileShader(GLuint programHandle, const char
 
    linkShader(programHandle, vs, fs);
 }
+
+void writePpmScreenshot(const int width, const int height, const char *filename)
+{
+   vector<char> image(width*height * 3);
+
+   glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &image[0]);
+
+   ofstream f(filename, ios::binary);
+   f << "P6 " << width << " " << height << " 255\n";
+   for (int i = 0; i < height; ++i)
+   {
+      f.write(&image[3 * width*(height - 1 - i)], 3 * width);
+   }
+}
@@ -13,7 +13,7 @@ void checkGlErrors();
 // Reads and compiles a pair of vertex shader and fragment shader files into a
 // GL shader program. Throws runtime_error on error
 void readAndCompileShader(GLuint programHandle,
-   const char *vertexShaderFileName, const char *fragmentShaderFileName, std::string);
+   const char *vertexShaderFileName, const char *fragmentShaderFileName);
 
 // Link two compiled vertex shader and fragment shader into a GL shader program
 void linkShader(GLuint programHandle, GLuint vertexShaderHandle, 
@@ -23,6 +23,10 @@ GLuint fragmentShaderHandle);
 // shader. Throws runtime_error on error
 void readAndCompileSingleShader(GLuint shaderHandle, const char* shaderFileName);
 
+// Reads the pixels of the GL framebuffer and writes them to a binary PPM file
+void writePpmScreenshot(const int width, const int height,
+const char *filename);
+
 // Classes inheriting Noncopyable will not have default compiler generated copy
 // constructor and assignment operator
 class Noncopyable
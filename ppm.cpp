@@ -6,26 +6,11 @@
 #include <vector>
 #include <string>
 #include <stdexcept>
-#include <GL/glew.h>
 
 #include "ppm.h"
 
 using namespace std;
 
-void writePpmScreenshot(const int width, const int height, const char *filename)
-{
-   vector<char> image(width*height * 3);
-
-   glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &image[0]);
-
-   ofstream f(filename, ios::binary);
-   f << "P6 " << width << " " << height << " 255\n";
-   for (int i = 0; i < height; ++i)
-   {
-      f.write(&image[3 * width*(height - 1 - i)], 3 * width);
-   }
-}
-
 // Read one positive integer from a (text) file. Line beginning with
 // "#" are ignored as comments.
 static int ppmReadInteger(istream& is)
@@ -126,4 +111,21 @@ std::vector<PackedPixel>& pixels)
          }
       }
    }
-}
\ No newline at end of file
+}
+
+//Writes pixels to a binary PPM, top row first as the format wants.
+void ppmWrite(const char *filename, int width, int height,
+const std::vector<PackedPixel>& pixels)
+{
+   ofstream f(filename, ios::binary);
+   if (!f.is_open())
+      throw runtime_error(string("ppmWrite: Cannot open file ") + filename
+      + " for write");
+
+   f << "P6 " << width << " " << height << " 255\n";
+   for (int row = height - 1; row >= 0; row--)
+   {
+      f.write(reinterpret_cast<const char*>(&pixels[row * width]), width
+      * sizeof(PackedPixel));
+   }
+}
@@ -3,10 +3,6 @@
 
 #include <vector>
 
-void writePpmScreenshot(const int width, const int height, 
-const char *filename);
-
-
 // A 3-byte structure storing R,G,B value of a pixel
 struct PackedPixel
 {
@@ -18,4 +14,9 @@ struct PackedPixel
 void ppmRead(const char *filename, int& width, int& height, 
 std::vector<PackedPixel>& pixels);
 
+// Writes `pixels', laid out as ppmRead returns them (bottom row first), to a
+// binary PPM file. Throws an exception on error.
+void ppmWrite(const char *filename, int width, int height,
+const std::vector<PackedPixel>& pixels);
+
 #endif